@@ -22,6 +22,8 @@ if %errorlevel% neq 0 exit /b 1
 if %errorlevel% neq 0 exit /b 1
 %CLExe% %HereDir%/libs/xxxx_tasks.c %CLCommonFlags%
 if %errorlevel% neq 0 exit /b 1
+%CLExe% %HereDir%/libs/xxxx_thread.c %CLCommonFlags%
+if %errorlevel% neq 0 exit /b 1
 %CLExe% %HereDir%/libs/xxxx_iobuffer.c %CLCommonFlags% -D_CRT_SECURE_NO_WARNINGS
 if %errorlevel% neq 0 exit /b 1
 %CLExe% %HereDir%/libs/xxxx_queue.c %CLCommonFlags% -wd4221
@@ -1362,6 +1362,11 @@ Mu_Bool Mu_LoadImage(const char *filename, struct Mu_Image *d_image)
 #include <AudioToolbox/ExtendedAudioFile.h>
 
 Mu_Bool Mu_LoadAudio(const char *filename, struct Mu_AudioBuffer *audio)
+{
+     return Mu_LoadAudioProgressive(filename, audio, NULL, NULL);
+}
+
+Mu_Bool Mu_LoadAudioProgressive(const char *filename, struct Mu_AudioBuffer *audio, Mu_AudioLoadCallback callback, void *user)
 {
      ExtAudioFileRef audiofile;
      /* open audio file */ {
@@ -1405,7 +1410,16 @@ Mu_Bool Mu_LoadAudio(const char *filename, struct Mu_AudioBuffer *audio)
                .bytes_per_sample = desc.mBitsPerChannel/8,
           };
      }
+     size_t expected_samples_count = 0;
+     /* fetch length */ {
+          SInt64 frames_n = 0;
+          UInt32 size = sizeof frames_n;
+          if (ExtAudioFileGetProperty(audiofile, kExtAudioFileProperty_FileLengthFrames, &size, &frames_n) == noErr && frames_n > 0) {
+               expected_samples_count = (size_t)frames_n * format.channels;
+          }
+     }
      int dest_buffer_capacity = 4096;
+     while (dest_buffer_capacity < expected_samples_count) dest_buffer_capacity *= 2;
      int dest_buffer_n = 0;
      int16_t *dest_buffer = (int16_t*)malloc(dest_buffer_capacity * sizeof *dest_buffer);
      /* read all and convert */ {
@@ -1428,7 +1442,20 @@ Mu_Bool Mu_LoadAudio(const char *filename, struct Mu_AudioBuffer *audio)
                          ++s_sample;
                     }
                }
+               size_t samples_f = dest_buffer_n;
                dest_buffer_n += read_samples_n;
+               if (callback) {
+                    struct Mu_AudioBuffer decoded = {
+                         .samples = dest_buffer,
+                         .samples_count = dest_buffer_n,
+                         .format = {
+                              .samples_per_second = format.samples_per_second,
+                              .channels = format.channels,
+                              .bytes_per_sample = (sizeof *dest_buffer),
+                         },
+                    };
+                    callback(user, &decoded, samples_f, expected_samples_count);
+               }
           }
           free(in_buffer), in_buffer = NULL, in_buffer_capacity = 0;
           ExtAudioFileDispose(audiofile);
@@ -941,6 +941,14 @@ done:
 static bool mf_initialized;
 
 Mu_Bool Mu_LoadAudio(const char* filename, Mu_AudioBuffer* audio)
+{
+  return Mu_LoadAudioProgressive(filename, audio, 0, 0);
+}
+
+Mu_Bool Mu_LoadAudioProgressive(const char* filename,
+                                Mu_AudioBuffer* audio,
+                                Mu_AudioLoadCallback callback,
+                                void* user)
 {
   HRESULT hr = 0;
   Mu_Bool result = MU_FALSE;
@@ -982,8 +990,28 @@ Mu_Bool Mu_LoadAudio(const char* filename, Mu_AudioBuffer* audio)
   {
     goto done;
   }
+  size_t expected_samples_count = 0;
+  {
+    PROPVARIANT duration;
+    PropVariantInit(&duration);
+    if (source_reader->GetPresentationAttribute(
+          MF_SOURCE_READER_MEDIASOURCE, MF_PD_DURATION, &duration)
+          >= 0
+        && duration.vt == VT_UI8)
+    {
+      // duration is in 100ns units
+      uint64_t frames_count = duration.uhVal.QuadPart
+                              * mu_audio_format.samples_per_second / 10000000ull;
+      expected_samples_count = (size_t)frames_count * mu_audio_format.channels;
+    }
+    PropVariantClear(&duration);
+  }
   size_t buffer_capacity = mu_audio_format.samples_per_second
                            * mu_audio_format.bytes_per_sample; // 1 second of audio
+  if (buffer_capacity < expected_samples_count * mu_audio_format.bytes_per_sample)
+  {
+    buffer_capacity = expected_samples_count * mu_audio_format.bytes_per_sample;
+  }
   size_t buffer_size = 0;
   char* buffer = (char*)malloc(buffer_capacity);
   for (;;)
@@ -1023,10 +1051,20 @@ Mu_Bool Mu_LoadAudio(const char* filename, Mu_AudioBuffer* audio)
     BYTE* sample_buffer_pointer;
     sample_buffer->Lock(&sample_buffer_pointer, 0, 0);
     CopyMemory(buffer + buffer_size, sample_buffer_pointer, sample_buffer_size);
+    size_t samples_f = buffer_size / mu_audio_format.bytes_per_sample;
     buffer_size += sample_buffer_size;
     sample_buffer->Unlock();
     sample_buffer->Release();
     sample->Release();
+    if (callback)
+    {
+      Mu_AudioBuffer decoded = {
+        (int16_t*)buffer,
+        buffer_size / mu_audio_format.bytes_per_sample,
+        mu_audio_format,
+      };
+      callback(user, &decoded, samples_f, expected_samples_count);
+    }
   }
   audio->format = mu_audio_format;
   audio->samples = (int16_t*)realloc(buffer, buffer_size);
@@ -0,0 +1,210 @@
+#ifndef XXXX_ATOMIC
+#define XXXX_ATOMIC
+
+/*
+ * @lang: c99
+ * @platform: win32 (x86/x64), gcc/clang
+ *
+ * Atomic operations on plain integers and pointers, for data shared between threads.
+ *
+ * Loads have acquire semantics, stores have release semantics and read-modify-write
+ * operations are sequentially consistent. This is what is needed to publish data
+ * written by one thread to another: write the data, then store the index/flag; read
+ * the index/flag, then read the data.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+
+// On x86/x64 aligned volatile accesses are atomic and ordered (TSO), we only need to
+// prevent compiler reordering.
+
+static inline uint32_t atomic_load_uint32(uint32_t const* s_x)
+{
+  uint32_t x = *(uint32_t const volatile*)s_x;
+  _ReadWriteBarrier();
+  return x;
+}
+
+static inline void atomic_store_uint32(uint32_t* d_y, uint32_t x)
+{
+  _ReadWriteBarrier();
+  *(uint32_t volatile*)d_y = x;
+}
+
+// returns the previous value
+static inline uint32_t atomic_fetch_add_uint32(uint32_t* d_y, uint32_t x)
+{
+  return (uint32_t)_InterlockedExchangeAdd((long volatile*)d_y, (long)x);
+}
+
+// returns the previous value
+static inline uint32_t atomic_exchange_uint32(uint32_t* d_y, uint32_t x)
+{
+  return (uint32_t)_InterlockedExchange((long volatile*)d_y, (long)x);
+}
+
+// stores `desired` if `*d_y == *expected`, otherwise loads `*d_y` into `*expected`
+static inline bool atomic_compare_exchange_uint32(uint32_t* d_y,
+                                                  uint32_t* expected,
+                                                  uint32_t desired)
+{
+  uint32_t previous = (uint32_t)_InterlockedCompareExchange(
+    (long volatile*)d_y, (long)desired, (long)*expected);
+  if (previous == *expected)
+    return true;
+  *expected = previous;
+  return false;
+}
+
+static inline uint64_t atomic_load_uint64(uint64_t const* s_x)
+{
+  uint64_t x = *(uint64_t const volatile*)s_x;
+  _ReadWriteBarrier();
+  return x;
+}
+
+static inline void atomic_store_uint64(uint64_t* d_y, uint64_t x)
+{
+  _ReadWriteBarrier();
+  *(uint64_t volatile*)d_y = x;
+}
+
+static inline uint64_t atomic_fetch_add_uint64(uint64_t* d_y, uint64_t x)
+{
+  return (uint64_t)_InterlockedExchangeAdd64((__int64 volatile*)d_y, (__int64)x);
+}
+
+static inline bool atomic_compare_exchange_uint64(uint64_t* d_y,
+                                                  uint64_t* expected,
+                                                  uint64_t desired)
+{
+  uint64_t previous = (uint64_t)_InterlockedCompareExchange64(
+    (__int64 volatile*)d_y, (__int64)desired, (__int64)*expected);
+  if (previous == *expected)
+    return true;
+  *expected = previous;
+  return false;
+}
+
+static inline void* atomic_load_ptr(void* const* s_x)
+{
+  void* x = *(void* const volatile*)s_x;
+  _ReadWriteBarrier();
+  return x;
+}
+
+static inline void atomic_store_ptr(void** d_y, void* x)
+{
+  _ReadWriteBarrier();
+  *(void* volatile*)d_y = x;
+}
+
+// returns the previous value
+static inline void* atomic_exchange_ptr(void** d_y, void* x)
+{
+  return _InterlockedExchangePointer((void* volatile*)d_y, x);
+}
+
+static inline void atomic_fence_seq_cst(void)
+{
+  _ReadWriteBarrier();
+  _mm_mfence();
+  _ReadWriteBarrier();
+}
+
+static inline void atomic_pause(void)
+{
+  _mm_pause();
+}
+
+#else
+
+static inline uint32_t atomic_load_uint32(uint32_t const* s_x)
+{
+  return __atomic_load_n(s_x, __ATOMIC_ACQUIRE);
+}
+
+static inline void atomic_store_uint32(uint32_t* d_y, uint32_t x)
+{
+  __atomic_store_n(d_y, x, __ATOMIC_RELEASE);
+}
+
+// returns the previous value
+static inline uint32_t atomic_fetch_add_uint32(uint32_t* d_y, uint32_t x)
+{
+  return __atomic_fetch_add(d_y, x, __ATOMIC_SEQ_CST);
+}
+
+// returns the previous value
+static inline uint32_t atomic_exchange_uint32(uint32_t* d_y, uint32_t x)
+{
+  return __atomic_exchange_n(d_y, x, __ATOMIC_SEQ_CST);
+}
+
+// stores `desired` if `*d_y == *expected`, otherwise loads `*d_y` into `*expected`
+static inline bool atomic_compare_exchange_uint32(uint32_t* d_y,
+                                                  uint32_t* expected,
+                                                  uint32_t desired)
+{
+  return __atomic_compare_exchange_n(
+    d_y, expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static inline uint64_t atomic_load_uint64(uint64_t const* s_x)
+{
+  return __atomic_load_n(s_x, __ATOMIC_ACQUIRE);
+}
+
+static inline void atomic_store_uint64(uint64_t* d_y, uint64_t x)
+{
+  __atomic_store_n(d_y, x, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t atomic_fetch_add_uint64(uint64_t* d_y, uint64_t x)
+{
+  return __atomic_fetch_add(d_y, x, __ATOMIC_SEQ_CST);
+}
+
+static inline bool atomic_compare_exchange_uint64(uint64_t* d_y,
+                                                  uint64_t* expected,
+                                                  uint64_t desired)
+{
+  return __atomic_compare_exchange_n(
+    d_y, expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static inline void* atomic_load_ptr(void* const* s_x)
+{
+  return __atomic_load_n(s_x, __ATOMIC_ACQUIRE);
+}
+
+static inline void atomic_store_ptr(void** d_y, void* x)
+{
+  __atomic_store_n(d_y, x, __ATOMIC_RELEASE);
+}
+
+// returns the previous value
+static inline void* atomic_exchange_ptr(void** d_y, void* x)
+{
+  return __atomic_exchange_n(d_y, x, __ATOMIC_SEQ_CST);
+}
+
+static inline void atomic_fence_seq_cst(void)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void atomic_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+#endif
+
+#endif
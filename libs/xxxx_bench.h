@@ -0,0 +1,67 @@
+#ifndef XXXX_BENCH
+#define XXXX_BENCH
+
+/*
+ * @lang: c99
+ *
+ * Prints benchmark results one per line, either as aligned text or, when the arguments
+ * contain `--json`, as a JSON document. The fields and their order do not change, so
+ * that results can be compared between runs.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef struct Bench
+{
+  bool is_json;
+  uint32_t results_n;
+} Bench;
+
+static inline Bench bench_begin(int argc, char const** argv)
+{
+  Bench bench = {0};
+  for (int arg_i = 0; arg_i < argc; arg_i++)
+  {
+    if (0 == strcmp(argv[arg_i], "--json"))
+      bench.is_json = true;
+  }
+  if (bench.is_json)
+    printf("{\"benchmarks\":[");
+  return bench;
+}
+
+// \param threads_n threads taking part in the measure
+// \param n operations measured
+// \param value the measure, in `unit`
+static inline void bench_result(Bench* bench,
+                                char const* name,
+                                uint32_t threads_n,
+                                uint64_t n,
+                                double value,
+                                char const* unit)
+{
+  if (bench->is_json)
+  {
+    printf("%s\n{\"name\":\"%s\",\"threads\":%u,\"n\":%llu,\"value\":%.3f,\"unit\":\"%s\"}",
+           bench->results_n ? "," : "", name, threads_n, (unsigned long long)n, value,
+           unit);
+  }
+  else
+  {
+    printf("%-32s threads=%-3u n=%-10llu %14.3f %s\n", name, threads_n,
+           (unsigned long long)n, value, unit);
+  }
+  bench->results_n++;
+}
+
+static inline void bench_end(Bench* bench)
+{
+  if (bench->is_json)
+    printf("\n]}\n");
+  fflush(stdout);
+}
+
+#endif
@@ -81,7 +81,7 @@ IOBUFFER_INTERNAL enum IOBufferError iobuffer_stdio_refill(IOBuffer* x)
     if (n == 0)
       return iobuffer_stdio_fail(x, IOBufferError_PastTheEnd);
     size_t fwrite_n = fwrite(x->bytes_f, n, 1, file_io_buffer->file);
-    if (fwrite_n != n)
+    if (fwrite_n != 1)
     {
       return iobuffer_stdio_fail(x, IOBufferError_IO);
     }
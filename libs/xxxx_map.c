@@ -3,9 +3,18 @@
 #include <assert.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SWISS_MAP_SSE2 1
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 static uint64_t pow2_ge_uint64(uint64_t x)
 {
   for (unsigned int i = 0;; i++)
@@ -34,18 +43,34 @@ static bool is_pow2_uint64(uint64_t x)
   return i == 64;
 }
 
+enum
+{
+  MAP_DISTANCE_MAX = UINT8_MAX, // the map grows rather than probing further
+};
+
+static void* map__calloc(Map const* map, size_t n, size_t size)
+{
+  if (map->allocator.calloc_fn)
+    return map->allocator.calloc_fn(map->allocator.allocator, n, size);
+  return calloc(n, size);
+}
+
 void map_grow(Map* map, size_t size)
 {
   size = pow2_ge_uint64(size);
   Map new_map = {
-    .keys = calloc(size, sizeof new_map.keys[0]),
-    .ptrs = malloc(size * sizeof new_map.ptrs[0]),
+    .keys = map__calloc(map, size, sizeof new_map.keys[0]),
+    .ptrs = map__calloc(map, size, sizeof new_map.ptrs[0]),
+    .distances = map__calloc(map, size, sizeof new_map.distances[0]),
     .cap = size,
+    .allocator = map->allocator,
   };
   if (!new_map.keys)
     exit(1);
   if (!new_map.ptrs)
     exit(1);
+  if (!new_map.distances)
+    exit(1);
 
   for (size_t i = 0; i < map->cap; i++)
   {
@@ -58,94 +83,465 @@ void map_grow(Map* map, size_t size)
   assert(is_pow2_uint64(new_map.cap));
   assert(new_map.len == map->len);
 
-  free(map->keys);
-  free(map->ptrs);
+  if (!map->allocator.calloc_fn)
+  {
+    free(map->keys);
+    free(map->ptrs);
+    free(map->distances);
+  }
 
   *map = new_map;
 }
 
 void map_free(Map* map)
 {
-  free(map->keys), map->keys = NULL;
-  free(map->ptrs), map->ptrs = NULL;
-  *map = (Map){0};
+  if (!map->allocator.calloc_fn)
+  {
+    free(map->keys), map->keys = NULL;
+    free(map->ptrs), map->ptrs = NULL;
+    free(map->distances), map->distances = NULL;
+  }
+  *map = (Map){.allocator = map->allocator};
 }
 
-// returns value at key
-void* map_get(Map const* map, uint64_t key)
+void map_clear(Map* map)
 {
-  assert(map->cap >= map->len);
+  if (map->cap)
+    memset(map->keys, 0, map->cap * sizeof map->keys[0]);
+  map->len = 0;
+}
+
+// returns the slot of key, or -1
+static ptrdiff_t map__find(Map const* map, uint64_t key)
+{
+  if (!key || map->len == 0)
+    return -1;
 
   size_t index = hash_uint64(key);
-  size_t rest = map->len;
-  while (rest > 0)
+  for (size_t distance = 0; distance <= MAP_DISTANCE_MAX; distance++, index++)
   {
-    index &= (map->cap - 1);
-    if (!map->keys[index])
-      return NULL;
+    index &= map->cap - 1;
+    // the key would have taken the slot of any entry closer to its own slot
+    if (!map->keys[index] || map->distances[index] < distance)
+      return -1;
     if (map->keys[index] == key)
-      return map->ptrs[index];
-    index++;
-    rest--;
+      return (ptrdiff_t)index;
   }
-  return NULL;
+  return -1;
+}
+
+// returns value at key
+void* map_get(Map const* map, uint64_t key)
+{
+  assert(map->cap >= map->len);
+  ptrdiff_t index = map__find(map, key);
+  return index < 0 ? NULL : map->ptrs[index];
 }
 
 // puts value in hasmapable, returns previous value
 void map_put(Map* map, uint64_t key, void* data)
 {
   assert(key); // key == 0 is disallowed, as it is the empty entry sentinel
-  if (map->cap == 0 || map->cap - map->len < map->len)
+  if (map->cap == 0 || map->len + 1 > map->cap - map->cap / 4)
   {
     map_grow(map, 1 + 2 * map->cap);
   }
 
   assert(is_pow2_uint64(map->cap));
   size_t index = hash_uint64(key);
-  size_t last = index;
-  do
+  size_t distance = 0;
+  bool is_displacing = false; // once true, `key` is another entry than the one put
+  for (;; distance++, index++)
   {
     index &= map->cap - 1;
     if (!map->keys[index])
     {
       map->keys[index] = key;
       map->ptrs[index] = data;
+      map->distances[index] = (uint8_t)distance;
       map->len++;
       return;
     }
-    else if (map->keys[index] == key)
+    if (!is_displacing && map->keys[index] == key)
+    {
+      map->ptrs[index] = data;
+      return;
+    }
+    if (map->distances[index] < distance)
     {
+      // take the slot, and carry on with its entry
+      uint64_t displaced_key = map->keys[index];
+      void* displaced_data = map->ptrs[index];
+      size_t displaced_distance = map->distances[index];
+      map->keys[index] = key;
       map->ptrs[index] = data;
+      map->distances[index] = (uint8_t)distance;
+      key = displaced_key;
+      data = displaced_data;
+      distance = displaced_distance;
+      is_displacing = true;
+    }
+    if (distance == MAP_DISTANCE_MAX)
+    {
+      map_grow(map, 2 * map->cap);
+      map_put(map, key, data);
       return;
     }
-    index++;
-  } while (index != last);
-  assert(0);
-  exit(1);
+  }
 }
 
 void map_remove(Map* map, uint64_t key)
 {
-  if (!key)
+  ptrdiff_t found_index = map__find(map, key);
+  if (found_index < 0)
     return;
+
+  // shift back the following entries, up to an empty slot or an entry in its own slot
+  size_t index = (size_t)found_index;
+  for (;;)
+  {
+    size_t next_index = (index + 1) & (map->cap - 1);
+    if (!map->keys[next_index] || map->distances[next_index] == 0)
+      break;
+    map->keys[index] = map->keys[next_index];
+    map->ptrs[index] = map->ptrs[next_index];
+    map->distances[index] = map->distances[next_index] - 1;
+    index = next_index;
+  }
+  map->keys[index] = 0;
+  map->len--;
+}
+
+enum
+{
+  SWISS_MAP_EMPTY = 0x80,
+  SWISS_MAP_DELETED = 0xfe,
+  // otherwise the control byte holds the low 7 bits of the hash
+};
+
+// bit i is set when the control byte i of the group equals `control`
+static uint32_t swiss_map__match(uint8_t const* group, uint8_t control)
+{
+#if SWISS_MAP_SSE2
+  __m128i controls = _mm_loadu_si128((__m128i const*)group);
+  __m128i matches = _mm_cmpeq_epi8(controls, _mm_set1_epi8((char)control));
+  return (uint32_t)_mm_movemask_epi8(matches);
+#else
+  uint32_t mask = 0;
+  for (uint32_t i = 0; i < SWISS_MAP_GROUP_SIZE; i++)
+  {
+    if (group[i] == control)
+      mask |= 1u << i;
+  }
+  return mask;
+#endif
+}
+
+// bit i is set when the slot i of the group is empty or deleted, the only control bytes
+// with their high bit set
+static uint32_t swiss_map__match_free(uint8_t const* group)
+{
+#if SWISS_MAP_SSE2
+  return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((__m128i const*)group));
+#else
+  uint32_t mask = 0;
+  for (uint32_t i = 0; i < SWISS_MAP_GROUP_SIZE; i++)
+  {
+    mask |= (uint32_t)(group[i] >> 7) << i;
+  }
+  return mask;
+#endif
+}
+
+static uint32_t swiss_map__first_bit(uint32_t mask)
+{
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return index;
+#else
+  return (uint32_t)__builtin_ctz(mask);
+#endif
+}
+
+// Visits the groups from the one of the hash, at increasing steps (1, 2, 3..), which
+// visits all of them when their number is a power of two.
+//
+// \return the slot of `key`, or -1
+static ptrdiff_t swiss_map__find(SwissMap const* map, uint64_t key, uint64_t hash)
+{
+  if (map->len == 0)
+    return -1;
+
+  size_t groups_mask = map->cap / SWISS_MAP_GROUP_SIZE - 1;
+  size_t group_i = (hash >> 7) & groups_mask;
+  for (size_t step = 1;; step++)
+  {
+    uint8_t const* group = &map->controls[group_i * SWISS_MAP_GROUP_SIZE];
+    for (uint32_t match = swiss_map__match(group, hash & 0x7f); match; match &= match - 1)
+    {
+      size_t slot_i = group_i * SWISS_MAP_GROUP_SIZE + swiss_map__first_bit(match);
+      if (map->entries[slot_i].key == key)
+        return (ptrdiff_t)slot_i;
+    }
+    // an insertion would have used this empty slot rather than probe further
+    if (swiss_map__match(group, SWISS_MAP_EMPTY))
+      return -1;
+    group_i = (group_i + step) & groups_mask;
+  }
+}
+
+// \pre `key` is absent and there is a free slot
+static void swiss_map__insert(SwissMap* map, uint64_t key, uint64_t hash, void* data)
+{
+  size_t groups_mask = map->cap / SWISS_MAP_GROUP_SIZE - 1;
+  size_t group_i = (hash >> 7) & groups_mask;
+  for (size_t step = 1;; step++)
+  {
+    uint8_t* group = &map->controls[group_i * SWISS_MAP_GROUP_SIZE];
+    uint32_t match = swiss_map__match_free(group);
+    if (match)
+    {
+      size_t slot_i = group_i * SWISS_MAP_GROUP_SIZE + swiss_map__first_bit(match);
+      if (map->controls[slot_i] == SWISS_MAP_DELETED)
+        map->deleted_n--;
+      map->controls[slot_i] = (uint8_t)(hash & 0x7f);
+      map->entries[slot_i] = (SwissMapEntry){.key = key, .ptr = data};
+      map->len++;
+      return;
+    }
+    group_i = (group_i + step) & groups_mask;
+  }
+}
+
+void swiss_map_grow(SwissMap* map, size_t size)
+{
+  size = pow2_ge_uint64(size < SWISS_MAP_GROUP_SIZE ? SWISS_MAP_GROUP_SIZE : size);
+  SwissMap new_map = {
+    .controls = malloc(size * sizeof new_map.controls[0]),
+    .entries = malloc(size * sizeof new_map.entries[0]),
+    .cap = size,
+  };
+  if (!new_map.controls)
+    exit(1);
+  if (!new_map.entries)
+    exit(1);
+  memset(new_map.controls, SWISS_MAP_EMPTY, size);
+
+  for (size_t i = 0; i < map->cap; i++)
+  {
+    if (!(map->controls[i] & 0x80))
+    {
+      uint64_t key = map->entries[i].key;
+      swiss_map__insert(&new_map, key, hash_uint64(key), map->entries[i].ptr);
+    }
+  }
+  assert(new_map.len == map->len);
+
+  free(map->controls);
+  free(map->entries);
+  *map = new_map;
+}
+
+void swiss_map_free(SwissMap* map)
+{
+  free(map->controls);
+  free(map->entries);
+  *map = (SwissMap){0};
+}
+
+void* swiss_map_get(SwissMap const* map, uint64_t key)
+{
+  ptrdiff_t slot_i = swiss_map__find(map, key, hash_uint64(key));
+  return slot_i < 0 ? NULL : map->entries[slot_i].ptr;
+}
+
+void swiss_map_put(SwissMap* map, uint64_t key, void* data)
+{
+  uint64_t hash = hash_uint64(key);
+  ptrdiff_t slot_i = swiss_map__find(map, key, hash);
+  if (slot_i >= 0)
+  {
+    map->entries[slot_i].ptr = data;
+    return;
+  }
+
+  // at most 7/8 used or deleted, so that probes meet empty slots soon. Many deleted
+  // slots are reclaimed without growing.
+  if (map->len + map->deleted_n + 1 > map->cap - map->cap / 8)
+    swiss_map_grow(map, map->len + 1 > map->cap / 2 ? 2 * map->cap : map->cap);
+  swiss_map__insert(map, key, hash, data);
+}
+
+void swiss_map_remove(SwissMap* map, uint64_t key)
+{
+  ptrdiff_t slot_i = swiss_map__find(map, key, hash_uint64(key));
+  if (slot_i < 0)
+    return;
+
+  // a lookup only probes past this group if it has no empty slot
+  size_t group_i = (size_t)slot_i / SWISS_MAP_GROUP_SIZE;
+  if (swiss_map__match(&map->controls[group_i * SWISS_MAP_GROUP_SIZE], SWISS_MAP_EMPTY))
+  {
+    map->controls[slot_i] = SWISS_MAP_EMPTY;
+  }
+  else
+  {
+    map->controls[slot_i] = SWISS_MAP_DELETED;
+    map->deleted_n++;
+  }
+  map->len--;
+}
+
+enum
+{
+  STR_MAP_KEYS_BLOCK_SIZE = 16 * 1024,
+  STR_MAP_CAP_MIN = 16,
+};
+
+static uint64_t str_map__hash(char const* key, size_t key_n)
+{
+  uint64_t hash = hash_bytes(key, key_n);
+  return hash ? hash : 1; // 0 marks the empty slots
+}
+
+// returns the slot of the key, or the empty slot where it would go
+static size_t str_map__find(StrMap const* map,
+                            char const* key,
+                            size_t key_n,
+                            uint64_t hash)
+{
   assert(is_pow2_uint64(map->cap));
-  size_t index = hash_uint64(key);
-  size_t last = index;
-  do
+  for (size_t index = hash;; index++)
   {
     index &= map->cap - 1;
-    if (map->keys[index] == key)
+    StrMapEntry const* entry = &map->entries[index];
+    if (!entry->hash)
+      return index;
+    if (entry->hash == hash && entry->key_n == key_n
+        && 0 == memcmp(entry->key, key, key_n))
+      return index;
+  }
+}
+
+static void str_map__grow(StrMap* map, size_t size)
+{
+  size = pow2_ge_uint64(size);
+  StrMapEntry* entries = calloc(size, sizeof entries[0]);
+  if (!entries)
+    exit(1);
+
+  StrMap new_map = *map;
+  new_map.entries = entries;
+  new_map.cap = size;
+  for (size_t index = 0; index < map->cap; index++)
+  {
+    StrMapEntry const* entry = &map->entries[index];
+    if (entry->hash)
     {
-      map->keys[index] = 0;
-      map->len--;
-      return;
+      size_t new_index = str_map__find(&new_map, entry->key, entry->key_n, entry->hash);
+      new_map.entries[new_index] = *entry;
     }
-    index++;
-  } while (index != last);
-  assert(0);
-  exit(1);
+  }
+  free(map->entries);
+  *map = new_map;
 }
 
+// copies the key into the current block, or a new one when it does not fit
+static char const* str_map__copy_key(StrMap* map, char const* key, size_t key_n)
+{
+  size_t needed_n = key_n + 1;
+  if (!map->keys_block || map->keys_block_n - map->keys_block_used_n < needed_n)
+  {
+    size_t header_n = sizeof(char*);
+    size_t block_n = header_n + needed_n;
+    if (block_n < STR_MAP_KEYS_BLOCK_SIZE)
+      block_n = STR_MAP_KEYS_BLOCK_SIZE;
+    char* block = malloc(block_n);
+    if (!block)
+      exit(1);
+    memcpy(block, &map->keys_block, sizeof map->keys_block);
+    map->keys_block = block;
+    map->keys_block_n = block_n;
+    map->keys_block_used_n = header_n;
+  }
+  char* copy = &map->keys_block[map->keys_block_used_n];
+  memcpy(copy, key, key_n);
+  copy[key_n] = '\0';
+  map->keys_block_used_n += needed_n;
+  return copy;
+}
+
+void str_map_free(StrMap* map)
+{
+  free(map->entries), map->entries = NULL;
+  while (map->keys_block)
+  {
+    char* previous_block;
+    memcpy(&previous_block, map->keys_block, sizeof previous_block);
+    free(map->keys_block);
+    map->keys_block = previous_block;
+  }
+  *map = (StrMap){0};
+}
+
+void* str_map_get(StrMap const* map, char const* key, size_t key_n)
+{
+  if (map->len == 0)
+    return NULL;
+  size_t index = str_map__find(map, key, key_n, str_map__hash(key, key_n));
+  return map->entries[index].ptr;
+}
+
+// returns the slot of the key, after adding it if absent
+static StrMapEntry* str_map__upsert(StrMap* map, char const* key, size_t key_n)
+{
+  // keeps an empty slot, where lookups of absent keys stop
+  if (map->cap == 0 || map->len + 1 > map->cap - map->cap / 4)
+    str_map__grow(map, map->cap ? 2 * map->cap : STR_MAP_CAP_MIN);
+
+  uint64_t hash = str_map__hash(key, key_n);
+  StrMapEntry* entry = &map->entries[str_map__find(map, key, key_n, hash)];
+  if (!entry->hash)
+  {
+    *entry = (StrMapEntry){
+      .hash = hash,
+      .key = str_map__copy_key(map, key, key_n),
+      .key_n = key_n,
+    };
+    map->len++;
+  }
+  return entry;
+}
+
+char const* str_map_put(StrMap* map, char const* key, size_t key_n, void* data)
+{
+  StrMapEntry* entry = str_map__upsert(map, key, key_n);
+  entry->ptr = data;
+  return entry->key;
+}
+
+char const* str_map_intern(StrMap* map, char const* key, size_t key_n)
+{
+  return str_map__upsert(map, key, key_n)->key;
+}
+
+typedef struct TestMapArena
+{
+  char* bytes;
+  size_t bytes_n;
+  size_t bytes_allocated;
+} TestMapArena;
+
+static void* test_map__arena_calloc(void* allocator, size_t n, size_t size)
+{
+  TestMapArena* arena = allocator;
+  size_t bytes_n = (n * size + 15) & ~(size_t)15;
+  assert(arena->bytes_allocated + bytes_n <= arena->bytes_n);
+  void* ptr = &arena->bytes[arena->bytes_allocated];
+  arena->bytes_allocated += bytes_n;
+  return ptr;
+}
 
 int test_map(int argc, char const** argv)
 {
@@ -175,7 +571,200 @@ int test_map(int argc, char const** argv)
   size_t old_cap = map.cap;
   for (size_t next_id = 6; old_cap == map.cap; map_put(&map, next_id++, "grow-me"))
     ;
+  map_free(&map);
+
+  // clearing keeps the capacity
+  {
+    for (uint64_t key = 1; key <= 100; key++)
+      map_put(&map, key, "cleared");
+    size_t cleared_cap = map.cap;
+    map_clear(&map);
+    assert(map.len == 0 && map.cap == cleared_cap);
+    for (uint64_t key = 1; key <= 100; key++)
+      assert(map_get(&map, key) == NULL);
+    for (uint64_t key = 1; key <= 100; key++)
+      map_put(&map, key, "refilled");
+    assert(map.len == 100 && map.cap == cleared_cap);
+    map_free(&map);
+  }
+
+  // arrays from an allocator, which the map never frees
+  {
+    static char arena_bytes[128 * 1024];
+    TestMapArena arena = {.bytes = arena_bytes, .bytes_n = sizeof arena_bytes};
+    memset(arena_bytes, 0, sizeof arena_bytes);
+    Map arena_map = {.allocator = {test_map__arena_calloc, &arena}};
+    for (uint64_t key = 1; key <= 1000; key++)
+      map_put(&arena_map, key, (void*)(uintptr_t)key);
+    for (uint64_t key = 1; key <= 1000; key++)
+      assert(map_get(&arena_map, key) == (void*)(uintptr_t)key);
+    map_free(&arena_map);
+    assert(arena_map.allocator.allocator == &arena);
+  }
+
+  // random puts and removes on both maps, checked against an array
+  {
+    enum
+    {
+      KEYS_N = 2000,
+    };
+    static uintptr_t expected[KEYS_N + 1];
+    memset(expected, 0, sizeof expected);
+    Map random_map = {0};
+    SwissMap swiss_map = {0};
+    assert(swiss_map_get(&swiss_map, 0) == NULL);
+    size_t expected_len = 0;
+    uint32_t seed = 1;
+    for (uintptr_t op_i = 1; op_i <= 50000; op_i++)
+    {
+      seed = seed * 1664525u + 1013904223u;
+      uint64_t key = 1 + (seed >> 8) % KEYS_N;
+      if ((seed >> 4) % 3 == 0)
+      {
+        expected_len -= expected[key] ? 1 : 0;
+        expected[key] = 0;
+        map_remove(&random_map, key);
+        swiss_map_remove(&swiss_map, key);
+      }
+      else
+      {
+        expected_len += expected[key] ? 0 : 1;
+        expected[key] = op_i;
+        map_put(&random_map, key, (void*)op_i);
+        swiss_map_put(&swiss_map, key, (void*)op_i);
+      }
+      assert(random_map.len == expected_len);
+      assert(swiss_map.len == expected_len);
+      if (op_i % 1000 == 0)
+      {
+        for (uint64_t check_key = 1; check_key <= KEYS_N; check_key++)
+        {
+          assert((uintptr_t)map_get(&random_map, check_key) == expected[check_key]);
+          assert((uintptr_t)swiss_map_get(&swiss_map, check_key) == expected[check_key]);
+        }
+      }
+    }
+    map_free(&random_map);
+    swiss_map_free(&swiss_map);
+  }
 
+  // string keys, including prefixes of one another and keys larger than a block
+  {
+    StrMap str_map = {0};
+    assert(str_map_get(&str_map, "", 0) == NULL);
+    str_map_put(&str_map, "", 0, "empty");
+    assert(str_map_get(&str_map, "/", 1) == NULL);
+    assert(0 == strcmp("empty", str_map_get(&str_map, "", 0)));
+    char key[32];
+    for (uintptr_t key_i = 0; key_i < 5000; key_i++)
+    {
+      size_t key_n = (size_t)snprintf(key, sizeof key, "/dir/%u", (unsigned)key_i);
+      char const* copy = str_map_put(&str_map, key, key_n, (void*)(key_i + 1));
+      assert(copy != key && 0 == strcmp(copy, key));
+      assert(copy == str_map_intern(&str_map, key, key_n));
+    }
+    assert(str_map.len == 5001);
+    for (uintptr_t key_i = 0; key_i < 5000; key_i++)
+    {
+      size_t key_n = (size_t)snprintf(key, sizeof key, "/dir/%u", (unsigned)key_i);
+      assert(str_map_get(&str_map, key, key_n) == (void*)(key_i + 1));
+      assert(str_map_get(&str_map, key, key_n - 1) != (void*)(key_i + 1));
+    }
+    assert(str_map_get(&str_map, "/dir/5000", 9) == NULL);
+
+    static char long_key[STR_MAP_KEYS_BLOCK_SIZE * 2];
+    memset(long_key, 'x', sizeof long_key);
+    char const* long_copy = str_map_intern(&str_map, long_key, sizeof long_key);
+    assert(long_copy[sizeof long_key] == '\0');
+    assert(str_map_get(&str_map, long_key, sizeof long_key) == NULL);
+    str_map_put(&str_map, long_key, sizeof long_key, "long");
+    assert(0 == strcmp("long", str_map_get(&str_map, long_key, sizeof long_key)));
+    assert(str_map.len == 5002);
+    str_map_free(&str_map);
+  }
+
+
+  return 0;
+}
 
+// Benchmarks
+
+#include "xxxx_bench.h"
+#include "xxxx_thread.h"
+
+enum
+{
+  BENCH_MAP_LOOKUPS_N = 1 << 20,
+};
+
+static uint64_t bench_map__random(uint64_t* state)
+{
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+// \param keys present keys are odd, so that even keys miss
+static void bench_map__run(Bench* bench,
+                           bool is_swiss,
+                           uint64_t const* keys,
+                           size_t keys_n)
+{
+  Map map = {0};
+  SwissMap swiss_map = {0};
+  for (size_t key_i = 0; key_i < keys_n; key_i++)
+  {
+    if (is_swiss)
+      swiss_map_put(&swiss_map, keys[key_i], (void*)(key_i + 1));
+    else
+      map_put(&map, keys[key_i], (void*)(key_i + 1));
+  }
+
+  uintptr_t found_n = 0;
+  for (int is_miss = 0; is_miss < 2; is_miss++)
+  {
+    uint64_t random_state = 0x9E3779B97F4A7C15ull;
+    uint64_t begin_ns = thread_clock_ns();
+    for (size_t lookup_i = 0; lookup_i < BENCH_MAP_LOOKUPS_N; lookup_i++)
+    {
+      uint64_t random = bench_map__random(&random_state);
+      uint64_t key = is_miss ? random & ~1ull : keys[random % keys_n];
+      void* found = is_swiss ? swiss_map_get(&swiss_map, key) : map_get(&map, key);
+      found_n += found != NULL;
+    }
+    uint64_t elapsed_ns = thread_clock_ns() - begin_ns;
+
+    char const* names[2][2] = {
+      {"map.get.hit", "map.get.miss"},
+      {"swiss_map.get.hit", "swiss_map.get.miss"},
+    };
+    bench_result(bench, names[is_swiss][is_miss], 1, keys_n,
+                 (double)elapsed_ns / BENCH_MAP_LOOKUPS_N, "ns/get");
+  }
+  if (found_n != BENCH_MAP_LOOKUPS_N)
+    fprintf(stderr, "ERROR: lookups found %llu keys\n", (unsigned long long)found_n);
+
+  map_free(&map);
+  swiss_map_free(&swiss_map);
+}
+
+int bench_map(int argc, char const** argv)
+{
+  Bench bench = bench_begin(argc, argv);
+  for (size_t keys_n = 10000; keys_n <= 10000000; keys_n *= 10)
+  {
+    uint64_t* keys = malloc(keys_n * sizeof keys[0]);
+    uint64_t random_state = 88172645463325252ull;
+    for (size_t key_i = 0; key_i < keys_n; key_i++)
+    {
+      keys[key_i] = bench_map__random(&random_state) | 1;
+    }
+    bench_map__run(&bench, false, keys, keys_n);
+    bench_map__run(&bench, true, keys, keys_n);
+    free(keys);
+  }
+  bench_end(&bench);
   return 0;
 }
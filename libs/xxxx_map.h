@@ -1,21 +1,40 @@
 #ifndef MAP
 #define MAP
 
-/* hashtable */
+/* hashtable
+ *
+ * Robin Hood linear probing: each entry stores its distance from the slot its hash
+ * points to, and an entry being inserted takes the slot of any entry closer to its own
+ * slot. Lookups stop as soon as they meet an entry closer to its slot than the key would
+ * be, and removals shift the following entries back instead of leaving holes. */
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+// Where a map takes its arrays from, when not from the C heap. The map never frees
+// them: the allocator is expected to release them all at once, like an arena does.
+typedef struct MapAllocator
+{
+  void* (*calloc_fn)(void* allocator, size_t n, size_t size); // returns zeroed memory
+  void* allocator;
+} MapAllocator;
+
 typedef struct Map
 {
-  uint64_t* keys;
+  uint64_t* keys; // 0 for empty slots
   void** ptrs;
+  uint8_t* distances; // from the slot of the key's hash
   size_t cap;
   size_t len;
+  MapAllocator allocator; // the C heap when calloc_fn is NULL
 } Map;
 
 void map_grow(Map* map, size_t size);
+// keeps the allocator, so that the map can be filled again
 void map_free(Map* map);
+// removes all entries but keeps the capacity
+void map_clear(Map* map);
 
 // returns value at key
 void* map_get(Map const* map, uint64_t key);
@@ -23,8 +42,75 @@ void* map_get(Map const* map, uint64_t key);
 // grows the map if necessary
 void map_put(Map* map, uint64_t key, void* data);
 
+// does nothing when the key is absent
 void map_remove(Map* map, uint64_t key);
 
+/* hashtable probing 16 slots at a time
+ *
+ * Each slot has a control byte: empty, deleted, or 7 bits of the key's hash. Lookups
+ * compare a whole group of control bytes at once (with SSE2 when available), and only
+ * read the entries whose byte matches. Keys and values are stored together, so that a
+ * match costs one cache miss. Unlike Map, any key is allowed, including 0. */
+
+enum
+{
+  SWISS_MAP_GROUP_SIZE = 16,
+};
+
+typedef struct SwissMapEntry
+{
+  uint64_t key;
+  void* ptr;
+} SwissMapEntry;
+
+typedef struct SwissMap
+{
+  uint8_t* controls;
+  SwissMapEntry* entries;
+  size_t cap; // power of two, at least one group
+  size_t len;
+  size_t deleted_n; // slots marked deleted, which lookups probe past
+} SwissMap;
+
+void swiss_map_grow(SwissMap* map, size_t size);
+void swiss_map_free(SwissMap* map);
+void* swiss_map_get(SwissMap const* map, uint64_t key);
+void swiss_map_put(SwissMap* map, uint64_t key, void* data);
+// does nothing when the key is absent
+void swiss_map_remove(SwissMap* map, uint64_t key);
+
+/* hashtable of strings
+ *
+ * The map keeps its own nul-terminated copy of each key, in blocks that are never moved
+ * or freed before the map is, so the copies can be held onto: interning a string returns
+ * the same copy for all equal strings. Slots cache the hash of their key, so that a
+ * lookup compares the bytes of a key only once its hash and length matched. */
+
+typedef struct StrMapEntry
+{
+  uint64_t hash; // 0 for empty slots
+  char const* key;
+  size_t key_n;
+  void* ptr;
+} StrMapEntry;
+
+typedef struct StrMap
+{
+  StrMapEntry* entries;
+  size_t cap;
+  size_t len;
+  char* keys_block; // starts with a pointer to the previous block
+  size_t keys_block_n;
+  size_t keys_block_used_n;
+} StrMap;
+
+void str_map_free(StrMap* map);
+void* str_map_get(StrMap const* map, char const* key, size_t key_n);
+// returns the map's copy of the key
+char const* str_map_put(StrMap* map, char const* key, size_t key_n, void* data);
+// returns the map's copy of the key, adding it with a NULL value when absent
+char const* str_map_intern(StrMap* map, char const* key, size_t key_n);
+
 static inline uint64_t hash_uint64(uint64_t x)
 {
   x *= 0xff51afd7ed558ccd;
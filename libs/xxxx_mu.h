@@ -196,4 +196,27 @@ Mu_Bool Mu_LoadImage(const char* filename, struct Mu_Image* image);
  */
 Mu_Bool Mu_LoadAudio(const char* filename, struct Mu_AudioBuffer* audio);
 
+/*
+ * Called after each block of samples is decoded. `audio` contains all the samples
+ * decoded so far, of which [samples_f, audio->samples_count) are new.
+ *
+ * `expected_samples_count` is the total estimated from the file's duration, or 0 when
+ * unknown. The actual count may differ.
+ */
+typedef void (*Mu_AudioLoadCallback)(void* user,
+                                     struct Mu_AudioBuffer const* audio,
+                                     size_t samples_f,
+                                     size_t expected_samples_count);
+
+/*
+ * Like Mu_LoadAudio, calling `callback` while decoding to let the caller process
+ * the samples as they come.
+ *
+ * @return: MU_FALSE on error
+ */
+Mu_Bool Mu_LoadAudioProgressive(const char* filename,
+                                struct Mu_AudioBuffer* audio,
+                                Mu_AudioLoadCallback callback,
+                                void* user);
+
 #endif
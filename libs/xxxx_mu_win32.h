@@ -13,6 +13,7 @@ enum
   MU_PAGEDOWN = 0x22, // VK_NEXT
   MU_HOME = 0x24,     // VK_HOME
   MU_END = 0x23,      // VK_END
+  MU_F12 = 0x7B,      // VK_F12
 };
 
 typedef void* HANDLE;
@@ -1,7 +1,10 @@
 #include "xxxx_queue.h"
 
-#include "xxxx_buf.h"
+#include "xxxx_atomic.h"
+#include "xxxx_thread.h"
 
+#include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 
 // Implementation notes:
@@ -23,110 +26,824 @@ void queue_reader_free(QueueReader* queue)
 
 void queue_writer_free(QueueWriter* queue)
 {
-  buf_free(queue->writer_buffer);
 }
 
-static bool queue__flush_up_to_n(QueueWriter* writer, uint32_t n)
+void queue_init(Queue* queue, void** storage, uint32_t capacity, QueueOverflow overflow)
 {
-  if (buf_len(writer->writer_buffer) == 0)
-    return false;
-  if (n == 0)
-    return buf_len(writer->writer_buffer) > 0;
+  assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+  memset(queue, 0, sizeof *queue);
+  queue->overflow = overflow;
+  queue->capacity = capacity;
+  queue->data = storage;
+}
 
+// write region is in [writer_index,reader_index + capacity) modulo capacity
+// both indices can wrap-around due to unsigned int modulo
+//
+// \param wanted_n reloads the reader index when fewer are known to be available
+static uint32_t queue__available_to_write(QueueWriter* writer, size_t wanted_n)
+{
   Queue* queue = writer->queue;
-  void** buffer = writer->writer_buffer;
-  size_t index;
-  uint32_t writer_index = queue->writer_index;
-  for (index = 0; index < n && index < buf_len(buffer); index++)
+  uint32_t writer_index = queue->writer_index; // only written by the writer
+  uint32_t available_to_write =
+    queue->capacity - (writer_index - writer->reader_index);
+  if (available_to_write < wanted_n)
   {
-    queue->data[modulo_pot_uint32(writer_index + (uint32_t)index, QUEUE_CAPACITY_POT)] =
-      buffer[index];
+    writer->reader_index = atomic_load_uint32(&queue->reader_index);
+    available_to_write = queue->capacity - (writer_index - writer->reader_index);
   }
-  assert(index > 0);
-  queue->writer_index += (uint32_t)(index - 0);
+  assert(available_to_write <= queue->capacity);
+  return available_to_write;
+}
 
-  size_t remaining = buf_len(buffer) - index;
-  memcpy(&buffer[0], &buffer[index], (sizeof *buffer) * remaining);
-  buf_truncate(buffer, remaining);
-  writer->writer_buffer = buffer;
-  return index > 0 || buf_len(writer->writer_buffer) > 0;
+// read region is in [reader_index,writer_index) modulo capacity
+// both indices can wrap-around due to unsigned int modulo
+//
+// \param wanted_n reloads the writer index when fewer are known to be available
+// \return more than the capacity when the writer dropped messages past `reader_index`
+static uint32_t queue__available_to_read(QueueReader* reader,
+                                         uint32_t reader_index,
+                                         size_t wanted_n)
+{
+  Queue* queue = reader->queue;
+  uint32_t available_to_read = reader->writer_index - reader_index;
+  // past the last seen writer index when the writer dropped the oldest messages
+  if (available_to_read < wanted_n || available_to_read > queue->capacity)
+  {
+    reader->writer_index = atomic_load_uint32(&queue->writer_index);
+    available_to_read = reader->writer_index - reader_index;
+  }
+  return available_to_read;
 }
 
-bool queue_flush(QueueWriter* writer)
+// writes as many of `data` as there is room for, and publishes them at once
+static size_t queue__write_n(QueueWriter* writer, void* const* data, size_t n)
 {
   Queue* queue = writer->queue;
-
-  // write region is in [writer_index,reader_index) modulo capacity
-  // both indices can wrap-around due to unsigned int modulo
-  uint32_t reader_index = queue->reader_index - 1;
   uint32_t writer_index = queue->writer_index;
-  uint32_t queue_len = writer_index - reader_index;
-  assert(queue_len <= QUEUE_CAPACITY_POT);
+  uint32_t available_to_write = queue__available_to_write(writer, n);
+  size_t index;
+  for (index = 0; index < available_to_write && index < n; index++)
+  {
+    uint32_t slot_i =
+      modulo_pot_uint32(writer_index + (uint32_t)index, queue->capacity);
+    atomic_store_ptr(&queue->data[slot_i], data[index]);
+  }
+  if (index > 0)
+    atomic_store_uint32(&queue->writer_index, writer_index + (uint32_t)index);
+  return index;
+}
 
-  uint32_t available_to_write = QUEUE_CAPACITY_POT - queue_len;
-  return queue__flush_up_to_n(writer, available_to_write);
+// Frees the slot of the oldest unread message, unless the reader freed one meanwhile.
+// The reader advances its index with a compare-exchange too, and reads again when the
+// writer got there first.
+static void queue__drop_oldest(QueueWriter* writer)
+{
+  Queue* queue = writer->queue;
+  uint32_t reader_index = atomic_load_uint32(&queue->reader_index);
+  if (queue->writer_index - reader_index == queue->capacity &&
+      atomic_compare_exchange_uint32(&queue->reader_index, &reader_index,
+                                     reader_index + 1))
+  {
+    reader_index++;
+    writer->dropped_n++;
+  }
+  writer->reader_index = reader_index;
 }
 
-void queue_push(QueueWriter* writer, void* data)
+bool queue_flush(QueueWriter* writer)
 {
-  buf_push(writer->writer_buffer, data);
-  queue_flush(writer);
+  if (!writer->latest)
+    return false;
+  if (queue__write_n(writer, &writer->latest, 1) == 0)
+    return true;
+  writer->latest = NULL;
+  return false;
+}
+
+bool queue_push(QueueWriter* writer, void* data)
+{
+  return queue_push_n(writer, &data, 1) == 1;
+}
+
+size_t queue_push_n(QueueWriter* writer, void* const* data, size_t n)
+{
+  size_t index = 0;
+  if (!queue_flush(writer)) // otherwise they must come after the kept message
+    index = queue__write_n(writer, data, n);
+  if (index == n)
+    return n;
+
+  switch (writer->queue->overflow)
+  {
+  case QueueOverflow_Fail:
+    return index;
+  case QueueOverflow_DropNewest:
+    writer->dropped_n += (uint32_t)(n - index);
+    break;
+  case QueueOverflow_DropOldest:
+    while (index < n)
+    {
+      queue__drop_oldest(writer);
+      index += queue__write_n(writer, &data[index], n - index);
+    }
+    break;
+  case QueueOverflow_OverwriteLatest:
+    writer->dropped_n += (uint32_t)(n - index - 1) + (writer->latest ? 1 : 0);
+    writer->latest = data[n - 1];
+    break;
+  }
+  return n;
 }
 
 void* queue_pull_next(QueueReader* reader)
+{
+  void* result;
+  return queue_pull_n(reader, &result, 1) ? result : NULL;
+}
+
+size_t queue_pull_n(QueueReader* reader, void** d_data, size_t n)
 {
   Queue* queue = reader->queue;
-  // read region is in [reader_index,writer_index) modulo capacity
-  // both indices can wrap-around due to unsigned int modulo
-  uint32_t reader_index = queue->reader_index - 1;
-  uint32_t writer_index = queue->writer_index;
-  uint32_t queue_len = writer_index - reader_index;
-  if (queue_len == 0)
+  for (;;)
+  {
+    uint32_t reader_index = atomic_load_uint32(&queue->reader_index);
+    uint32_t available_to_read = queue__available_to_read(reader, reader_index, n);
+    if (available_to_read > queue->capacity)
+    {
+      // the writer dropped messages since reader_index was loaded
+      assert(queue->overflow == QueueOverflow_DropOldest);
+      continue;
+    }
+    size_t index;
+    for (index = 0; index < available_to_read && index < n; index++)
+    {
+      uint32_t slot_i =
+        modulo_pot_uint32(reader_index + (uint32_t)index, queue->capacity);
+      d_data[index] = atomic_load_ptr(&queue->data[slot_i]);
+    }
+    if (index == 0)
+      return 0;
+
+    if (queue->overflow != QueueOverflow_DropOldest)
+    {
+      atomic_store_uint32(&queue->reader_index, reader_index + (uint32_t)index);
+      return index;
+    }
+    // the writer may have dropped and overwritten the oldest messages while reading
+    if (atomic_compare_exchange_uint32(&queue->reader_index, &reader_index,
+                                       reader_index + (uint32_t)index))
+    {
+      return index;
+    }
+  }
+}
+
+QueueSpan queue_write_span(QueueWriter* writer)
+{
+  QueueSpan span = {0};
+  if (queue_flush(writer))
+    return span; // the kept message comes first
+
+  Queue* queue = writer->queue;
+  uint32_t slot_i = modulo_pot_uint32(queue->writer_index, queue->capacity);
+  span.data = &queue->data[slot_i];
+  span.n = queue__available_to_write(writer, queue->capacity - slot_i);
+  if (span.n > queue->capacity - slot_i)
+    span.n = queue->capacity - slot_i;
+  return span;
+}
+
+void queue_write_commit(QueueWriter* writer, size_t n)
+{
+  Queue* queue = writer->queue;
+  assert(n <= queue->capacity - (queue->writer_index - writer->reader_index));
+  if (n > 0)
+    atomic_store_uint32(&queue->writer_index, queue->writer_index + (uint32_t)n);
+}
+
+QueueSpan queue_read_span(QueueReader* reader)
+{
+  Queue* queue = reader->queue;
+  assert(queue->overflow != QueueOverflow_DropOldest);
+  uint32_t reader_index = queue->reader_index; // only written by the reader
+  uint32_t slot_i = modulo_pot_uint32(reader_index, queue->capacity);
+  QueueSpan span = {
+    .data = &queue->data[slot_i],
+    .n = queue__available_to_read(reader, reader_index, queue->capacity - slot_i),
+  };
+  assert(span.n <= queue->capacity);
+  if (span.n > queue->capacity - slot_i)
+    span.n = queue->capacity - slot_i;
+  return span;
+}
+
+void queue_read_commit(QueueReader* reader, size_t n)
+{
+  Queue* queue = reader->queue;
+  assert(n <= reader->writer_index - queue->reader_index);
+  if (n > 0)
+    atomic_store_uint32(&queue->reader_index, queue->reader_index + (uint32_t)n);
+}
+
+typedef struct ByteQueueHeader
+{
+  uint32_t type;
+  uint32_t size;
+} ByteQueueHeader;
+
+static uint32_t byte_queue__record_size(uint32_t size)
+{
+  uint32_t record_size = (uint32_t)sizeof(ByteQueueHeader) + size;
+  return (record_size + BYTE_QUEUE_ALIGNMENT - 1) & ~(uint32_t)(BYTE_QUEUE_ALIGNMENT - 1);
+}
+
+static ByteQueueHeader* byte_queue__header(ByteQueue* queue, uint32_t index)
+{
+  uint8_t* data = (uint8_t*)&queue->data[0];
+  return (ByteQueueHeader*)&data[modulo_pot_uint32(index, BYTE_QUEUE_CAPACITY_POT)];
+}
+
+void* byte_queue_write_begin(ByteQueueWriter* writer, uint32_t type, uint32_t size)
+{
+  assert(type != BYTE_QUEUE_TYPE_PADDING);
+  uint32_t record_size = byte_queue__record_size(size);
+  assert(record_size <= BYTE_QUEUE_CAPACITY_POT);
+
+  // the message starts over at the front when it does not fit before the end
+  ByteQueue* queue = writer->queue;
+  uint32_t writer_index = queue->writer_index; // only written by the writer
+  uint32_t until_end_n =
+    BYTE_QUEUE_CAPACITY_POT - modulo_pot_uint32(writer_index, BYTE_QUEUE_CAPACITY_POT);
+  uint32_t padding_n = until_end_n < record_size ? until_end_n : 0;
+
+  uint32_t available_to_write =
+    BYTE_QUEUE_CAPACITY_POT - (writer_index - writer->reader_index);
+  if (available_to_write < padding_n + record_size)
+  {
+    writer->reader_index = atomic_load_uint32(&queue->reader_index);
+    available_to_write = BYTE_QUEUE_CAPACITY_POT - (writer_index - writer->reader_index);
+    if (available_to_write < padding_n + record_size)
+      return NULL;
+  }
+
+  if (padding_n)
+  {
+    ByteQueueHeader* padding = byte_queue__header(queue, writer_index);
+    padding->type = BYTE_QUEUE_TYPE_PADDING;
+    padding->size = padding_n - (uint32_t)sizeof(ByteQueueHeader);
+    writer_index += padding_n;
+  }
+  ByteQueueHeader* header = byte_queue__header(queue, writer_index);
+  header->type = type;
+  header->size = size;
+  writer->reserved_index = writer_index + record_size;
+  return header + 1;
+}
+
+void byte_queue_write_commit(ByteQueueWriter* writer)
+{
+  assert(writer->reserved_index != writer->queue->writer_index);
+  atomic_store_uint32(&writer->queue->writer_index, writer->reserved_index);
+}
+
+bool byte_queue_push(ByteQueueWriter* writer,
+                     uint32_t type,
+                     void const* payload,
+                     uint32_t size)
+{
+  void* d_payload = byte_queue_write_begin(writer, type, size);
+  if (!d_payload)
+    return false;
+  memcpy(d_payload, payload, size);
+  byte_queue_write_commit(writer);
+  return true;
+}
+
+bool byte_queue_peek(ByteQueueReader* reader, ByteQueueMessage* d_message)
+{
+  ByteQueue* queue = reader->queue;
+  uint32_t reader_index = queue->reader_index; // only written by the reader
+  for (;;)
+  {
+    if (reader_index == reader->writer_index)
+    {
+      reader->writer_index = atomic_load_uint32(&queue->writer_index);
+      if (reader_index == reader->writer_index)
+        return false;
+    }
+    assert(reader->writer_index - reader_index <= BYTE_QUEUE_CAPACITY_POT);
+
+    ByteQueueHeader* header = byte_queue__header(queue, reader_index);
+    if (header->type != BYTE_QUEUE_TYPE_PADDING)
+    {
+      d_message->type = header->type;
+      d_message->size = header->size;
+      d_message->payload = header + 1;
+      return true;
+    }
+    // padding at the end of the ring, the next message is at the front
+    reader_index += byte_queue__record_size(header->size);
+    atomic_store_uint32(&queue->reader_index, reader_index);
+  }
+}
+
+void byte_queue_pop(ByteQueueReader* reader)
+{
+  ByteQueue* queue = reader->queue;
+  uint32_t reader_index = queue->reader_index;
+  assert(reader_index != reader->writer_index);
+  ByteQueueHeader* header = byte_queue__header(queue, reader_index);
+  assert(header->type != BYTE_QUEUE_TYPE_PADDING);
+  atomic_store_uint32(&queue->reader_index,
+                      reader_index + byte_queue__record_size(header->size));
+}
+
+// A slot at index `index` is free for the producer claiming `index` when its sequence is
+// `index`, and holds a message for the reader when it is `index + 1`. The reader then
+// frees it for the producer one lap later.
+void mpsc_queue_init(MpscQueue* queue)
+{
+  memset(queue, 0, sizeof *queue);
+  for (uint32_t slot_i = 0; slot_i < MPSC_QUEUE_CAPACITY_POT; slot_i++)
+  {
+    queue->slots[slot_i].sequence = slot_i;
+  }
+}
+
+bool mpsc_queue_push(MpscQueue* queue, void* data)
+{
+  uint32_t writer_index = atomic_load_uint32(&queue->writer_index);
+  for (;;)
+  {
+    MpscQueueSlot* slot =
+      &queue->slots[modulo_pot_uint32(writer_index, MPSC_QUEUE_CAPACITY_POT)];
+    uint32_t sequence = atomic_load_uint32(&slot->sequence);
+    int32_t lap_difference = (int32_t)(sequence - writer_index);
+    if (lap_difference == 0)
+    {
+      // on failure, the exchange loads the index claimed by the other producer
+      if (atomic_compare_exchange_uint32(&queue->writer_index, &writer_index,
+                                         writer_index + 1))
+      {
+        slot->data = data;
+        atomic_store_uint32(&slot->sequence, writer_index + 1);
+        return true;
+      }
+    }
+    else if (lap_difference < 0)
+    {
+      return false; // the reader has not freed the slot yet
+    }
+    else
+    {
+      writer_index = atomic_load_uint32(&queue->writer_index); // claimed by another
+    }
+  }
+}
+
+void* mpsc_queue_pull_next(MpscQueue* queue)
+{
+  uint32_t reader_index = queue->reader_index;
+  MpscQueueSlot* slot =
+    &queue->slots[modulo_pot_uint32(reader_index, MPSC_QUEUE_CAPACITY_POT)];
+  if (atomic_load_uint32(&slot->sequence) != reader_index + 1)
     return NULL;
-  assert(queue_len <= QUEUE_CAPACITY_POT);
 
-  void* result = queue->data[modulo_pot_uint32(reader_index, QUEUE_CAPACITY_POT)];
-  queue->reader_index++;
+  void* result = slot->data;
+  atomic_store_uint32(&slot->sequence, reader_index + MPSC_QUEUE_CAPACITY_POT);
+  queue->reader_index = reader_index + 1;
   return result;
 }
 
+size_t mpsc_queue_pull_n(MpscQueue* queue, void** d_data, size_t n)
+{
+  size_t index;
+  for (index = 0; index < n; index++)
+  {
+    d_data[index] = mpsc_queue_pull_next(queue);
+    if (!d_data[index])
+      break;
+  }
+  return index;
+}
+
+typedef struct QueueTestProducer
+{
+  QueueWriter writer;
+  uintptr_t messages_n;
+} QueueTestProducer;
+
+// spins a little before letting the other thread run, in case both share a processor
+static void queue__test_backoff(uint32_t* spins_n)
+{
+  if (++*spins_n < 64)
+    atomic_pause();
+  else
+    thread_yield(), *spins_n = 0;
+}
+
+// sends 1..messages_n, waiting for room when the queue is full
+static void queue__test_produce(void* data)
+{
+  QueueTestProducer* producer = data;
+  uint32_t spins_n = 0;
+  for (uintptr_t message_i = 1; message_i <= producer->messages_n; message_i++)
+  {
+    while (!queue_push(&producer->writer, (void*)message_i))
+      queue__test_backoff(&spins_n);
+  }
+}
+
+// receives the messages of queue__test_produce in order
+static void queue__test_consume(QueueReader* reader, uintptr_t messages_n)
+{
+  uint32_t spins_n = 0;
+  for (uintptr_t message_i = 1; message_i <= messages_n;)
+  {
+    void* message = queue_pull_next(reader);
+    if (!message)
+    {
+      queue__test_backoff(&spins_n);
+      continue;
+    }
+    assert((uintptr_t)message == message_i);
+    message_i++;
+  }
+}
+
+enum
+{
+  QUEUE_TEST_CAPACITY = 256,
+  QUEUE_TEST_PRODUCERS_MAX = 16,
+};
+
+typedef struct QueueTestMpscProducer
+{
+  MpscQueue* queue;
+  uintptr_t producer_i;
+  uintptr_t messages_n;
+} QueueTestMpscProducer;
+
+// sends 1..messages_n, tagged with the producer
+static void queue__test_produce_mpsc(void* data)
+{
+  QueueTestMpscProducer* producer = data;
+  uint32_t spins_n = 0;
+  for (uintptr_t message_i = 1; message_i <= producer->messages_n; message_i++)
+  {
+    void* message = (void*)(message_i * QUEUE_TEST_PRODUCERS_MAX + producer->producer_i);
+    while (!mpsc_queue_push(producer->queue, message))
+      queue__test_backoff(&spins_n);
+  }
+}
+
+// runs the producers against the calling thread, which checks that the messages of each
+// producer arrive in order, and returns the elapsed time
+static uint64_t queue__test_mpsc(uint32_t producers_n, uintptr_t messages_n)
+{
+  assert(producers_n <= QUEUE_TEST_PRODUCERS_MAX);
+  MpscQueue queue;
+  mpsc_queue_init(&queue);
+  QueueTestMpscProducer producers[QUEUE_TEST_PRODUCERS_MAX];
+  Thread threads[QUEUE_TEST_PRODUCERS_MAX];
+  uintptr_t next_message_i[QUEUE_TEST_PRODUCERS_MAX];
+
+  uint64_t begin_ns = thread_clock_ns();
+  for (uint32_t producer_i = 0; producer_i < producers_n; producer_i++)
+  {
+    producers[producer_i] = (QueueTestMpscProducer){
+      .queue = &queue, .producer_i = producer_i, .messages_n = messages_n};
+    next_message_i[producer_i] = 1;
+    thread_start(&threads[producer_i], queue__test_produce_mpsc, &producers[producer_i]);
+  }
+  uint32_t spins_n = 0;
+  for (uintptr_t pulled_n = 0; pulled_n < producers_n * messages_n;)
+  {
+    void* message = mpsc_queue_pull_next(&queue);
+    if (!message)
+    {
+      queue__test_backoff(&spins_n);
+      continue;
+    }
+    uintptr_t producer_i = (uintptr_t)message % QUEUE_TEST_PRODUCERS_MAX;
+    assert(producer_i < producers_n);
+    assert((uintptr_t)message / QUEUE_TEST_PRODUCERS_MAX == next_message_i[producer_i]);
+    next_message_i[producer_i]++;
+    pulled_n++;
+  }
+  for (uint32_t producer_i = 0; producer_i < producers_n; producer_i++)
+  {
+    thread_join(&threads[producer_i]);
+  }
+  uint64_t elapsed_ns = thread_clock_ns() - begin_ns;
+  assert(mpsc_queue_pull_next(&queue) == NULL);
+  return elapsed_ns;
+}
+
 int test_queue(int argc, char const** argv)
 {
   (void)argc, (void)argv;
 
-  Queue queue = {
-    0,
-  };
-  QueueWriter writer = {.queue = &queue};
-  QueueReader reader = {.queue = &queue};
+  // each overflow policy, pushing two more than fit
+  for (QueueOverflow overflow = 0; overflow <= QueueOverflow_OverwriteLatest; overflow++)
+  {
+    Queue queue;
+    void* queue_storage[QUEUE_TEST_CAPACITY];
+    queue_init(&queue, queue_storage, QUEUE_TEST_CAPACITY, overflow);
+    QueueWriter writer = {.queue = &queue};
+    QueueReader reader = {.queue = &queue};
+    assert(queue_pull_next(&reader) == NULL);
 
-  assert(queue_pull_next(&reader) == NULL);
+    for (uintptr_t message_i = 1; message_i <= QUEUE_TEST_CAPACITY; message_i++)
+    {
+      assert(queue_push(&writer, (void*)message_i));
+    }
+    bool is_pushed = queue_push(&writer, (void*)(QUEUE_TEST_CAPACITY + 1));
+    assert(is_pushed == (overflow != QueueOverflow_Fail));
+    queue_push(&writer, (void*)(QUEUE_TEST_CAPACITY + 2));
 
-  uintptr_t next_message_i = 1;
-  while (buf_len(writer.writer_buffer) == 0)
+    uintptr_t first_message_i = overflow == QueueOverflow_DropOldest ? 3 : 1;
+    for (uintptr_t message_i = first_message_i;
+         message_i < first_message_i + QUEUE_TEST_CAPACITY; message_i++)
+    {
+      assert((uintptr_t)queue_pull_next(&reader) == message_i);
+    }
+    assert(!queue_flush(&writer));
+    void* latest = queue_pull_next(&reader);
+    assert((overflow == QueueOverflow_OverwriteLatest) ==
+           ((uintptr_t)latest == QUEUE_TEST_CAPACITY + 2));
+    assert(queue_pull_next(&reader) == NULL);
+    assert(writer.dropped_n == (overflow == QueueOverflow_Fail              ? 0
+                                : overflow == QueueOverflow_OverwriteLatest ? 1
+                                                                            : 2));
+  }
+
+  // any power of two capacity, with storage from an allocator
   {
-    queue_push(&writer, (void*)next_message_i++);
+    Queue large_queue;
+    void** large_storage = malloc(sizeof(void*) * 4096);
+    queue_init(&large_queue, large_storage, 4096, QueueOverflow_Fail);
+    QueueWriter large_writer = {.queue = &large_queue};
+    QueueReader large_reader = {.queue = &large_queue};
+    uintptr_t pushed_n = 0;
+    while (queue_push(&large_writer, (void*)(pushed_n + 1)))
+      pushed_n++;
+    assert(pushed_n == 4096);
+    for (uintptr_t message_i = 1; message_i <= pushed_n; message_i++)
+    {
+      assert((uintptr_t)queue_pull_next(&large_reader) == message_i);
+    }
+    assert(queue_pull_next(&large_reader) == NULL);
+    free(large_storage);
+  }
+
+  // batches and spans
+  {
+    Queue batch_queue;
+    void* batch_storage[QUEUE_TEST_CAPACITY];
+    queue_init(&batch_queue, batch_storage, QUEUE_TEST_CAPACITY, QueueOverflow_Fail);
+    QueueWriter batch_writer = {.queue = &batch_queue};
+    QueueReader batch_reader = {.queue = &batch_queue};
+    void* messages[QUEUE_TEST_CAPACITY + 44];
+    for (uintptr_t message_i = 0; message_i < QUEUE_TEST_CAPACITY + 44; message_i++)
+    {
+      messages[message_i] = (void*)(message_i + 1);
+    }
+    assert(queue_push_n(&batch_writer, messages, QUEUE_TEST_CAPACITY + 44) ==
+           QUEUE_TEST_CAPACITY);
+
+    void* pulled[100];
+    assert(queue_pull_n(&batch_reader, pulled, 100) == 100);
+    assert((uintptr_t)pulled[0] == 1 && (uintptr_t)pulled[99] == 100);
+    assert(queue_push_n(&batch_writer, &messages[QUEUE_TEST_CAPACITY], 44) == 44);
+
+    // the rest is in two spans, before and after the wrap-around
+    QueueSpan span = queue_read_span(&batch_reader);
+    assert(span.n == QUEUE_TEST_CAPACITY - 100 && (uintptr_t)span.data[0] == 101);
+    queue_read_commit(&batch_reader, span.n);
+    span = queue_read_span(&batch_reader);
+    assert(span.n == 44 && (uintptr_t)span.data[43] == QUEUE_TEST_CAPACITY + 44);
+    queue_read_commit(&batch_reader, span.n);
+    assert(queue_read_span(&batch_reader).n == 0);
+
+    span = queue_write_span(&batch_writer);
+    assert(span.n == QUEUE_TEST_CAPACITY - 44);
+    span.data[0] = (void*)1;
+    queue_write_commit(&batch_writer, 1);
+    assert((uintptr_t)queue_pull_next(&batch_reader) == 1);
+    assert(queue_pull_next(&batch_reader) == NULL);
+    queue_writer_free(&batch_writer);
+  }
+
+  // messages of varied sizes copied into the byte ring, across its end
+  {
+    ByteQueue byte_queue = {0};
+    ByteQueueWriter byte_writer = {.queue = &byte_queue};
+    ByteQueueReader byte_reader = {.queue = &byte_queue};
+    ByteQueueMessage message;
+    assert(!byte_queue_peek(&byte_reader, &message));
+
+    uint8_t payload[300];
+    uint32_t pushed_n = 0, pulled_n = 0;
+    for (int round_i = 0; round_i < 100; round_i++)
+    {
+      // fill up, then take half of it
+      for (;;)
+      {
+        uint32_t size = pushed_n % 300;
+        memset(payload, (uint8_t)pushed_n, size);
+        if (!byte_queue_push(&byte_writer, 1 + pushed_n % 3, payload, size))
+          break;
+        pushed_n++;
+      }
+      uint32_t pulled_l =
+        round_i == 99 ? pushed_n : pulled_n + (pushed_n - pulled_n + 1) / 2;
+      for (; pulled_n < pulled_l; pulled_n++)
+      {
+        assert(byte_queue_peek(&byte_reader, &message));
+        assert(message.type == 1 + pulled_n % 3 && message.size == pulled_n % 300);
+        assert((uintptr_t)message.payload % BYTE_QUEUE_ALIGNMENT == 0);
+        uint8_t const* bytes = message.payload;
+        assert(message.size == 0 || bytes[message.size - 1] == (uint8_t)pulled_n);
+        byte_queue_pop(&byte_reader);
+      }
+    }
+    assert(pushed_n > 1000);
+    assert(!byte_queue_peek(&byte_reader, &message));
+  }
+
+  // many producers
+  {
+    MpscQueue mpsc_queue;
+    mpsc_queue_init(&mpsc_queue);
+    assert(mpsc_queue_pull_next(&mpsc_queue) == NULL);
+    uintptr_t pushed_n = 0;
+    while (mpsc_queue_push(&mpsc_queue, (void*)(pushed_n + 1)))
+      pushed_n++;
+    assert(pushed_n == MPSC_QUEUE_CAPACITY_POT);
+
+    void* pulled[100];
+    assert(mpsc_queue_pull_n(&mpsc_queue, pulled, 100) == 100);
+    assert((uintptr_t)pulled[99] == 100);
+    assert(mpsc_queue_push(&mpsc_queue, (void*)(pushed_n + 1)));
+    for (uintptr_t message_i = 101; message_i <= pushed_n + 1; message_i++)
+    {
+      assert((uintptr_t)mpsc_queue_pull_next(&mpsc_queue) == message_i);
+    }
+    assert(mpsc_queue_pull_next(&mpsc_queue) == NULL);
+
+    queue__test_mpsc(4, 10000);
+  }
+
+  // between two threads
+  {
+    Queue thread_queue;
+    void* thread_storage[QUEUE_TEST_CAPACITY];
+    queue_init(&thread_queue, thread_storage, QUEUE_TEST_CAPACITY, QueueOverflow_Fail);
+    QueueTestProducer producer = {.writer.queue = &thread_queue, .messages_n = 10000};
+    QueueReader thread_reader = {.queue = &thread_queue};
+    Thread thread;
+    thread_start(&thread, queue__test_produce, &producer);
+    queue__test_consume(&thread_reader, producer.messages_n);
+    thread_join(&thread);
+    assert(queue_pull_next(&thread_reader) == NULL);
+  }
+
+  // between two threads, dropping the oldest messages when full, and with a small
+  // queue pulled in batches, so that the writer often drops past the reader's index
+  for (int variant_i = 0; variant_i < 2; variant_i++)
+  {
+    enum
+    {
+      PULL_MAX = 64,
+    };
+    uint32_t capacity = variant_i == 0 ? QUEUE_TEST_CAPACITY : 4;
+    size_t pull_max = variant_i == 0 ? 1 : PULL_MAX;
+    Queue thread_queue;
+    void* thread_storage[QUEUE_TEST_CAPACITY];
+    queue_init(&thread_queue, thread_storage, capacity, QueueOverflow_DropOldest);
+    QueueTestProducer producer = {
+      .writer.queue = &thread_queue,
+      .messages_n = variant_i == 0 ? 10000 : 1000000,
+    };
+    QueueReader thread_reader = {.queue = &thread_queue};
+    Thread thread;
+    thread_start(&thread, queue__test_produce, &producer);
+    uintptr_t last_message_i = 0, pulled_n = 0;
+    uint32_t spins_n = 0;
+    while (last_message_i < producer.messages_n)
+    {
+      void* messages[PULL_MAX];
+      size_t messages_n = queue_pull_n(&thread_reader, messages, pull_max);
+      if (messages_n == 0)
+      {
+        // the batched pulls keep spinning, to also be preempted while reading
+        if (pull_max == 1)
+          queue__test_backoff(&spins_n);
+        continue;
+      }
+      for (size_t message_i = 0; message_i < messages_n; message_i++)
+      {
+        assert((uintptr_t)messages[message_i] > last_message_i);
+        last_message_i = (uintptr_t)messages[message_i];
+      }
+      pulled_n += messages_n;
+    }
+    thread_join(&thread);
+    assert(pulled_n + producer.writer.dropped_n == producer.messages_n);
   }
-  assert(buf_len(writer.writer_buffer) == 1);
 
-  assert((uintptr_t)queue_pull_next(&reader) == 1);
-  queue_push(&writer, (void*)next_message_i++);
-  assert(buf_len(writer.writer_buffer) == 1);
+  return 0;
+}
+
+// Benchmarks
+
+#include "xxxx_bench.h"
+
+enum
+{
+  BENCH_QUEUE_MESSAGES_N = 1 << 22,
+};
 
-  // read all
-  void* read;
-  uintptr_t last_read_message_i;
-  do
+// same as queue__test_produce, a span at a time
+static void bench_queue__produce_spans(void* data)
+{
+  QueueTestProducer* producer = data;
+  uint32_t spins_n = 0;
+  for (uintptr_t message_i = 1; message_i <= producer->messages_n;)
   {
-    read = queue_pull_next(&reader);
-    if (read)
+    QueueSpan span = queue_write_span(&producer->writer);
+    if (span.n == 0)
+    {
+      queue__test_backoff(&spins_n);
+      continue;
+    }
+    size_t index;
+    for (index = 0; index < span.n && message_i <= producer->messages_n; index++)
     {
-      last_read_message_i = (uintptr_t)read;
+      span.data[index] = (void*)message_i++;
     }
-  } while (queue_flush(&writer) || read);
-  assert(last_read_message_i == next_message_i - 1);
+    queue_write_commit(&producer->writer, index);
+  }
+}
 
-  queue_push(&writer, (void*)next_message_i++);
-  assert(buf_len(writer.writer_buffer) == 0);
+// same as queue__test_consume, a span at a time
+static void bench_queue__consume_spans(QueueReader* reader, uintptr_t messages_n)
+{
+  uint32_t spins_n = 0;
+  for (uintptr_t message_i = 1; message_i <= messages_n;)
+  {
+    QueueSpan span = queue_read_span(reader);
+    if (span.n == 0)
+    {
+      queue__test_backoff(&spins_n);
+      continue;
+    }
+    for (size_t index = 0; index < span.n; index++)
+    {
+      assert((uintptr_t)span.data[index] == message_i);
+      message_i++;
+    }
+    queue_read_commit(reader, span.n);
+  }
+}
+
+static void bench_queue__run(Bench* bench, char const* name, bool use_spans)
+{
+  Queue queue;
+  void* queue_storage[QUEUE_TEST_CAPACITY];
+  queue_init(&queue, queue_storage, QUEUE_TEST_CAPACITY, QueueOverflow_Fail);
+  QueueTestProducer producer = {.writer.queue = &queue,
+                                .messages_n = BENCH_QUEUE_MESSAGES_N};
+  QueueReader reader = {.queue = &queue};
+  uint64_t begin_ns = thread_clock_ns();
+  Thread thread;
+  thread_start(&thread, use_spans ? bench_queue__produce_spans : queue__test_produce,
+               &producer);
+  if (use_spans)
+    bench_queue__consume_spans(&reader, producer.messages_n);
+  else
+    queue__test_consume(&reader, producer.messages_n);
+  thread_join(&thread);
+  uint64_t elapsed_ns = thread_clock_ns() - begin_ns;
+  bench_result(bench, name, 2, BENCH_QUEUE_MESSAGES_N,
+               BENCH_QUEUE_MESSAGES_N / (elapsed_ns / 1e9), "msg/s");
+}
+
+int bench_queue(int argc, char const** argv)
+{
+  Bench bench = bench_begin(argc, argv);
+  bench_queue__run(&bench, "queue.spsc", false);
+  bench_queue__run(&bench, "queue.spsc.spans", true);
+  for (uint32_t producers_n = 1; producers_n <= QUEUE_TEST_PRODUCERS_MAX;
+       producers_n *= 2)
+  {
+    uintptr_t messages_n = BENCH_QUEUE_MESSAGES_N / producers_n;
+    uint64_t elapsed_ns = queue__test_mpsc(producers_n, messages_n);
+    bench_result(&bench, "queue.mpsc", producers_n + 1, producers_n * messages_n,
+                 producers_n * messages_n / (elapsed_ns / 1e9), "msg/s");
+  }
+  bench_end(&bench);
   return 0;
 }
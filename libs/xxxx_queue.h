@@ -2,39 +2,191 @@
 #define XXXX_QUEUE
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-/* single consumer single producer queue for cross thread work synchronization */
+/* single consumer single producer queue for cross thread work synchronization
+ *
+ * The writer publishes messages by storing its index after writing them (release), the
+ * reader loads that index before reading them (acquire), and the other way around for
+ * the slots the reader frees. Each side keeps the last index it saw from the other side,
+ * and only loads it again when the queue looks full or empty. */
 
 enum
 {
-  QUEUE_CAPACITY_POT = 256,
+  QUEUE_CACHE_LINE_SIZE = 64,
 };
 
+// what queue_push does when the queue is full
+typedef enum QueueOverflow
+{
+  QueueOverflow_Fail,       // returns false, the caller keeps the message
+  QueueOverflow_DropNewest, // drops the pushed message
+  QueueOverflow_DropOldest, // drops the oldest unread message to make room
+  // keeps the pushed message in the writer until there is room, in place of any message
+  // kept before: for messages that each replace the previous one, such as states
+  QueueOverflow_OverwriteLatest,
+} QueueOverflow;
+
 typedef struct Queue
 {
-  void* data[QUEUE_CAPACITY_POT];
-  uint32_t writer_index;
-  uint32_t reader_index;
+  // the indices are on their own cache line, so that the writer and the reader do not
+  // invalidate each other's line on every message
+  uint32_t writer_index; // @atomic
+  char writer_padding[QUEUE_CACHE_LINE_SIZE - sizeof(uint32_t)];
+  uint32_t reader_index; // @atomic also advanced by the writer with DropOldest
+  char reader_padding[QUEUE_CACHE_LINE_SIZE - sizeof(uint32_t)];
+  QueueOverflow overflow;
+  uint32_t capacity; // power of two
+  void** data;       // @atomic
 } Queue;
 
 typedef struct QueueWriter
 {
   Queue* queue;
-  void** writer_buffer;
+  uint32_t reader_index; // last seen
+  uint32_t dropped_n;    // messages dropped or overwritten because the queue was full
+  void* latest;          // with OverwriteLatest, waiting for room
 } QueueWriter;
 
 typedef struct QueueReader
 {
   Queue* queue;
+  uint32_t writer_index; // last seen
 } QueueReader;
 
+// \param storage `capacity` slots, static or from any allocator, outliving the queue
+// \pre `capacity` is a power of two
+void queue_init(Queue* queue, void** storage, uint32_t capacity, QueueOverflow overflow);
 void queue_free(Queue* queue);
 void queue_reader_free(QueueReader* queue);
 void queue_writer_free(QueueWriter* queue);
 
-void queue_push(QueueWriter* queue, void* data);
+// \pre `data` is not null
+// \return false when the queue is full and its overflow policy is Fail
+bool queue_push(QueueWriter* queue, void* data);
+// Pushes `data[0..n)` in order, publishing as many as fit at once, then applies the
+// overflow policy to the rest.
+//
+// \return how many were pushed before the queue was full with Fail, `n` otherwise
+size_t queue_push_n(QueueWriter* queue, void* const* data, size_t n);
+// publishes the message kept with OverwriteLatest, returns whether it is still waiting
 bool queue_flush(QueueWriter* queue);
 void* queue_pull_next(QueueReader* queue);
+// pulls up to `n` messages into `d_data` at once, returns how many
+size_t queue_pull_n(QueueReader* queue, void** d_data, size_t n);
+
+/* Zero-copy access to the queue's slots: get a span, write or read its first messages
+ * in place, then commit how many. A span stops where the ring wraps around, so that a
+ * second span may follow. */
+
+typedef struct QueueSpan
+{
+  void** data;
+  size_t n;
+} QueueSpan;
+
+// empty while a message kept with OverwriteLatest is still waiting for room
+QueueSpan queue_write_span(QueueWriter* queue);
+// \pre `n` is at most the size of the span returned by the last queue_write_span
+void queue_write_commit(QueueWriter* queue, size_t n);
+// \pre the overflow policy is not DropOldest, which could overwrite the span
+QueueSpan queue_read_span(QueueReader* queue);
+// \pre `n` is at most the size of the span returned by the last queue_read_span
+void queue_read_commit(QueueReader* queue, size_t n);
+
+/* single consumer single producer ring of variable-length messages, copied inline
+ *
+ * Each message is a header (type and size) followed by its payload, aligned to
+ * BYTE_QUEUE_ALIGNMENT. A message never wraps around: when it does not fit before the
+ * end of the ring, the writer fills the end with padding and starts over at the front.
+ * Messages are plain data, so that sending one needs no allocation. */
+
+enum
+{
+  BYTE_QUEUE_CAPACITY_POT = 4096,
+  BYTE_QUEUE_ALIGNMENT = 8,
+  BYTE_QUEUE_TYPE_PADDING = 0, // reserved, message types start at 1
+};
+
+typedef struct ByteQueue
+{
+  uint32_t writer_index; // @atomic in bytes
+  char writer_padding[QUEUE_CACHE_LINE_SIZE - sizeof(uint32_t)];
+  uint32_t reader_index; // @atomic in bytes
+  char reader_padding[QUEUE_CACHE_LINE_SIZE - sizeof(uint32_t)];
+  uint64_t data[BYTE_QUEUE_CAPACITY_POT / sizeof(uint64_t)];
+} ByteQueue;
+
+typedef struct ByteQueueWriter
+{
+  ByteQueue* queue;
+  uint32_t reader_index;   // last seen
+  uint32_t reserved_index; // end of the message being written
+} ByteQueueWriter;
+
+typedef struct ByteQueueReader
+{
+  ByteQueue* queue;
+  uint32_t writer_index; // last seen
+} ByteQueueReader;
+
+typedef struct ByteQueueMessage
+{
+  uint32_t type;
+  uint32_t size;
+  void* payload; // in the ring, until byte_queue_pop
+} ByteQueueMessage;
+
+// Reserves room for a message and returns where to write its payload, or NULL when the
+// ring is full. The message is sent by byte_queue_write_commit.
+//
+// \pre `type` is not BYTE_QUEUE_TYPE_PADDING
+void* byte_queue_write_begin(ByteQueueWriter* writer, uint32_t type, uint32_t size);
+void byte_queue_write_commit(ByteQueueWriter* writer);
+// copies `payload`, returns false when the ring is full
+bool byte_queue_push(ByteQueueWriter* writer,
+                     uint32_t type,
+                     void const* payload,
+                     uint32_t size);
+
+// \return false when there are no messages
+bool byte_queue_peek(ByteQueueReader* reader, ByteQueueMessage* d_message);
+// frees the message returned by byte_queue_peek
+void byte_queue_pop(ByteQueueReader* reader);
+
+/* multiple producers single consumer bounded queue
+ *
+ * Each slot has a sequence number telling whether it is free for the producer claiming
+ * that index, or holds a message for the reader at that index. Producers claim indices
+ * with a compare-exchange, so that they only contend on it and not on the slots.
+ * @url: https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue */
+
+enum
+{
+  MPSC_QUEUE_CAPACITY_POT = 256,
+};
+
+typedef struct MpscQueueSlot
+{
+  uint32_t sequence; // @atomic
+  void* data;
+} MpscQueueSlot;
+
+typedef struct MpscQueue
+{
+  uint32_t writer_index; // @atomic
+  char writer_padding[QUEUE_CACHE_LINE_SIZE - sizeof(uint32_t)];
+  uint32_t reader_index; // only used by the reader
+  char reader_padding[QUEUE_CACHE_LINE_SIZE - sizeof(uint32_t)];
+  MpscQueueSlot slots[MPSC_QUEUE_CAPACITY_POT];
+} MpscQueue;
+
+void mpsc_queue_init(MpscQueue* queue);
+// from any thread, returns false when the queue is full
+bool mpsc_queue_push(MpscQueue* queue, void* data);
+// from the reader thread, as for Queue
+void* mpsc_queue_pull_next(MpscQueue* queue);
+size_t mpsc_queue_pull_n(MpscQueue* queue, void** d_data, size_t n);
 
 #endif
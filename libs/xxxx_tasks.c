@@ -1,272 +1,2002 @@
 #include "xxxx_tasks.h"
 
+#include "xxxx_atomic.h"
 #include "xxxx_buf.h"
-
-#include <windows.h>
+#include "xxxx_thread.h"
 
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 
-typedef struct Mutex
+typedef struct Task
 {
-#if defined(_WIN32)
-  CRITICAL_SECTION critical_section;
-#endif
-} Mutex;
+  TaskHandle handle; // @atomic
+  TaskFn* task_function;
+  void* task_data;
+  char const* name;
+  uint64_t trace_serial; // unique in traces, 0 when created with tracing disabled
+  uint64_t run_begin_ns; // when traced, since the task started or continued
+  TaskPriority priority;
+  uint32_t pending_n; // @atomic unfinished predecessors, plus one until released
+  uint32_t released;  // @atomic started explicitly or by a predecessor
+  uint32_t cancelled; // @atomic
+  uint32_t lock;      // @atomic spin lock for the fields below
+  TaskHandle* dependencies;
+  uint32_t waiters_n; // threads in task_wait, the last one frees the task
+  struct TaskFiber** waiting_fibers_buf; // suspended in task_wait
+  uint32_t done;      // @atomic
+  uint32_t next_free_index; // @atomic in the free list
+} Task;
 
-void mtx_init(Mutex* mutex)
+enum
 {
-  InitializeCriticalSection(&mutex->critical_section);
-}
+  TASK_INDEX_MASK = ((1 << 24) - 1),
+  TASK_GENERATION_OFFSET = 24,
+  TASK_INDEX_NONE = TASK_INDEX_MASK,
+  TASK_PAGE_SIZE_LOG2 = 12,
+  TASK_PAGE_SIZE = 1 << TASK_PAGE_SIZE_LOG2,
+  TASK_PAGES_MAX = (TASK_INDEX_MASK + 1) / TASK_PAGE_SIZE,
+  TASK_WORKERS_MAX = 64,
+  TASK_DEQUE_CAP = 4096, // power of two
+  TASK_TRACE_RING_CAP = 1 << 15, // power of two
+  TASK_FIBER_STACK_SIZE = 256 << 10,
+  TASK_FIBERS_PER_WORKER_MAX = 64, // then tasks run on the worker's stack
+  TASK_IO_THREADS_N = 32,          // blocking calls in flight
+};
+
+// Chase-Lev work-stealing deque of task handles.
+//
+// The owner worker pushes and pops at the bottom, other workers steal from the top. It
+// does not grow: when full, tasks go to the shared input queue instead.
+typedef struct TaskDeque
+{
+  uint32_t top;    // @atomic
+  char top_padding[60];
+  uint32_t bottom; // @atomic
+  char bottom_padding[60];
+  uint32_t items[TASK_DEQUE_CAP]; // @atomic
+} TaskDeque;
 
-void mtx_deinit(Mutex* mutex)
+static bool task_deque__push(TaskDeque* deque, TaskHandle handle)
 {
-  DeleteCriticalSection(&mutex->critical_section);
+  uint32_t bottom = deque->bottom; // only written by the owner
+  uint32_t top = atomic_load_uint32(&deque->top);
+  if (bottom - top >= TASK_DEQUE_CAP)
+    return false;
+
+  atomic_store_uint32(&deque->items[bottom & (TASK_DEQUE_CAP - 1)], (uint32_t)handle.id);
+  atomic_store_uint32(&deque->bottom, bottom + 1);
+  return true;
 }
 
-void mtx_lock(Mutex* mutex)
+static TaskHandle task_deque__pop(TaskDeque* deque)
 {
-  EnterCriticalSection(&mutex->critical_section);
+  TaskHandle handle = {0};
+  uint32_t bottom = deque->bottom - 1;
+  atomic_exchange_uint32(&deque->bottom, bottom); // must be ordered before loading top
+  uint32_t top = atomic_load_uint32(&deque->top);
+  if ((int32_t)(bottom - top) < 0)
+  {
+    atomic_store_uint32(&deque->bottom, bottom + 1); // empty
+    return handle;
+  }
+
+  handle.id = (int)atomic_load_uint32(&deque->items[bottom & (TASK_DEQUE_CAP - 1)]);
+  if (bottom == top)
+  {
+    // last item, race against thieves
+    if (!atomic_compare_exchange_uint32(&deque->top, &top, top + 1))
+      handle.id = 0;
+    atomic_store_uint32(&deque->bottom, bottom + 1);
+  }
+  return handle;
 }
 
-void mtx_unlock(Mutex* mutex)
+static TaskHandle task_deque__steal(TaskDeque* deque)
 {
-  LeaveCriticalSection(&mutex->critical_section);
+  TaskHandle handle = {0};
+  uint32_t top = atomic_load_uint32(&deque->top);
+  atomic_fence_seq_cst();
+  uint32_t bottom = atomic_load_uint32(&deque->bottom);
+  if ((int32_t)(bottom - top) <= 0)
+    return handle;
+
+  uint32_t id = atomic_load_uint32(&deque->items[top & (TASK_DEQUE_CAP - 1)]);
+  if (atomic_compare_exchange_uint32(&deque->top, &top, top + 1))
+    handle.id = (int)id;
+  return handle;
 }
 
-typedef struct Task
+// tasks started outside of the workers, or that did not fit in a deque
+typedef struct TaskInputQueue
 {
-  TaskHandle handle;
-  TaskFn* task_function;
-  void* task_data;
-  TaskHandle* dependencies;
-} Task;
+  TaskHandle* handles_buf;
+  size_t head; // first task not yet taken
+} TaskInputQueue;
+
+enum
+{
+  TaskFiberState_Running,
+  TaskFiberState_Parked, // suspended, waiting to be resumed
+  TaskFiberState_Woken,  // resumed before it was parked
+};
+
+// A task running on its own stack, so that it can suspend without blocking its worker.
+// Fibers only ever run on the worker that created them.
+typedef struct TaskFiber
+{
+  Fiber fiber;
+  struct TaskWorker* worker;
+  Task* task;
+  bool is_completed; // the task returned
+  uint32_t state;    // @atomic TaskFiberState_*
+} TaskFiber;
+
+typedef struct TaskWorker
+{
+  TaskDeque deques[TaskPriority_Count];
+  Thread thread;
+  uint32_t index;
+  Fiber thread_fiber;         // where the fibers switch back to
+  TaskFiber* running_fiber;   // null on the thread's own stack
+  TaskFiber** idle_fibers_buf;
+  uint32_t fibers_n;
+  Mutex resumed_lock;
+  TaskFiber** resumed_buf;    // suspended fibers ready to continue
+  size_t resumed_head;        // first not yet continued
+  uint64_t found_n;           // tasks this worker took, for the statistics
+  uint64_t stolen_n;          // of which were stolen from other workers
+} TaskWorker;
+
+// a blocking call made on an I/O thread for a suspended task
+typedef struct TaskIoCall
+{
+  TaskIoFn* io_function;
+  void* io_data;
+  TaskFiber* fiber;
+  Task* task; // the call sees it as the current task, e.g. for its cancellation
+} TaskIoCall;
+
+// A task that ran, or an edge to one of its dependents, or a time the thread slept.
+typedef struct TaskTraceEvent
+{
+  uint64_t begin_ns;          // @atomic
+  uint64_t end_ns;            // @atomic
+  uint64_t serial;            // @atomic of the task, 0 while sleeping
+  uint64_t dependency_serial; // @atomic of the dependent for an edge, otherwise 0
+  char const* name;           // @atomic
+} TaskTraceEvent;
+
+// Events recorded by one thread, without locks. Only the most recent ones are kept.
+typedef struct TaskTraceRing
+{
+  uint32_t thread_id;
+  uint64_t events_n; // @atomic ever recorded
+  TaskTraceEvent events[TASK_TRACE_RING_CAP];
+} TaskTraceRing;
 
+// Tasks are allocated in pages that never move, so that they can be accessed without
+// locks. Free slots are kept in a lock-free stack, whose head packs a tag incremented on
+// every change (against ABA) with the index of the first free slot.
 static bool g_task_init;
-static Mutex g_tasks_lock;
-static Task* g_tasks = NULL;
-static int g_worker_thread_mustrun = 0;
-static HANDLE g_worker_thread;
+static Mutex g_task_pages_lock;
+static Task* g_task_pages[TASK_PAGES_MAX]; // @atomic
+static uint32_t g_tasks_n;                 // @atomic slots ever allocated
+static uint64_t g_tasks_free_head;         // @atomic tag << 32 | index
+static TaskWorker* g_workers; // [g_workers_n]
+static uint32_t g_workers_n;
+static uint32_t g_workers_mustrun = 0;     // @atomic
+static uint32_t g_workers_sleeping_n = 0;  // @atomic
+static uint32_t g_work_epoch = 0;          // @atomic incremented when work is added
+static uint64_t g_task_found_n;            // @atomic added by the workers when they stop
+static uint64_t g_task_stolen_n;           // @atomic
 static Mutex g_worker_thread_input_lock;
-static TaskHandle* g_worker_thread_input = NULL;
+static TaskInputQueue g_worker_thread_input[TaskPriority_Count];
+static THREAD_LOCAL TaskWorker* g_current_worker;
+static THREAD_LOCAL TaskPriority g_current_priority; // of the running task
+static THREAD_LOCAL Task* g_current_task;
+static THREAD_LOCAL uint32_t g_steal_seed;
 
-enum
+static bool g_task_fibers;
+static Mutex g_task_io_lock;
+static CondVar g_task_io_calls_cond;
+static TaskIoCall* g_task_io_calls_buf;
+static size_t g_task_io_calls_head;
+static bool g_task_io_mustrun;
+static Thread g_task_io_threads[TASK_IO_THREADS_N];
+
+static uint32_t g_task_trace_enabled; // @atomic
+static uint64_t g_task_trace_serial;  // @atomic
+static Mutex g_task_trace_lock;
+static TaskTraceRing** g_task_trace_rings_buf;
+static uint32_t g_task_trace_rings_generation; // the rings are freed by task_deinit
+static THREAD_LOCAL TaskTraceRing* g_current_trace_ring;
+static THREAD_LOCAL uint32_t g_current_trace_ring_generation;
+
+static Task* task__slot(uint32_t index)
 {
-  TASK_INDEX_MASK = ((1 << 24) - 1),
-  TASK_GENERATION_OFFSET = 24,
-};
+  Task* page = atomic_load_ptr((void**)&g_task_pages[index >> TASK_PAGE_SIZE_LOG2]);
+  return &page[index & (TASK_PAGE_SIZE - 1)];
+}
 
-static Task* task__get(TaskHandle handle, Task* const tasks)
+static Task* task__get(TaskHandle handle)
 {
   uint32_t index = handle.id & TASK_INDEX_MASK;
-  assert(index < buf_len(tasks));
-  if (index >= buf_len(tasks))
+  assert(index < atomic_load_uint32(&g_tasks_n));
+  if (index >= atomic_load_uint32(&g_tasks_n))
     return NULL;
 
-  Task* task = &tasks[index];
-  assert(task->handle.id == handle.id);
-  if (task->handle.id != handle.id)
+  Task* task = task__slot(index);
+  assert(atomic_load_uint32((uint32_t*)&task->handle.id) == (uint32_t)handle.id);
+  if (atomic_load_uint32((uint32_t*)&task->handle.id) != (uint32_t)handle.id)
     return NULL;
 
   return task;
 }
 
-static void task__run(Task task)
+// returns a slot that is not in use, or null when all indices are taken
+static Task* task__alloc(void)
 {
-  task.task_function(task.task_data);
-  for (TaskHandle* dep_f = &task.dependencies[0]; dep_f < buf_end(task.dependencies);
-       dep_f++)
+  uint64_t head = atomic_load_uint64(&g_tasks_free_head);
+  for (;;)
+  {
+    uint32_t index = (uint32_t)head;
+    if (index == TASK_INDEX_NONE)
+      break;
+    // the slot may be taken and freed again concurrently, then the tag changed too
+    uint32_t next_index = atomic_load_uint32(&task__slot(index)->next_free_index);
+    uint64_t next_head = ((head >> 32) + 1) << 32 | next_index;
+    if (atomic_compare_exchange_uint64(&g_tasks_free_head, &head, next_head))
+      return task__slot(index);
+  }
+
+  uint32_t index = atomic_fetch_add_uint32(&g_tasks_n, 1);
+  if (index >= TASK_INDEX_NONE)
+  {
+    atomic_fetch_add_uint32(&g_tasks_n, (uint32_t)-1);
+    return NULL;
+  }
+
+  uint32_t page_i = index >> TASK_PAGE_SIZE_LOG2;
+  if (!atomic_load_ptr((void**)&g_task_pages[page_i]))
   {
-    task_start(*dep_f);
+    mtx_lock(&g_task_pages_lock);
+    if (!g_task_pages[page_i])
+    {
+      Task* page = calloc(TASK_PAGE_SIZE, sizeof *page);
+      assert(page);
+      atomic_store_ptr((void**)&g_task_pages[page_i], page);
+    }
+    mtx_unlock(&g_task_pages_lock);
   }
-  buf_reset(task.dependencies);
+
+  Task* task = task__slot(index);
+  task->handle.id = (int)(1u << TASK_GENERATION_OFFSET | index);
+  return task;
 }
 
+// invalidates the handles to the task and puts it back in the free list
 static void task__free(Task* task)
 {
   task->task_function = NULL;
+  uint32_t index = task->handle.id & TASK_INDEX_MASK;
+  uint8_t generation = (uint8_t)(task->handle.id >> TASK_GENERATION_OFFSET) + 1;
+  if (generation == 0)
+    generation = 1; // so that the handle is never null
+  atomic_store_uint32((uint32_t*)&task->handle.id,
+                      (uint32_t)generation << TASK_GENERATION_OFFSET | index);
+
+  uint64_t head = atomic_load_uint64(&g_tasks_free_head);
+  do
+  {
+    atomic_store_uint32(&task->next_free_index, (uint32_t)head);
+  } while (!atomic_compare_exchange_uint64(
+    &g_tasks_free_head, &head, ((head >> 32) + 1) << 32 | index));
 }
 
-static DWORD task__worker_thread_run(LPVOID lpParameter)
+static void task__lock(Task* task)
 {
-  (void)lpParameter;
-  while (g_worker_thread_mustrun)
+  uint32_t unlocked = 0;
+  while (!atomic_compare_exchange_uint32(&task->lock, &unlocked, 1))
   {
-    TaskHandle* pending = NULL;
-    mtx_lock(&g_worker_thread_input_lock);
-    for (TaskHandle* th_i = &g_worker_thread_input[0];
-         th_i < buf_end(g_worker_thread_input); th_i++)
-    {
-      buf_push(pending, *th_i);
-    }
-    buf_reset(g_worker_thread_input);
-    mtx_unlock(&g_worker_thread_input_lock);
+    unlocked = 0;
+    atomic_pause();
+  }
+}
 
-    for (TaskHandle* th_i = &pending[0]; th_i < buf_end(pending); th_i++)
-    {
-      mtx_lock(&g_tasks_lock);
-      Task task = *task__get(*th_i, g_tasks);
-      mtx_unlock(&g_tasks_lock);
+static void task__unlock(Task* task)
+{
+  atomic_store_uint32(&task->lock, 0);
+}
 
-      task__run(task);
+static TaskTraceRing* task__trace_ring(void)
+{
+  TaskTraceRing* ring = g_current_trace_ring;
+  if (ring && g_current_trace_ring_generation == g_task_trace_rings_generation)
+    return ring;
 
-      mtx_lock(&g_tasks_lock);
-      task__free(task__get(*th_i, g_tasks));
-      mtx_unlock(&g_tasks_lock);
-    }
-    buf_free(pending), pending = NULL;
-    Sleep(1);
+  ring = calloc(1, sizeof *ring);
+  assert(ring);
+  mtx_lock(&g_task_trace_lock);
+  // workers keep their index, the other threads come after them
+  ring->thread_id = g_current_worker
+                      ? g_current_worker->index
+                      : TASK_WORKERS_MAX + (uint32_t)buf_len(g_task_trace_rings_buf);
+  buf_push(g_task_trace_rings_buf, ring);
+  mtx_unlock(&g_task_trace_lock);
+  g_current_trace_ring = ring;
+  g_current_trace_ring_generation = g_task_trace_rings_generation;
+  return ring;
+}
+
+static void task__trace_record(uint64_t begin_ns,
+                               uint64_t end_ns,
+                               uint64_t serial,
+                               uint64_t dependency_serial,
+                               char const* name)
+{
+  TaskTraceRing* ring = task__trace_ring();
+  uint64_t event_i = ring->events_n; // only written by this thread
+  TaskTraceEvent* event = &ring->events[event_i & (TASK_TRACE_RING_CAP - 1)];
+  atomic_store_uint64(&event->begin_ns, begin_ns);
+  atomic_store_uint64(&event->end_ns, end_ns);
+  atomic_store_uint64(&event->serial, serial);
+  atomic_store_uint64(&event->dependency_serial, dependency_serial);
+  atomic_store_ptr((void**)&event->name, (void*)name);
+  atomic_store_uint64(&ring->events_n, event_i + 1);
+}
+
+static void task__wake_workers(void)
+{
+  atomic_fetch_add_uint32(&g_work_epoch, 1);
+  atomic_fence_seq_cst(); // order the epoch before reading the sleepers
+  if (atomic_load_uint32(&g_workers_sleeping_n) == 0)
+    return;
+
+  futex_wake_one(&g_work_epoch);
+}
+
+static void task__schedule(Task* task, TaskHandle task_handle)
+{
+  // tasks started from a task go to the worker's own deque, where idle workers steal them
+  TaskWorker* worker = g_current_worker;
+  if (!worker || !task_deque__push(&worker->deques[task->priority], task_handle))
+  {
+    mtx_lock(&g_worker_thread_input_lock);
+    TaskHandle* handles_buf = g_worker_thread_input[task->priority].handles_buf;
+    buf_push(handles_buf, task_handle);
+    g_worker_thread_input[task->priority].handles_buf = handles_buf;
+    mtx_unlock(&g_worker_thread_input_lock);
   }
+  task__wake_workers();
+}
 
-  return 0;
+static void task__decrement_pending(Task* task, TaskHandle handle)
+{
+  uint32_t previous_n = atomic_fetch_add_uint32(&task->pending_n, (uint32_t)-1);
+  assert(previous_n > 0);
+  if (previous_n == 1)
+    task__schedule(task, handle);
 }
 
-void task_init(void)
+// drops the reference that keeps a task from running before it is started
+static void task__release(Task* task, TaskHandle handle)
 {
-  assert(!g_task_init);
-  mtx_init(&g_tasks_lock);
-  g_task_init = true;
+  if (atomic_exchange_uint32(&task->released, 1) == 0)
+    task__decrement_pending(task, handle);
+}
 
-  mtx_init(&g_worker_thread_input_lock);
-  g_worker_thread_mustrun = 1;
-  g_worker_thread =
-    CreateThread(NULL /* lpThreadAttributes: inherit */, 0 /* dwStackSize: default */,
-                 task__worker_thread_run, NULL /* lpParameter */,
-                 0 /* dwCreationFlags: thread runs immediately */, NULL /* lpThreadId */);
+static bool task__is_traced(Task* task)
+{
+  return task->trace_serial && atomic_load_uint32(&g_task_trace_enabled);
 }
 
-void task_deinit(void)
+static void task__run(Task* task)
 {
-  assert(g_task_init);
-  g_worker_thread_mustrun = 0;
-  WaitForSingleObject(g_worker_thread, INFINITE);
-  CloseHandle(g_worker_thread);
-  mtx_deinit(&g_worker_thread_input_lock);
-  mtx_deinit(&g_tasks_lock);
-  buf_free(g_tasks);
-  buf_free(g_worker_thread_input);
-  g_task_init = false;
+  TaskPriority waiting_priority = g_current_priority; // when helping from task_wait
+  Task* waiting_task = g_current_task;
+  if (task__is_traced(task))
+    task->run_begin_ns = thread_clock_ns();
+  g_current_priority = task->priority;
+  g_current_task = task;
+  task->task_function(task->task_data);
+  g_current_priority = waiting_priority;
+  g_current_task = waiting_task;
+  if (task__is_traced(task))
+  {
+    task__trace_record(
+      task->run_begin_ns, thread_clock_ns(), task->trace_serial, 0, task->name);
+  }
 }
 
-TaskHandle task_create(TaskFn* task_function, void* task_data)
+static void task__resume_fiber(TaskFiber* task_fiber);
+
+// releases the dependents and the waiters of a task that returned
+static void task__complete(Task* task)
 {
-  assert(g_task_init);
-  mtx_lock(&g_tasks_lock);
-  Task* free_task;
-  for (free_task = &g_tasks[0]; free_task < buf_end(g_tasks) && free_task->task_function;
-       free_task++)
-    ;
+  bool is_traced = task__is_traced(task);
+  uint64_t end_ns = is_traced ? thread_clock_ns() : 0;
 
-  TaskHandle handle = {0};
+  // no dependencies are added once a task runs
+  for (TaskHandle* dep_f = &task->dependencies[0]; dep_f < buf_end(task->dependencies);
+       dep_f++)
+  {
+    Task* dependency = task__get(*dep_f);
+    if (is_traced && dependency->trace_serial)
+    {
+      task__trace_record(
+        end_ns, end_ns, task->trace_serial, dependency->trace_serial, NULL);
+    }
+    task__decrement_pending(dependency, *dep_f);
+  }
 
-  Task task = {
-    .task_function = task_function,
-    .task_data = task_data,
-  };
+  task__lock(task);
+  buf_reset(task->dependencies); // keeps the storage for the next task in this slot
+  atomic_store_uint32(&task->done, 1);
+  uint32_t waiters_n = task->waiters_n;
+  for (TaskFiber** fiber_i = &task->waiting_fibers_buf[0];
+       fiber_i < buf_end(task->waiting_fibers_buf); fiber_i++)
+  {
+    task__resume_fiber(*fiber_i);
+  }
+  buf_reset(task->waiting_fibers_buf);
+  task__unlock(task);
+
+  if (waiters_n == 0)
+  {
+    task__free(task);
+    return;
+  }
 
+  // the waiters sleep with the idle workers
+  atomic_fetch_add_uint32(&g_work_epoch, 1);
+  futex_wake_all(&g_work_epoch);
+}
+
+static void task__execute(TaskHandle handle)
+{
+  Task* task = task__get(handle);
+  task__run(task);
+  task__complete(task);
+}
 
-  if (free_task == buf_end(g_tasks))
+// Fibers
+//
+// With fibers, the workers start tasks on a fiber of their own. A task that waits,
+// for another task or for a blocking call, switches back to the worker's thread, which
+// runs other tasks until the fiber is resumed.
+
+static void task__fiber_run(void* fiber_data)
+{
+  TaskFiber* task_fiber = fiber_data;
+  for (;;)
   {
-    uint32_t index = (uint32_t)buf_len(g_tasks);
-    index &= TASK_INDEX_MASK;
-    assert((size_t)index == buf_len(g_tasks));
-    handle.id = (0x01 << TASK_GENERATION_OFFSET) | index;
-    task.handle = handle;
-    buf_push(g_tasks, task);
+    task__run(task_fiber->task);
+    task_fiber->is_completed = true;
+    fiber_switch(&task_fiber->fiber, &task_fiber->worker->thread_fiber);
   }
-  else
+}
+
+static void task__push_resumed(TaskWorker* worker, TaskFiber* task_fiber)
+{
+  mtx_lock(&worker->resumed_lock);
+  TaskFiber** resumed_buf = worker->resumed_buf;
+  buf_push(resumed_buf, task_fiber);
+  worker->resumed_buf = resumed_buf;
+  mtx_unlock(&worker->resumed_lock);
+}
+
+static TaskFiber* task__take_resumed(TaskWorker* worker)
+{
+  TaskFiber* task_fiber = NULL;
+  mtx_lock(&worker->resumed_lock);
+  if (worker->resumed_head < buf_len(worker->resumed_buf))
   {
-    uint32_t index = free_task->handle.id & TASK_INDEX_MASK;
-    uint8_t generation = free_task->handle.id >> TASK_GENERATION_OFFSET;
-    handle.id = (generation + 1) << TASK_GENERATION_OFFSET | index;
-    task.handle = handle;
-    *free_task = task;
+    task_fiber = worker->resumed_buf[worker->resumed_head++];
+    if (worker->resumed_head == buf_len(worker->resumed_buf))
+    {
+      buf_reset(worker->resumed_buf);
+      worker->resumed_head = 0;
+    }
   }
+  mtx_unlock(&worker->resumed_lock);
+  return task_fiber;
+}
 
-  // done_with_mutex:
-  mtx_unlock(&g_tasks_lock);
-  return handle;
+// makes a suspended fiber continue, from any thread
+static void task__resume_fiber(TaskFiber* task_fiber)
+{
+  if (atomic_exchange_uint32(&task_fiber->state, TaskFiberState_Woken) !=
+      TaskFiberState_Parked)
+    return; // its worker sees it when parking it
+
+  task__push_resumed(task_fiber->worker, task_fiber);
+  // only its worker can continue it
+  atomic_fetch_add_uint32(&g_work_epoch, 1);
+  futex_wake_all(&g_work_epoch);
 }
 
-/* Mark that `dependency` depends on `task`. Upon completion of `task` all its
- * dependencies are started. */
-void task_depends(TaskHandle task, TaskHandle dependency)
+// runs the fiber until its task returns or suspends
+// \pre called from the worker's own stack
+static void task__switch_to_fiber(TaskWorker* worker, TaskFiber* task_fiber)
 {
-  assert(task.id != dependency.id);
+  Task* waiting_task = g_current_task; // when helping from task_wait
+  TaskPriority waiting_priority = g_current_priority;
+  atomic_store_uint32(&task_fiber->state, TaskFiberState_Running);
+  worker->running_fiber = task_fiber;
+  fiber_switch(&worker->thread_fiber, &task_fiber->fiber);
+  worker->running_fiber = NULL;
+  g_current_task = waiting_task;
+  g_current_priority = waiting_priority;
+
+  if (task_fiber->is_completed)
+  {
+    Task* task = task_fiber->task;
+    task_fiber->task = NULL;
+    buf_push(worker->idle_fibers_buf, task_fiber);
+    task__complete(task);
+    return;
+  }
 
-  mtx_lock(&g_tasks_lock);
+  uint32_t running = TaskFiberState_Running;
+  if (!atomic_compare_exchange_uint32(
+        &task_fiber->state, &running, TaskFiberState_Parked))
+    task__push_resumed(worker, task_fiber); // resumed already
+}
+
+// starts the task on a fiber, or directly when none is available
+static void task__execute_on_worker(TaskWorker* worker, TaskHandle handle)
+{
+  if (!g_task_fibers || worker->running_fiber)
+  {
+    task__execute(handle);
+    return;
+  }
 
-  Task* parent = task__get(task, g_tasks);
-  (void)task__get(dependency, g_tasks); // to check the handle
+  TaskFiber* task_fiber = NULL;
+  if (buf_len(worker->idle_fibers_buf) > 0)
+  {
+    task_fiber = buf_end(worker->idle_fibers_buf)[-1];
+    buf_truncate(worker->idle_fibers_buf, buf_len(worker->idle_fibers_buf) - 1);
+  }
+  else if (worker->fibers_n < TASK_FIBERS_PER_WORKER_MAX)
+  {
+    task_fiber = calloc(1, sizeof *task_fiber);
+    task_fiber->worker = worker;
+    if (fiber_create(
+          &task_fiber->fiber, TASK_FIBER_STACK_SIZE, task__fiber_run, task_fiber))
+      worker->fibers_n++;
+    else
+      free(task_fiber), task_fiber = NULL;
+  }
+  if (!task_fiber)
+  {
+    task__execute(handle); // many tasks are suspended already
+    return;
+  }
 
-  buf_push(parent->dependencies, dependency);
+  task_fiber->task = task__get(handle);
+  task_fiber->is_completed = false;
+  task__switch_to_fiber(worker, task_fiber);
+}
 
-  // done_with_mutex:
-  mtx_unlock(&g_tasks_lock);
+// \pre the calling task runs on `task_fiber`, and will be resumed
+static void task__suspend(TaskFiber* task_fiber)
+{
+  Task* task = g_current_task;
+  TaskPriority priority = g_current_priority;
+  bool is_traced = task__is_traced(task);
+  if (is_traced)
+  {
+    task__trace_record(
+      task->run_begin_ns, thread_clock_ns(), task->trace_serial, 0, task->name);
+  }
+  fiber_switch(&task_fiber->fiber, &task_fiber->worker->thread_fiber);
+  // the thread-locals were changed by the other tasks
+  g_current_task = task;
+  g_current_priority = priority;
+  if (is_traced)
+    task->run_begin_ns = thread_clock_ns();
 }
 
-/* Schedule the task to run as soon as possible. */
-void task_start(TaskHandle task_handle)
+static void task__io_thread_run(void* thread_data)
 {
+  (void)thread_data;
+  mtx_lock(&g_task_io_lock);
+  for (;;)
   {
-    mtx_lock(&g_tasks_lock);
-    (void)task__get(task_handle, g_tasks); // check task_handle
-    mtx_unlock(&g_tasks_lock);
+    while (g_task_io_mustrun && g_task_io_calls_head == buf_len(g_task_io_calls_buf))
+      cnd_wait(&g_task_io_calls_cond, &g_task_io_lock);
+    if (g_task_io_calls_head == buf_len(g_task_io_calls_buf))
+      break;
+
+    TaskIoCall io_call = g_task_io_calls_buf[g_task_io_calls_head++];
+    if (g_task_io_calls_head == buf_len(g_task_io_calls_buf))
+    {
+      buf_reset(g_task_io_calls_buf);
+      g_task_io_calls_head = 0;
+    }
+    mtx_unlock(&g_task_io_lock);
+    g_current_task = io_call.task;
+    g_current_priority = io_call.task->priority;
+    io_call.io_function(io_call.io_data);
+    g_current_task = NULL;
+    task__resume_fiber(io_call.fiber);
+    mtx_lock(&g_task_io_lock);
   }
+  mtx_unlock(&g_task_io_lock);
+}
 
+static TaskHandle task__take_input(TaskPriority priority)
+{
+  TaskHandle handle = {0};
+  TaskInputQueue* input = &g_worker_thread_input[priority];
   mtx_lock(&g_worker_thread_input_lock);
-  buf_push(g_worker_thread_input, task_handle);
+  if (input->head < buf_len(input->handles_buf))
+  {
+    handle = input->handles_buf[input->head++];
+    if (input->head == buf_len(input->handles_buf))
+    {
+      buf_reset(input->handles_buf);
+      input->head = 0;
+    }
+  }
   mtx_unlock(&g_worker_thread_input_lock);
+  return handle;
 }
 
-#include <stdio.h>
+// threads helping from outside of the workers count directly in the totals
+static void task__count_found(TaskWorker* worker, bool is_stolen)
+{
+  if (worker)
+  {
+    worker->found_n++;
+    worker->stolen_n += is_stolen;
+  }
+  else
+  {
+    atomic_fetch_add_uint64(&g_task_found_n, 1);
+    if (is_stolen)
+      atomic_fetch_add_uint64(&g_task_stolen_n, 1);
+  }
+}
 
-static void test_task_printf(void* data)
+// Looks for interactive work everywhere before any background work, so that interactive
+// tasks overtake background ones whenever a task completes.
+//
+// \param worker null when called from outside of the workers
+static TaskHandle task__find_work(TaskWorker* worker)
 {
-  char const* text = data;
-  printf("%s", text);
+  TaskHandle handle = {0};
+  for (TaskPriority priority = 0; priority < TaskPriority_Count; priority++)
+  {
+    if (worker)
+    {
+      handle = task_deque__pop(&worker->deques[priority]);
+      if (handle.id)
+      {
+        task__count_found(worker, false);
+        return handle;
+      }
+    }
+
+    handle = task__take_input(priority);
+    if (handle.id)
+    {
+      task__count_found(worker, false);
+      return handle;
+    }
+
+    // visit the other workers starting from a random one
+    g_steal_seed = g_steal_seed * 1664525u + 1013904223u;
+    uint32_t first_victim_i = (g_steal_seed >> 16) % g_workers_n;
+    for (uint32_t victim_n = 0; victim_n < g_workers_n; victim_n++)
+    {
+      uint32_t victim_i = (first_victim_i + victim_n) % g_workers_n;
+      if (worker && victim_i == worker->index)
+        continue;
+      handle = task_deque__steal(&g_workers[victim_i].deques[priority]);
+      if (handle.id)
+      {
+        task__count_found(worker, true);
+        return handle;
+      }
+    }
+  }
+  return handle;
 }
 
-static void test_task_end(void* data)
+static void task__worker_thread_run(void* thread_data)
 {
-  int* i = data;
-  (*i)--;
+  TaskWorker* worker = thread_data;
+  g_current_worker = worker;
+  g_steal_seed = worker->index * 2654435761u + 1;
+  if (g_task_fibers)
+    fiber_init_thread(&worker->thread_fiber);
+  while (atomic_load_uint32(&g_workers_mustrun))
+  {
+    uint32_t epoch = atomic_load_uint32(&g_work_epoch);
+    // suspended tasks first, they already hold resources
+    TaskFiber* resumed_fiber = task__take_resumed(worker);
+    if (resumed_fiber)
+    {
+      task__switch_to_fiber(worker, resumed_fiber);
+      continue;
+    }
+
+    TaskHandle handle = task__find_work(worker);
+    if (handle.id)
+    {
+      task__execute_on_worker(worker, handle);
+      continue;
+    }
+
+    // Park until some work is added. The futex re-checks the epoch after we announced
+    // that we sleep, so that a concurrent task_start either sees us sleeping or we see
+    // its work.
+    bool is_traced = atomic_load_uint32(&g_task_trace_enabled);
+    uint64_t begin_ns = is_traced ? thread_clock_ns() : 0;
+    atomic_fetch_add_uint32(&g_workers_sleeping_n, 1);
+    if (atomic_load_uint32(&g_workers_mustrun))
+      futex_wait(&g_work_epoch, epoch);
+    atomic_fetch_add_uint32(&g_workers_sleeping_n, (uint32_t)-1);
+    if (is_traced)
+      task__trace_record(begin_ns, thread_clock_ns(), 0, 0, "(idle)");
+  }
+
+  assert(buf_len(worker->idle_fibers_buf) == worker->fibers_n); // none is suspended
+  for (TaskFiber** fiber_i = &worker->idle_fibers_buf[0];
+       fiber_i < buf_end(worker->idle_fibers_buf); fiber_i++)
+  {
+    fiber_destroy(&(*fiber_i)->fiber);
+    free(*fiber_i);
+  }
+  buf_free(worker->idle_fibers_buf);
+  buf_free(worker->resumed_buf);
+  atomic_fetch_add_uint64(&g_task_found_n, worker->found_n);
+  atomic_fetch_add_uint64(&g_task_stolen_n, worker->stolen_n);
+  if (g_task_fibers)
+    fiber_deinit_thread(&worker->thread_fiber);
+  g_current_worker = NULL;
 }
 
-int test_task(int argc, char const** argv)
+// \param workers_n 0 for one per processor
+static void task__init(bool with_fibers, uint32_t workers_n)
 {
-  (void)argc, (void)argv;
-  task_init();
-  int e1_n_storage = 1;
-  int e2_n_storage = 1;
-  TaskHandle a = task_create(test_task_printf, "a\n");
-  TaskHandle b = task_create(test_task_printf, "b\n");
-  TaskHandle c1 = task_create(test_task_printf, "c1\n");
-  TaskHandle c2 = task_create(test_task_printf, "c2\n");
+  assert(!g_task_init);
+  mtx_init(&g_task_pages_lock);
+  mtx_init(&g_task_trace_lock);
+  g_tasks_free_head = TASK_INDEX_NONE;
+  g_task_init = true;
 
-  int volatile* e1_n = &e1_n_storage;
-  int volatile* e2_n = &e2_n_storage;
+  g_workers_n = workers_n ? workers_n : thread_processor_n();
+  if (g_workers_n < 1)
+    g_workers_n = 1;
+  if (g_workers_n > TASK_WORKERS_MAX)
+    g_workers_n = TASK_WORKERS_MAX;
 
-  TaskHandle e1 = task_create(test_task_end, (void*)e1_n);
-  TaskHandle e2 = task_create(test_task_end, (void*)e2_n);
+  mtx_init(&g_worker_thread_input_lock);
+  g_task_fibers = with_fibers;
+  g_workers = calloc(g_workers_n, sizeof *g_workers);
+  g_workers_mustrun = 1;
+  for (uint32_t worker_i = 0; worker_i < g_workers_n; worker_i++)
+  {
+    TaskWorker* worker = &g_workers[worker_i];
+    worker->index = worker_i;
+    mtx_init(&worker->resumed_lock);
+    bool thread_started = thread_start(&worker->thread, task__worker_thread_run, worker);
+    assert(thread_started);
+    (void)thread_started;
+  }
 
-  task_depends(a, b);
-  task_depends(b, c1);
-  task_depends(b, c2);
-  task_depends(c1, e1);
-  task_depends(c2, e2);
+  if (with_fibers)
+  {
+    mtx_init(&g_task_io_lock);
+    cnd_init(&g_task_io_calls_cond);
+    g_task_io_mustrun = true;
+    for (int io_thread_i = 0; io_thread_i < TASK_IO_THREADS_N; io_thread_i++)
+    {
+      bool thread_started =
+        thread_start(&g_task_io_threads[io_thread_i], task__io_thread_run, NULL);
+      assert(thread_started);
+      (void)thread_started;
+    }
+  }
+}
 
-  assert(*e1_n == 1 && *e2_n == 1);
-  task_start(a);
+void task_init(void)
+{
+  task__init(false, 0);
+}
+
+void task_init_with_fibers(void)
+{
+  task__init(true, 0);
+}
 
-  // join tasks
-  while (*e1_n || *e2_n)
+void task_deinit(void)
+{
+  assert(g_task_init);
+  if (g_task_fibers)
   {
-    Sleep(1);
+    mtx_lock(&g_task_io_lock);
+    g_task_io_mustrun = false;
+    cnd_broadcast(&g_task_io_calls_cond);
+    mtx_unlock(&g_task_io_lock);
+    for (int io_thread_i = 0; io_thread_i < TASK_IO_THREADS_N; io_thread_i++)
+    {
+      thread_join(&g_task_io_threads[io_thread_i]);
+    }
+    buf_free(g_task_io_calls_buf);
+    g_task_io_calls_head = 0;
+    cnd_deinit(&g_task_io_calls_cond);
+    mtx_deinit(&g_task_io_lock);
   }
 
-  task_start(task_create(test_task_printf, "a\n"));
+  atomic_store_uint32(&g_workers_mustrun, 0);
+  atomic_fetch_add_uint32(&g_work_epoch, 1);
+  futex_wake_all(&g_work_epoch);
+  for (uint32_t worker_i = 0; worker_i < g_workers_n; worker_i++)
+  {
+    thread_join(&g_workers[worker_i].thread);
+    mtx_deinit(&g_workers[worker_i].resumed_lock);
+  }
+  free(g_workers), g_workers = NULL;
+  g_task_fibers = false;
+  g_workers_n = 0;
+  mtx_deinit(&g_worker_thread_input_lock);
+  mtx_deinit(&g_task_pages_lock);
+  for (uint32_t page_i = 0; page_i < TASK_PAGES_MAX && g_task_pages[page_i]; page_i++)
+  {
+    Task* page = g_task_pages[page_i];
+    for (Task *task_i = &page[0], *task_l = &page[TASK_PAGE_SIZE]; task_i < task_l;
+         task_i++)
+    {
+      buf_free(task_i->dependencies);
+      buf_free(task_i->waiting_fibers_buf);
+    }
+    free(page), g_task_pages[page_i] = NULL;
+  }
+  g_tasks_n = 0;
+  for (TaskTraceRing** ring_i = &g_task_trace_rings_buf[0];
+       ring_i < buf_end(g_task_trace_rings_buf); ring_i++)
+  {
+    free(*ring_i);
+  }
+  buf_free(g_task_trace_rings_buf);
+  g_task_trace_rings_generation++;
+  mtx_deinit(&g_task_trace_lock);
+  for (TaskPriority priority = 0; priority < TaskPriority_Count; priority++)
+  {
+    buf_free(g_worker_thread_input[priority].handles_buf);
+    g_worker_thread_input[priority].head = 0;
+  }
+  g_task_init = false;
+}
 
-  task_deinit();
+TaskHandle task_create_named(TaskFn* task_function, void* task_data, char const* name)
+{
+  // inherits the priority of the task it is created from, if any
+  return task_create_with_priority_named(
+    task_function, task_data, g_current_priority, name);
+}
+
+TaskHandle task_create_with_priority_named(TaskFn* task_function,
+                                           void* task_data,
+                                           TaskPriority priority,
+                                           char const* name)
+{
+  assert(g_task_init);
+  assert(priority < TaskPriority_Count);
+  TaskHandle handle = {0};
+  Task* task = task__alloc();
+  if (!task)
+    return handle;
+
+  handle = task->handle;
+  task->task_function = task_function;
+  task->task_data = task_data;
+  task->name = name;
+  task->trace_serial = atomic_load_uint32(&g_task_trace_enabled)
+                         ? atomic_fetch_add_uint64(&g_task_trace_serial, 1) + 1
+                         : 0;
+  task->priority = priority;
+  task->pending_n = 1;
+  task->released = 0;
+  // the work spawned by a cancelled task is cancelled too
+  task->cancelled = task_is_cancelled();
+  task->waiters_n = 0;
+  task->done = 0;
+  return handle;
+}
+
+void task_depends(TaskHandle task, TaskHandle dependency)
+{
+  assert(task.id != dependency.id);
+
+  Task* parent = task__get(task);
+  Task* child = task__get(dependency);
+
+  uint32_t previous_n = atomic_fetch_add_uint32(&child->pending_n, 1);
+  assert(previous_n > 0); // `dependency` must not have been scheduled already
+  (void)previous_n;
+
+  task__lock(parent);
+  TaskHandle* dependencies = parent->dependencies;
+  buf_push(dependencies, dependency);
+  parent->dependencies = dependencies;
+  task__unlock(parent);
+
+  task__release(child, dependency); // now started by its predecessors
+}
+
+void task_start(TaskHandle task_handle)
+{
+  task__release(task__get(task_handle), task_handle);
+}
+
+void task_cancel(TaskHandle task_handle)
+{
+  assert(g_task_init);
+  uint32_t index = task_handle.id & TASK_INDEX_MASK;
+  if (index >= atomic_load_uint32(&g_tasks_n))
+    return;
+
+  // the task may be done and its slot reused already, then there is nothing to cancel
+  Task* task = task__slot(index);
+  TaskHandle* dependencies = NULL;
+  task__lock(task);
+  if (atomic_load_uint32((uint32_t*)&task->handle.id) == (uint32_t)task_handle.id &&
+      !atomic_load_uint32(&task->done) && !atomic_exchange_uint32(&task->cancelled, 1))
+  {
+    for (TaskHandle* dep_f = &task->dependencies[0]; dep_f < buf_end(task->dependencies);
+         dep_f++)
+    {
+      buf_push(dependencies, *dep_f);
+    }
+  }
+  task__unlock(task);
+
+  // dependents that completed in the meantime are skipped by the handle check
+  for (TaskHandle* dep_f = &dependencies[0]; dep_f < buf_end(dependencies); dep_f++)
+  {
+    task_cancel(*dep_f);
+  }
+  buf_free(dependencies);
+}
+
+void task_io_call(TaskIoFn* io_function, void* io_data)
+{
+  TaskWorker* worker = g_current_worker;
+  TaskFiber* task_fiber = worker ? worker->running_fiber : NULL;
+  if (!task_fiber)
+  {
+    io_function(io_data);
+    return;
+  }
+
+  TaskIoCall io_call = {
+    .io_function = io_function,
+    .io_data = io_data,
+    .fiber = task_fiber,
+    .task = g_current_task,
+  };
+  mtx_lock(&g_task_io_lock);
+  buf_push(g_task_io_calls_buf, io_call);
+  cnd_signal(&g_task_io_calls_cond);
+  mtx_unlock(&g_task_io_lock);
+  task__suspend(task_fiber); // resumed by the I/O thread once the call returned
+}
+
+bool task_is_cancelled(void)
+{
+  Task* task = g_current_task;
+  return task && atomic_load_uint32(&task->cancelled);
+}
+
+void task_wait(TaskHandle task_handle)
+{
+  assert(g_task_init);
+  uint32_t index = task_handle.id & TASK_INDEX_MASK;
+  if (index >= atomic_load_uint32(&g_tasks_n))
+    return;
+
+  // register as a waiter, unless the task is already done and maybe freed
+  TaskWorker* worker = g_current_worker;
+  TaskFiber* task_fiber = worker ? worker->running_fiber : NULL;
+  Task* task = task__slot(index);
+  task__lock(task);
+  bool is_pending =
+    atomic_load_uint32((uint32_t*)&task->handle.id) == (uint32_t)task_handle.id &&
+    !atomic_load_uint32(&task->done);
+  if (is_pending)
+  {
+    task->waiters_n++;
+    if (task_fiber)
+      buf_push(task->waiting_fibers_buf, task_fiber);
+  }
+  task__unlock(task);
+  if (!is_pending)
+    return;
+
+  // on a fiber, let the worker run other tasks until the task completed
+  if (task_fiber)
+    task__suspend(task_fiber);
+
+  for (;;)
+  {
+    uint32_t epoch = atomic_load_uint32(&g_work_epoch);
+    if (atomic_load_uint32(&task->done))
+      break;
+
+    TaskFiber* resumed_fiber = worker ? task__take_resumed(worker) : NULL;
+    if (resumed_fiber)
+    {
+      task__switch_to_fiber(worker, resumed_fiber);
+      continue;
+    }
+
+    TaskHandle handle = task__find_work(worker);
+    if (handle.id)
+    {
+      if (worker)
+        task__execute_on_worker(worker, handle);
+      else
+        task__execute(handle);
+      continue;
+    }
+
+    bool is_traced = atomic_load_uint32(&g_task_trace_enabled);
+    uint64_t begin_ns = is_traced ? thread_clock_ns() : 0;
+    atomic_fetch_add_uint32(&g_workers_sleeping_n, 1);
+    if (!atomic_load_uint32(&task->done))
+      futex_wait(&g_work_epoch, epoch);
+    atomic_fetch_add_uint32(&g_workers_sleeping_n, (uint32_t)-1);
+    if (is_traced)
+      task__trace_record(begin_ns, thread_clock_ns(), 0, 0, "(waiting)");
+  }
+
+  task__lock(task);
+  bool is_last_waiter = --task->waiters_n == 0;
+  task__unlock(task);
+  if (is_last_waiter)
+    task__free(task);
+}
+
+typedef struct TaskParallelFor
+{
+  TaskRangeFn* task_function;
+  void* task_data;
+  size_t grain;
+  Task* caller; // null outside of tasks, its cancellation stops all the splits
+} TaskParallelFor;
+
+typedef struct TaskParallelForSplit
+{
+  TaskParallelFor const* parallel_for;
+  TaskRange range;
+} TaskParallelForSplit;
+
+enum
+{
+  TASK_PARALLEL_FOR_SPLITS_MAX = 64,
+  TASK_PARALLEL_FOR_CHUNKS_PER_WORKER = 8, // for the automatic grain
+};
+
+static void task__parallel_for_range(TaskParallelFor const* parallel_for,
+                                     TaskRange range);
+
+static void task__parallel_for_task(void* task_data)
+{
+  TaskParallelForSplit* split = task_data;
+  task__parallel_for_range(split->parallel_for, split->range);
+}
+
+// Lazy binary splitting: the second half of the range is offered to the other workers
+// only while the previously offered work was stolen, otherwise the range is consumed a
+// grain at a time. Splits adapt to how busy the other workers are.
+static void task__parallel_for_range(TaskParallelFor const* parallel_for,
+                                     TaskRange range)
+{
+  TaskParallelForSplit splits[TASK_PARALLEL_FOR_SPLITS_MAX];
+  TaskHandle split_tasks[TASK_PARALLEL_FOR_SPLITS_MAX];
+  size_t splits_n = 0;
+  size_t const grain = parallel_for->grain;
+  TaskWorker* worker = g_current_worker;
+  Task* caller = parallel_for->caller;
+  while (range.f < range.l && !(caller && atomic_load_uint32(&caller->cancelled)))
+  {
+    size_t range_n = range.l - range.f;
+    TaskDeque* deque = worker ? &worker->deques[g_current_priority] : NULL;
+    bool offered_work_is_pending =
+      deque && atomic_load_uint32(&deque->bottom) != atomic_load_uint32(&deque->top);
+    if (range_n > grain && splits_n < TASK_PARALLEL_FOR_SPLITS_MAX &&
+        !offered_work_is_pending)
+    {
+      TaskParallelForSplit* split = &splits[splits_n];
+      split->parallel_for = parallel_for;
+      split->range.f = range.f + range_n / 2;
+      split->range.l = range.l;
+      TaskHandle split_task = task_create(task__parallel_for_task, split);
+      if (split_task.id)
+      {
+        split_tasks[splits_n++] = split_task;
+        range.l = split->range.f;
+        task_start(split_task);
+        continue;
+      }
+    }
+
+    size_t chunk_l = range.f + (range_n < grain ? range_n : grain);
+    parallel_for->task_function(parallel_for->task_data, (TaskRange){range.f, chunk_l});
+    range.f = chunk_l;
+  }
+
+  // join, most recent first as they are the most likely to still be in our deque
+  while (splits_n)
+    task_wait(split_tasks[--splits_n]);
+}
+
+void task_parallel_for(TaskRange range,
+                       size_t grain,
+                       TaskRangeFn* task_function,
+                       void* task_data)
+{
+  if (range.f >= range.l)
+    return;
+
+  size_t range_n = range.l - range.f;
+  if (!g_task_init)
+  {
+    // still a grain at a time, callers may size their buffers by it
+    size_t chunk_n = grain > 0 ? grain : range_n;
+    for (size_t chunk_f = range.f; chunk_f < range.l; chunk_f += chunk_n)
+    {
+      size_t chunk_l = range.l - chunk_f < chunk_n ? range.l : chunk_f + chunk_n;
+      task_function(task_data, (TaskRange){chunk_f, chunk_l});
+    }
+    return;
+  }
+
+  if (grain == 0)
+    grain = range_n / (g_workers_n * TASK_PARALLEL_FOR_CHUNKS_PER_WORKER);
+  TaskParallelFor parallel_for = {
+    .task_function = task_function,
+    .task_data = task_data,
+    .grain = grain > 0 ? grain : 1,
+    .caller = g_current_task,
+  };
+  task__parallel_for_range(&parallel_for, range);
+}
+
+void task_trace_enable(bool is_enabled)
+{
+  atomic_store_uint32(&g_task_trace_enabled, is_enabled);
+}
+
+typedef struct TaskTraceRecord
+{
+  TaskTraceEvent event;
+  uint32_t thread_id;
+} TaskTraceRecord;
+
+static int task__trace_compare_serials(void const* a_, void const* b_)
+{
+  TaskTraceRecord const* a = a_;
+  TaskTraceRecord const* b = b_;
+  return a->event.serial < b->event.serial ? -1 : a->event.serial > b->event.serial;
+}
+
+static TaskTraceRecord const* task__trace_find_run(TaskTraceRecord const* runs_buf,
+                                                   uint64_t serial)
+{
+  TaskTraceRecord key = {.event.serial = serial};
+  return bsearch(
+    &key, runs_buf, buf_len(runs_buf), sizeof runs_buf[0], task__trace_compare_serials);
+}
+
+void task_trace_write(FILE* file)
+{
+  assert(g_task_init);
+  TaskTraceRecord* records_buf = NULL;
+  uint32_t* thread_ids_buf = NULL;
+  TaskTraceEvent* events_buf = NULL;
+  buf_fit(events_buf, TASK_TRACE_RING_CAP);
+  mtx_lock(&g_task_trace_lock);
+  for (TaskTraceRing** ring_i = &g_task_trace_rings_buf[0];
+       ring_i < buf_end(g_task_trace_rings_buf); ring_i++)
+  {
+    TaskTraceRing* ring = *ring_i;
+    uint64_t events_l = atomic_load_uint64(&ring->events_n);
+    uint64_t events_f =
+      events_l > TASK_TRACE_RING_CAP ? events_l - TASK_TRACE_RING_CAP : 0;
+    for (uint64_t event_i = events_f; event_i < events_l; event_i++)
+    {
+      TaskTraceEvent* s_event = &ring->events[event_i & (TASK_TRACE_RING_CAP - 1)];
+      TaskTraceEvent* d_event = &events_buf[event_i - events_f];
+      d_event->begin_ns = atomic_load_uint64(&s_event->begin_ns);
+      d_event->end_ns = atomic_load_uint64(&s_event->end_ns);
+      d_event->serial = atomic_load_uint64(&s_event->serial);
+      d_event->dependency_serial = atomic_load_uint64(&s_event->dependency_serial);
+      d_event->name = atomic_load_ptr((void**)&s_event->name);
+    }
+
+    // drop the events the thread overwrote while we copied, and the one it may be
+    // writing
+    uint64_t events_now_n = atomic_load_uint64(&ring->events_n) + 1;
+    uint64_t kept_f = events_now_n > TASK_TRACE_RING_CAP
+                        ? events_now_n - TASK_TRACE_RING_CAP
+                        : 0;
+    for (uint64_t event_i = kept_f > events_f ? kept_f : events_f; event_i < events_l;
+         event_i++)
+    {
+      TaskTraceRecord record = {events_buf[event_i - events_f], ring->thread_id};
+      buf_push(records_buf, record);
+    }
+    buf_push(thread_ids_buf, ring->thread_id);
+  }
+  mtx_unlock(&g_task_trace_lock);
+  buf_free(events_buf);
+
+  // runs first, sorted by serial to find the ends of the edges
+  TaskTraceRecord* runs_buf = NULL;
+  TaskTraceRecord* edges_buf = NULL;
+  uint64_t origin_ns = UINT64_MAX;
+  for (TaskTraceRecord* record_i = &records_buf[0]; record_i < buf_end(records_buf);
+       record_i++)
+  {
+    if (record_i->event.begin_ns < origin_ns)
+      origin_ns = record_i->event.begin_ns;
+    if (record_i->event.dependency_serial)
+      buf_push(edges_buf, *record_i);
+    else
+      buf_push(runs_buf, *record_i);
+  }
+  buf_free(records_buf);
+  if (runs_buf)
+  {
+    qsort(runs_buf, buf_len(runs_buf), sizeof runs_buf[0], task__trace_compare_serials);
+  }
+
+  // Chrome trace_event format, in microseconds
+  char const* separator = "";
+  fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  for (uint32_t* thread_id_i = &thread_ids_buf[0]; thread_id_i < buf_end(thread_ids_buf);
+       thread_id_i++)
+  {
+    uint32_t thread_id = *thread_id_i;
+    bool is_worker = thread_id < TASK_WORKERS_MAX;
+    fprintf(file,
+            "%s\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":0,\"tid\":%u,"
+            "\"args\":{\"name\":\"%s %u\"}}",
+            separator, thread_id, is_worker ? "worker" : "thread",
+            is_worker ? thread_id : thread_id - TASK_WORKERS_MAX);
+    separator = ",";
+  }
+  for (TaskTraceRecord* run_i = &runs_buf[0]; run_i < buf_end(runs_buf); run_i++)
+  {
+    fprintf(file,
+            "%s\n{\"ph\":\"X\",\"name\":\"%s\",\"cat\":\"%s\",\"pid\":0,\"tid\":%u,"
+            "\"ts\":%.3f,\"dur\":%.3f}",
+            separator, run_i->event.name ? run_i->event.name : "?",
+            run_i->event.serial ? "task" : "sleep", run_i->thread_id,
+            (run_i->event.begin_ns - origin_ns) / 1000.0,
+            (run_i->event.end_ns - run_i->event.begin_ns) / 1000.0);
+    separator = ",";
+  }
+  // a flow from the predecessor to the dependent, for those still in the rings
+  size_t flow_id = 0;
+  for (TaskTraceRecord* edge_i = &edges_buf[0]; edge_i < buf_end(edges_buf); edge_i++)
+  {
+    TaskTraceRecord const* from = task__trace_find_run(runs_buf, edge_i->event.serial);
+    TaskTraceRecord const* to =
+      task__trace_find_run(runs_buf, edge_i->event.dependency_serial);
+    if (!from || !to)
+      continue;
+
+    flow_id++;
+    fprintf(file,
+            "%s\n{\"ph\":\"s\",\"name\":\"dependency\",\"cat\":\"task\",\"id\":%zu,"
+            "\"pid\":0,\"tid\":%u,\"ts\":%.3f}",
+            separator, flow_id, from->thread_id,
+            (from->event.begin_ns - origin_ns) / 1000.0);
+    fprintf(file,
+            ",\n{\"ph\":\"f\",\"bp\":\"e\",\"name\":\"dependency\",\"cat\":\"task\","
+            "\"id\":%zu,\"pid\":0,\"tid\":%u,\"ts\":%.3f}",
+            flow_id, to->thread_id, (to->event.begin_ns - origin_ns) / 1000.0);
+    separator = ",";
+  }
+  fprintf(file, "\n]}\n");
+  buf_free(runs_buf);
+  buf_free(edges_buf);
+  buf_free(thread_ids_buf);
+}
+
+static void test_task_printf(void* data)
+{
+  char const* text = data;
+  printf("%s", text);
+}
+
+static void test_task_end(void* data)
+{
+  int* i = data;
+  (*i)--;
+}
+
+static void test_task_count(void* data)
+{
+  atomic_fetch_add_uint32(data, 1);
+}
+
+typedef struct TestTaskFanIn
+{
+  uint32_t predecessors_done_n; // @atomic
+  uint32_t join_n;
+} TestTaskFanIn;
+
+static void test_task_fan_in_join(void* data)
+{
+  TestTaskFanIn* fan_in = data;
+  assert(atomic_load_uint32(&fan_in->predecessors_done_n) == 64);
+  fan_in->join_n++;
+}
+
+// waits from inside a task, which must run the children itself when workers are busy
+static void test_task_wait_children(void* data)
+{
+  uint32_t* count = data;
+  TaskHandle children[4];
+  for (int child_i = 0; child_i < 4; child_i++)
+  {
+    children[child_i] = task_create(test_task_count, count);
+    task_start(children[child_i]);
+  }
+  for (int child_i = 0; child_i < 4; child_i++)
+  {
+    task_wait(children[child_i]);
+  }
+  assert(atomic_load_uint32(count) >= 4);
+}
+
+typedef struct TestTaskParallelFor
+{
+  uint32_t* visits; // @atomic [range_n]
+  uint32_t calls_n; // @atomic
+} TestTaskParallelFor;
+
+static void test_task_parallel_for_visit(void* data, TaskRange range)
+{
+  TestTaskParallelFor* parallel_for = data;
+  atomic_fetch_add_uint32(&parallel_for->calls_n, 1);
+  for (size_t i = range.f; i < range.l; i++)
+    atomic_fetch_add_uint32(&parallel_for->visits[i], 1);
+}
+
+// nested parallel_for, from inside workers
+static void test_task_parallel_for_nested(void* data, TaskRange range)
+{
+  TestTaskParallelFor* parallel_for = data;
+  for (size_t i = range.f; i < range.l; i++)
+  {
+    TestTaskParallelFor inner = {.visits = &parallel_for->visits[i * 100]};
+    task_parallel_for((TaskRange){0, 100}, 7, test_task_parallel_for_visit, &inner);
+  }
+}
+
+typedef struct TestTaskBlocker
+{
+  uint32_t running_n; // @atomic
+  uint32_t released;  // @atomic
+} TestTaskBlocker;
+
+static void test_task_block(void* data)
+{
+  TestTaskBlocker* blocker = data;
+  atomic_fetch_add_uint32(&blocker->running_n, 1);
+  while (!atomic_load_uint32(&blocker->released))
+    thread_sleep_ms(1);
+}
+
+typedef struct TestTaskCancel
+{
+  uint32_t running;   // @atomic
+  uint32_t cancelled; // @atomic seen from the task
+  uint32_t visits_n;  // @atomic by a parallel_for from the task
+} TestTaskCancel;
+
+static void test_task_cancel_visit(void* data, TaskRange range)
+{
+  TestTaskCancel* cancel = data;
+  atomic_fetch_add_uint32(&cancel->visits_n, (uint32_t)(range.l - range.f));
+}
+
+static void test_task_record_cancel(void* data)
+{
+  TestTaskCancel* cancel = data;
+  atomic_store_uint32(&cancel->cancelled, task_is_cancelled());
+  task_parallel_for((TaskRange){0, 100}, 10, test_task_cancel_visit, cancel);
+}
+
+// runs until cancelled
+static void test_task_poll_cancel(void* data)
+{
+  TestTaskCancel* cancel = data;
+  atomic_store_uint32(&cancel->running, 1);
+  while (!task_is_cancelled())
+    thread_sleep_ms(1);
+  atomic_store_uint32(&cancel->cancelled, 1);
+}
+
+typedef struct TestTaskOrder
+{
+  uint32_t* next_rank;
+  uint32_t rank;
+} TestTaskOrder;
+
+static void test_task_rank(void* data)
+{
+  TestTaskOrder* order = data;
+  order->rank = (*order->next_rank)++;
+}
+
+typedef struct TestTaskFanOut
+{
+  uint32_t depth;
+  uint32_t* leaves_n; // @atomic
+} TestTaskFanOut;
+
+static TestTaskFanOut g_test_task_fan_out_nodes[1 << 10];
+
+static void test_task_fan_in(void* data)
+{
+  (void)data;
+}
+
+// spawns two children per node, so that most tasks are started from workers, and
+// completes after them
+static void test_task_fan_out(void* data)
+{
+  TestTaskFanOut* node = data;
+  if (node->depth == 0)
+  {
+    atomic_fetch_add_uint32(node->leaves_n, 1);
+    return;
+  }
+
+  size_t node_i = node - &g_test_task_fan_out_nodes[0];
+  TaskHandle children[2];
+  TaskHandle fan_in = task_create(test_task_fan_in, NULL);
+  for (size_t child_i = 0; child_i < 2; child_i++)
+  {
+    TestTaskFanOut* child = &g_test_task_fan_out_nodes[2 * node_i + 1 + child_i];
+    child->depth = node->depth - 1;
+    child->leaves_n = node->leaves_n;
+    children[child_i] = task_create(test_task_fan_out, child);
+    task_depends(children[child_i], fan_in);
+  }
+  task_start(children[0]);
+  task_start(children[1]);
+  task_wait(fan_in);
+}
+
+typedef struct TestTaskIo
+{
+  uint32_t in_flight_n;   // @atomic
+  uint32_t in_flight_max; // @atomic
+} TestTaskIo;
+
+static void test_task_io_sleep(void* data)
+{
+  TestTaskIo* io = data;
+  uint32_t in_flight_n = atomic_fetch_add_uint32(&io->in_flight_n, 1) + 1;
+  uint32_t in_flight_max = atomic_load_uint32(&io->in_flight_max);
+  while (in_flight_n > in_flight_max &&
+         !atomic_compare_exchange_uint32(&io->in_flight_max, &in_flight_max, in_flight_n))
+    ;
+  thread_sleep_ms(20);
+  atomic_fetch_add_uint32(&io->in_flight_n, (uint32_t)-1);
+}
+
+static void test_task_io(void* data)
+{
+  task_io_call(test_task_io_sleep, data);
+}
+
+// \pre the task system is initialised
+static void test_task_scheduling(void)
+{
+  // freed slots are reused first, with a new generation that is never null
+  {
+    TaskHandle first = task_create(test_task_printf, "");
+    TaskHandle previous = first;
+    for (int i = 0; i < 600; i++)
+    {
+      task__free(task__get(previous));
+      TaskHandle handle = task_create(test_task_printf, "");
+      assert(handle.id != 0 && handle.id != previous.id);
+      assert((handle.id & TASK_INDEX_MASK) == (first.id & TASK_INDEX_MASK));
+      previous = handle;
+    }
+    task__free(task__get(previous));
+  }
+
+  int e1_n = 1;
+  int e2_n = 1;
+  TaskHandle a = task_create(test_task_printf, "a\n");
+  TaskHandle b = task_create(test_task_printf, "b\n");
+  TaskHandle c1 = task_create(test_task_printf, "c1\n");
+  TaskHandle c2 = task_create(test_task_printf, "c2\n");
+
+  TaskHandle e1 = task_create(test_task_end, &e1_n);
+  TaskHandle e2 = task_create(test_task_end, &e2_n);
+
+  task_depends(a, b);
+  task_depends(b, c1);
+  task_depends(b, c2);
+  task_depends(c1, e1);
+  task_depends(c2, e2);
+
+  assert(e1_n == 1 && e2_n == 1);
+  task_start(a);
+
+  task_wait(e1);
+  task_wait(e2);
+  assert(e1_n == 0 && e2_n == 0);
+
+  task_start(task_create(test_task_printf, "a\n"));
+
+  // a task with many predecessors runs once, after all of them
+  {
+    TestTaskFanIn fan_in = {0};
+    TaskHandle join = task_create(test_task_fan_in_join, &fan_in);
+    TaskHandle predecessors[64];
+    for (int predecessor_i = 0; predecessor_i < 64; predecessor_i++)
+    {
+      predecessors[predecessor_i] =
+        task_create(test_task_count, &fan_in.predecessors_done_n);
+      task_depends(predecessors[predecessor_i], join);
+    }
+    task_start(join); // no effect, it is started by its predecessors
+    for (int predecessor_i = 0; predecessor_i < 64; predecessor_i++)
+    {
+      task_start(predecessors[predecessor_i]);
+    }
+    task_wait(join);
+    assert(fan_in.join_n == 1);
+  }
+
+  {
+    uint32_t count = 0;
+    TaskHandle parents[16];
+    for (int parent_i = 0; parent_i < 16; parent_i++)
+    {
+      parents[parent_i] = task_create(test_task_wait_children, &count);
+      task_start(parents[parent_i]);
+    }
+    for (int parent_i = 0; parent_i < 16; parent_i++)
+    {
+      task_wait(parents[parent_i]);
+    }
+    assert(atomic_load_uint32(&count) == 64);
+  }
+
+  // interactive tasks run before the background tasks started earlier
+  {
+    TestTaskBlocker blocker = {0};
+    TaskHandle blockers[TASK_WORKERS_MAX];
+    for (uint32_t worker_i = 0; worker_i < g_workers_n; worker_i++)
+    {
+      blockers[worker_i] = task_create(test_task_block, &blocker);
+      task_start(blockers[worker_i]);
+    }
+    while (atomic_load_uint32(&blocker.running_n) != g_workers_n)
+      thread_sleep_ms(1);
+
+    // with all workers blocked, only this thread runs the tasks, in order
+    uint32_t next_rank = 0;
+    TestTaskOrder orders[8];
+    TaskHandle tasks[8];
+    for (int task_i = 0; task_i < 8; task_i++)
+    {
+      orders[task_i].next_rank = &next_rank;
+      TaskPriority priority =
+        task_i < 4 ? TaskPriority_Background : TaskPriority_Interactive;
+      tasks[task_i] =
+        task_create_with_priority(test_task_rank, &orders[task_i], priority);
+      task_start(tasks[task_i]);
+    }
+    task_wait(tasks[3]);
+    for (int task_i = 0; task_i < 8; task_i++)
+    {
+      task_wait(tasks[task_i]);
+      assert(orders[task_i].rank == (uint32_t)((task_i + 4) % 8));
+    }
+
+    atomic_store_uint32(&blocker.released, 1);
+    for (uint32_t worker_i = 0; worker_i < g_workers_n; worker_i++)
+      task_wait(blockers[worker_i]);
+  }
+
+  // cancellation reaches the dependents, and running tasks that poll it
+  {
+    TestTaskCancel cancels[4] = {0};
+    TaskHandle tasks[4];
+    for (int task_i = 0; task_i < 4; task_i++)
+    {
+      tasks[task_i] = task_create(test_task_record_cancel, &cancels[task_i]);
+    }
+    task_depends(tasks[0], tasks[1]);
+    task_depends(tasks[1], tasks[2]);
+    task_cancel(tasks[0]);
+    task_start(tasks[0]);
+    task_start(tasks[3]);
+    task_wait(tasks[2]);
+    task_wait(tasks[3]);
+    for (int task_i = 0; task_i < 3; task_i++)
+    {
+      assert(cancels[task_i].cancelled && cancels[task_i].visits_n == 0);
+    }
+    assert(!cancels[3].cancelled && cancels[3].visits_n == 100);
+    assert(!task_is_cancelled());
+
+    TestTaskCancel poll = {0};
+    TaskHandle poll_task = task_create(test_task_poll_cancel, &poll);
+    task_start(poll_task);
+    while (!atomic_load_uint32(&poll.running))
+      thread_sleep_ms(1);
+    task_cancel(poll_task);
+    task_wait(poll_task);
+    assert(poll.cancelled);
+    task_cancel(poll_task); // no effect once completed
+  }
+
+  // traces name the tasks after their function, and link the dependent tasks
+  {
+    uint32_t count = 0;
+    task_trace_enable(true);
+    TaskHandle first = task_create(test_task_count, &count);
+    TaskHandle second = task_create(test_task_count, &count);
+    task_depends(first, second);
+    task_start(first);
+    task_wait(second);
+    task_trace_enable(false);
+    assert(count == 2);
+
+    FILE* file = tmpfile();
+    if (file)
+    {
+      task_trace_write(file);
+      long file_n = ftell(file);
+      char* json = calloc(file_n + 1, 1);
+      rewind(file);
+      size_t json_n = fread(json, 1, file_n, file);
+      assert(json_n == (size_t)file_n);
+      (void)json_n;
+      assert(strstr(json, "\"name\":\"test_task_count\""));
+      assert(strstr(json, "\"ph\":\"s\""));
+      assert(strstr(json, "\"ph\":\"f\""));
+      assert(json[file_n - 2] == '}');
+      free(json);
+      fclose(file);
+    }
+  }
+
+  // every index is visited once, in ranges of at most `grain`
+  {
+    enum
+    {
+      range_n = 100000,
+    };
+    TestTaskParallelFor parallel_for = {.visits = calloc(range_n, sizeof(uint32_t))};
+    task_parallel_for((TaskRange){0, range_n}, 1000, test_task_parallel_for_visit,
+                      &parallel_for);
+    for (size_t i = 0; i < range_n; i++)
+      assert(parallel_for.visits[i] == 1);
+    assert(parallel_for.calls_n >= range_n / 1000);
+
+    memset(parallel_for.visits, 0, range_n * sizeof(uint32_t));
+    task_parallel_for((TaskRange){0, range_n / 100}, 0, test_task_parallel_for_nested,
+                      &parallel_for);
+    for (size_t i = 0; i < range_n; i++)
+      assert(parallel_for.visits[i] == 1);
+
+    task_parallel_for((TaskRange){5, 5}, 0, test_task_parallel_for_visit, NULL);
+    free(parallel_for.visits);
+  }
+
+  {
+    uint32_t leaves_n = 0;
+    g_test_task_fan_out_nodes[0].depth = 9; // 512 leaves, 1023 nodes
+    g_test_task_fan_out_nodes[0].leaves_n = &leaves_n;
+    TaskHandle root = task_create(test_task_fan_out, &g_test_task_fan_out_nodes[0]);
+    task_start(root);
+    task_wait(root);
+    assert(leaves_n == 512);
+  }
+
+}
+
+int test_task(int argc, char const** argv)
+{
+  (void)argc, (void)argv;
+
+  // without the task system, the range is still visited a grain at a time
+  {
+    uint32_t visits[105] = {0};
+    TestTaskParallelFor parallel_for = {.visits = visits};
+    task_parallel_for((TaskRange){0, 105}, 10, test_task_parallel_for_visit,
+                      &parallel_for);
+    for (size_t i = 0; i < 105; i++)
+      assert(visits[i] == 1);
+    assert(parallel_for.calls_n == 11);
+  }
+
+  task_init();
+  test_task_scheduling();
+  task_deinit();
+
+  task_init_with_fibers();
+  test_task_scheduling();
+  // blocking calls suspend their task, so that more of them are in flight than workers
+  {
+    TestTaskIo io = {0};
+    TaskHandle tasks[16];
+    for (int task_i = 0; task_i < 16; task_i++)
+    {
+      tasks[task_i] = task_create(test_task_io, &io);
+      task_start(tasks[task_i]);
+    }
+    for (int task_i = 0; task_i < 16; task_i++)
+    {
+      task_wait(tasks[task_i]);
+    }
+    // the calling thread makes the calls of the tasks it helps with directly
+    if (g_workers_n + 1 < 16)
+      assert(io.in_flight_max > g_workers_n + 1);
+  }
+  task_deinit();
+
+  return 0;
+}
+
+// Benchmarks
+//
+// Each measure is repeated with 1, 2, 4.. workers up to one per processor, to see how
+// the scheduler scales. The calling thread helps in task_wait, like in the application.
+
+#include "xxxx_bench.h"
+
+enum
+{
+  BENCH_TASK_SPAWN_N = 100000,
+  BENCH_TASK_FAN_REPEAT_N = 100,
+  BENCH_TASK_FAN_CHILDREN_MAX = 1024,
+  BENCH_TASK_PARALLEL_FOR_N = 1 << 24,
+  BENCH_TASK_IMBALANCED_N = 4096,
+  BENCH_TASK_IMBALANCED_COST = 2000, // elements per light task, heavy ones are 64x
+};
+
+static void bench_task_empty(void* data)
+{
+  (void)data;
+}
+
+static uint64_t bench_task_mix_range(TaskRange range)
+{
+  uint64_t sum = 0;
+  for (size_t i = range.f; i < range.l; i++)
+  {
+    uint64_t x = i * 0x9E3779B97F4A7C15ull;
+    x ^= x >> 29;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 32;
+    sum += x;
+  }
+  return sum;
+}
+
+static void bench_task_mix(void* data, TaskRange range)
+{
+  atomic_fetch_add_uint64(data, bench_task_mix_range(range));
+}
+
+typedef struct BenchTaskFan
+{
+  TaskHandle join;
+  uint32_t children_n;
+} BenchTaskFan;
+
+// all children are created before any starts, so that the join runs after all of them
+static void bench_task_fan_out(void* data)
+{
+  BenchTaskFan* fan = data;
+  TaskHandle children[BENCH_TASK_FAN_CHILDREN_MAX];
+  for (uint32_t child_i = 0; child_i < fan->children_n; child_i++)
+  {
+    children[child_i] = task_create(bench_task_empty, NULL);
+    task_depends(children[child_i], fan->join);
+  }
+  for (uint32_t child_i = 0; child_i < fan->children_n; child_i++)
+  {
+    task_start(children[child_i]);
+  }
+}
+
+
+typedef struct BenchTaskLeaf
+{
+  TaskRange range;
+  uint64_t* sum; // @atomic
+} BenchTaskLeaf;
+
+static void bench_task_leaf(void* data)
+{
+  BenchTaskLeaf* leaf = data;
+  atomic_fetch_add_uint64(leaf->sum, bench_task_mix_range(leaf->range));
+}
+
+typedef struct BenchTaskImbalanced
+{
+  TaskHandle join;
+  BenchTaskLeaf* leaves;
+} BenchTaskImbalanced;
+
+// spawned from a single worker, so that the others must steal to take part
+static void bench_task_imbalanced_root(void* data)
+{
+  BenchTaskImbalanced* imbalanced = data;
+  TaskHandle* leaves = malloc(sizeof(TaskHandle) * BENCH_TASK_IMBALANCED_N);
+  for (uint32_t leaf_i = 0; leaf_i < BENCH_TASK_IMBALANCED_N; leaf_i++)
+  {
+    leaves[leaf_i] = task_create(bench_task_leaf, &imbalanced->leaves[leaf_i]);
+    task_depends(leaves[leaf_i], imbalanced->join);
+  }
+  for (uint32_t leaf_i = 0; leaf_i < BENCH_TASK_IMBALANCED_N; leaf_i++)
+  {
+    task_start(leaves[leaf_i]);
+  }
+  free(leaves);
+}
+
+static int bench_task__compare_ns(void const* a_, void const* b_)
+{
+  uint64_t a = *(uint64_t const*)a_;
+  uint64_t b = *(uint64_t const*)b_;
+  return a < b ? -1 : a > b;
+}
+
+static void bench_task_spawn(Bench* bench, char const* name, uint32_t threads_n)
+{
+  TaskHandle* handles = malloc(sizeof(TaskHandle) * BENCH_TASK_SPAWN_N);
+  uint64_t begin_ns = thread_clock_ns();
+  for (uint32_t task_i = 0; task_i < BENCH_TASK_SPAWN_N; task_i++)
+  {
+    handles[task_i] = task_create(bench_task_empty, NULL);
+    task_start(handles[task_i]);
+  }
+  for (uint32_t task_i = 0; task_i < BENCH_TASK_SPAWN_N; task_i++)
+  {
+    task_wait(handles[task_i]);
+  }
+  uint64_t elapsed_ns = thread_clock_ns() - begin_ns;
+  free(handles);
+  bench_result(bench, name, threads_n, BENCH_TASK_SPAWN_N,
+               (double)elapsed_ns / BENCH_TASK_SPAWN_N, "ns/task");
+}
+
+static void bench_task_fan(Bench* bench, uint32_t children_n, uint32_t threads_n)
+{
+  uint64_t elapsed_ns[BENCH_TASK_FAN_REPEAT_N];
+  for (uint32_t repeat_i = 0; repeat_i < BENCH_TASK_FAN_REPEAT_N; repeat_i++)
+  {
+    uint64_t begin_ns = thread_clock_ns();
+    BenchTaskFan fan = {.join = task_create(bench_task_empty, NULL),
+                        .children_n = children_n};
+    TaskHandle root = task_create(bench_task_fan_out, &fan);
+    task_start(root);
+    task_wait(fan.join);
+    elapsed_ns[repeat_i] = thread_clock_ns() - begin_ns;
+    task_wait(root);
+  }
+  qsort(elapsed_ns, BENCH_TASK_FAN_REPEAT_N, sizeof(elapsed_ns[0]),
+        bench_task__compare_ns);
+
+  char name[64];
+  snprintf(name, sizeof(name), "task.fan_out_in.%u.median", children_n);
+  bench_result(bench, name, threads_n, BENCH_TASK_FAN_REPEAT_N,
+               elapsed_ns[BENCH_TASK_FAN_REPEAT_N / 2] / 1e3, "us");
+  snprintf(name, sizeof(name), "task.fan_out_in.%u.p99", children_n);
+  bench_result(bench, name, threads_n, BENCH_TASK_FAN_REPEAT_N,
+               elapsed_ns[BENCH_TASK_FAN_REPEAT_N * 99 / 100] / 1e3, "us");
+}
+
+// \return the elapsed time
+static uint64_t bench_task_parallel_for(Bench* bench, uint32_t threads_n)
+{
+  uint64_t sum = 0;
+  TaskRange all = {0, BENCH_TASK_PARALLEL_FOR_N};
+  uint64_t begin_ns = thread_clock_ns();
+  task_parallel_for(all, 0, bench_task_mix, &sum);
+  uint64_t elapsed_ns = thread_clock_ns() - begin_ns;
+  if (sum != bench_task_mix_range(all))
+    fprintf(stderr, "ERROR: task_parallel_for missed elements\n");
+  bench_result(bench, "task.parallel_for", threads_n, BENCH_TASK_PARALLEL_FOR_N,
+               elapsed_ns / 1e6, "ms");
+  return elapsed_ns;
+}
+
+static void bench_task_imbalanced(Bench* bench, uint32_t threads_n)
+{
+  uint64_t sum = 0;
+  BenchTaskLeaf* leaves = malloc(sizeof(BenchTaskLeaf) * BENCH_TASK_IMBALANCED_N);
+  size_t element_i = 0;
+  for (uint32_t leaf_i = 0; leaf_i < BENCH_TASK_IMBALANCED_N; leaf_i++)
+  {
+    size_t cost = BENCH_TASK_IMBALANCED_COST * (leaf_i % 16 == 0 ? 64 : 1);
+    leaves[leaf_i].range = (TaskRange){element_i, element_i + cost};
+    leaves[leaf_i].sum = &sum;
+    element_i += cost;
+  }
+
+  BenchTaskImbalanced imbalanced = {.join = task_create(bench_task_empty, NULL),
+                                    .leaves = leaves};
+  uint64_t begin_ns = thread_clock_ns();
+  TaskHandle root = task_create(bench_task_imbalanced_root, &imbalanced);
+  task_start(root);
+  task_wait(imbalanced.join);
+  uint64_t elapsed_ns = thread_clock_ns() - begin_ns;
+  task_wait(root);
+  free(leaves);
+  bench_result(bench, "task.imbalanced", threads_n, BENCH_TASK_IMBALANCED_N,
+               elapsed_ns / 1e6, "ms");
+}
+
+int bench_task(int argc, char const** argv)
+{
+  Bench bench = bench_begin(argc, argv);
+  uint32_t processors_n = thread_processor_n();
+  if (processors_n > TASK_WORKERS_MAX)
+    processors_n = TASK_WORKERS_MAX;
+
+  uint64_t parallel_for_1_ns = 0;
+  for (uint32_t workers_n = 1;; workers_n *= 2)
+  {
+    if (workers_n > processors_n)
+      workers_n = processors_n;
+
+    // the workers add their statistics when they stop
+    atomic_store_uint64(&g_task_found_n, 0);
+    atomic_store_uint64(&g_task_stolen_n, 0);
+    task__init(false, workers_n);
+    bench_task_imbalanced(&bench, workers_n);
+    task_deinit();
+    uint64_t found_n = atomic_load_uint64(&g_task_found_n);
+    uint64_t stolen_n = atomic_load_uint64(&g_task_stolen_n);
+    bench_result(&bench, "task.imbalanced.stolen", workers_n, found_n,
+                 found_n ? 100.0 * stolen_n / found_n : 0.0, "%");
+
+    task__init(false, workers_n);
+    bench_task_spawn(&bench, "task.spawn", workers_n);
+    bench_task_fan(&bench, 64, workers_n);
+    bench_task_fan(&bench, BENCH_TASK_FAN_CHILDREN_MAX, workers_n);
+    uint64_t parallel_for_ns = bench_task_parallel_for(&bench, workers_n);
+    if (workers_n == 1)
+      parallel_for_1_ns = parallel_for_ns;
+    bench_result(&bench, "task.parallel_for.speedup", workers_n,
+                 BENCH_TASK_PARALLEL_FOR_N,
+                 parallel_for_ns ? (double)parallel_for_1_ns / parallel_for_ns : 0.0,
+                 "x");
+    task_deinit();
+
+    task__init(true, workers_n);
+    bench_task_spawn(&bench, "task.spawn.fibers", workers_n);
+    task_deinit();
+
+    if (workers_n == processors_n)
+      break;
+  }
 
+  bench_end(&bench);
   return 0;
 }
@@ -1,6 +1,10 @@
 #ifndef XXXX_TASKS
 #define XXXX_TASKS
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
 typedef struct TaskHandle
 {
   int id; // null task has id = 0
@@ -8,20 +12,106 @@ typedef struct TaskHandle
 
 typedef void(TaskFn)(void* task_data);
 
+/* Starts one worker thread per processor. Tasks started from a task are pushed to the
+ * worker's own deque, and idle workers steal from the others. */
 void task_init(void);
+
+/* Like task_init, but the workers run the tasks on fibers: a task waiting in task_wait
+ * or task_io_call is suspended, and its worker runs other tasks in the meantime. */
+void task_init_with_fibers(void);
+
+/* \pre all tasks completed */
 void task_deinit(void);
 
+typedef enum TaskPriority {
+  TaskPriority_Interactive, // the user is waiting for it
+  TaskPriority_Background,  // bulk work, runs when no interactive task is ready
+  TaskPriority_Count,
+} TaskPriority;
+
 /* Create a new task and returns its handle. A null handle (all bits to zero)
- * denotes an allocation error. */
-TaskHandle task_create(TaskFn* task_function, void* task_data);
+ * denotes an allocation error.
+ *
+ * The task has the priority of the task calling task_create, or is interactive when
+ * created outside of a task. It starts cancelled when the calling task is cancelled.
+ *
+ * The task is named after its function in traces. */
+#define task_create(task_function, task_data)                                          \
+  task_create_named((task_function), (task_data), #task_function)
 
-/* Mark that `dependency` depends on `task`. Upon completion of `task` all its
- * dependencies are started. */
+#define task_create_with_priority(task_function, task_data, priority)                  \
+  task_create_with_priority_named(                                                     \
+    (task_function), (task_data), (priority), #task_function)
+
+TaskHandle task_create_named(TaskFn* task_function, void* task_data, char const* name);
+
+TaskHandle task_create_with_priority_named(TaskFn* task_function,
+                                           void* task_data,
+                                           TaskPriority priority,
+                                           char const* name);
+
+/* Mark that `dependency` depends on `task`. `dependency` runs once, after all the tasks
+ * it depends on completed, and needs no `task_start` of its own.
+ *
+ * \pre neither task was started yet */
 void task_depends(TaskHandle task, TaskHandle dependency);
 
 /* Schedule the task to run as soon as possible. */
 void task_start(TaskHandle task);
 
+/* Wait until the task completed, running other tasks in the meantime.
+ *
+ * \pre the task was or will be started, directly or by its predecessors */
+void task_wait(TaskHandle task);
+
+/* Request the task to stop, and all the tasks that depend on it, directly or not.
+ *
+ * Cancellation is cooperative: cancelled tasks still run, so that they can release what
+ * they own, but are expected to poll `task_is_cancelled` and return early. No effect on
+ * tasks that already completed. */
+void task_cancel(TaskHandle task);
+
+/* True when the task running on the calling thread was cancelled. Always false outside
+ * of tasks. */
+bool task_is_cancelled(void);
+
+typedef void(TaskIoFn)(void* io_data);
+
+/* Call `io_function(io_data)`, a blocking call such as reading a file or listing a
+ * directory. From a task running on a fiber, the call is made by an I/O thread while the
+ * task is suspended, so that many calls can be in flight with few workers. Otherwise it
+ * is called directly. */
+void task_io_call(TaskIoFn* io_function, void* io_data);
+
+/* Start or stop recording which task ran when and on which thread, with the edges
+ * between dependent tasks. Each thread keeps its most recent events in a ring buffer,
+ * which costs a clock read per task and per sleep while enabled. */
+void task_trace_enable(bool is_enabled);
+
+/* Write the recorded events as Chrome trace_event JSON, for chrome://tracing or
+ * Perfetto. Can be called while tasks run. */
+void task_trace_write(FILE* file);
+
+typedef struct TaskRange
+{
+  size_t f; // first
+  size_t l; // last (excluded)
+} TaskRange;
+
+typedef void(TaskRangeFn)(void* task_data, TaskRange range);
+
+/* Call `task_function` on sub-ranges of `range` no larger than `grain`, from the
+ * calling thread and the workers, and return when all of them completed. The range is
+ * split in halves only as long as the other workers take the halves. A `grain` of 0
+ * picks one from the size of the range and the number of workers.
+ *
+ * Runs on the calling thread, one grain after the other, when the task system is not
+ * initialised. Stops calling `task_function` once the calling task is cancelled. */
+void task_parallel_for(TaskRange range,
+                       size_t grain,
+                       TaskRangeFn* task_function,
+                       void* task_data);
+
 /*
  * Always assign task workloads that, on average, justify the overhead of
  * scheduling a task, however minimal that overhead may be.
@@ -37,7 +127,8 @@ void task_start(TaskHandle task);
  * for the characteristics of your data.
  *
  * Don't try to make batching the job of the task system. The right strategy is
- * tied up with your data design.
+ * tied up with your data design. task_parallel_for only does the partitioning: its
+ * grain is still yours to pick.
  */
 
 #endif
@@ -0,0 +1,492 @@
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+// before any system header: clock_gettime, nanosleep and syscall are hidden by -std=c11
+#define _GNU_SOURCE
+#endif
+#include "xxxx_thread.h"
+
+#include "xxxx_atomic.h"
+
+#include <assert.h>
+
+#if defined(_WIN32)
+
+#if defined(_MSC_VER)
+#pragma comment(lib, "Synchronization.lib") // WaitOnAddress
+#endif
+
+void mtx_init(Mutex* mutex)
+{
+  InitializeCriticalSection(&mutex->critical_section);
+}
+
+void mtx_deinit(Mutex* mutex)
+{
+  DeleteCriticalSection(&mutex->critical_section);
+}
+
+void mtx_lock(Mutex* mutex)
+{
+  EnterCriticalSection(&mutex->critical_section);
+}
+
+void mtx_unlock(Mutex* mutex)
+{
+  LeaveCriticalSection(&mutex->critical_section);
+}
+
+void cnd_init(CondVar* cnd)
+{
+  InitializeConditionVariable(&cnd->condition_variable);
+}
+
+void cnd_deinit(CondVar* cnd)
+{
+  (void)cnd; // nothing to release
+}
+
+void cnd_wait(CondVar* cnd, Mutex* mutex)
+{
+  SleepConditionVariableCS(&cnd->condition_variable, &mutex->critical_section, INFINITE);
+}
+
+void cnd_signal(CondVar* cnd)
+{
+  WakeConditionVariable(&cnd->condition_variable);
+}
+
+void cnd_broadcast(CondVar* cnd)
+{
+  WakeAllConditionVariable(&cnd->condition_variable);
+}
+
+static DWORD WINAPI thread__run(LPVOID lpParameter)
+{
+  Thread* thread = lpParameter;
+  thread->thread_function(thread->thread_data);
+  return 0;
+}
+
+bool thread_start(Thread* d_thread, ThreadFn* thread_function, void* thread_data)
+{
+  d_thread->thread_function = thread_function;
+  d_thread->thread_data = thread_data;
+  d_thread->handle =
+    CreateThread(NULL /* lpThreadAttributes: inherit */, 0 /* dwStackSize: default */,
+                 thread__run, d_thread /* lpParameter */,
+                 0 /* dwCreationFlags: thread runs immediately */, NULL /* lpThreadId */);
+  return d_thread->handle != NULL;
+}
+
+void thread_join(Thread* thread)
+{
+  WaitForSingleObject(thread->handle, INFINITE);
+  CloseHandle(thread->handle);
+  thread->handle = NULL;
+}
+
+void thread_sleep_ms(uint32_t ms)
+{
+  Sleep(ms);
+}
+
+void thread_yield(void)
+{
+  SwitchToThread();
+}
+
+uint64_t thread_clock_ns(void)
+{
+  LARGE_INTEGER frequency, counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  // in two parts, to not overflow
+  uint64_t seconds = (uint64_t)(counter.QuadPart / frequency.QuadPart);
+  uint64_t remainder = (uint64_t)(counter.QuadPart % frequency.QuadPart);
+  return seconds * 1000000000u + remainder * 1000000000u / (uint64_t)frequency.QuadPart;
+}
+
+uint32_t thread_processor_n(void)
+{
+  SYSTEM_INFO system_info;
+  GetSystemInfo(&system_info);
+  return system_info.dwNumberOfProcessors;
+}
+
+void futex_wait(uint32_t* s_address, uint32_t expected)
+{
+  WaitOnAddress(s_address, &expected, sizeof expected, INFINITE);
+}
+
+void futex_wake_one(uint32_t* s_address)
+{
+  WakeByAddressSingle(s_address);
+}
+
+void futex_wake_all(uint32_t* s_address)
+{
+  WakeByAddressAll(s_address);
+}
+
+void fiber_init_thread(Fiber* d_fiber)
+{
+  d_fiber->fiber = ConvertThreadToFiber(NULL);
+  assert(d_fiber->fiber);
+}
+
+void fiber_deinit_thread(Fiber* fiber)
+{
+  ConvertFiberToThread();
+  fiber->fiber = NULL;
+}
+
+static void WINAPI fiber__run(LPVOID lpParameter)
+{
+  Fiber* fiber = lpParameter;
+  fiber->fiber_function(fiber->fiber_data);
+  assert(0); // must switch away instead of returning
+}
+
+bool fiber_create(Fiber* d_fiber,
+                  size_t stack_n,
+                  FiberFn* fiber_function,
+                  void* fiber_data)
+{
+  d_fiber->fiber_function = fiber_function;
+  d_fiber->fiber_data = fiber_data;
+  d_fiber->fiber = CreateFiber(stack_n, fiber__run, d_fiber);
+  return d_fiber->fiber != NULL;
+}
+
+void fiber_destroy(Fiber* fiber)
+{
+  DeleteFiber(fiber->fiber);
+  fiber->fiber = NULL;
+}
+
+void fiber_switch(Fiber* from, Fiber* to)
+{
+  (void)from; // saved by the system
+  SwitchToFiber(to->fiber);
+}
+
+#else
+
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+void mtx_init(Mutex* mutex)
+{
+  pthread_mutex_init(&mutex->mutex, NULL);
+}
+
+void mtx_deinit(Mutex* mutex)
+{
+  pthread_mutex_destroy(&mutex->mutex);
+}
+
+void mtx_lock(Mutex* mutex)
+{
+  pthread_mutex_lock(&mutex->mutex);
+}
+
+void mtx_unlock(Mutex* mutex)
+{
+  pthread_mutex_unlock(&mutex->mutex);
+}
+
+void cnd_init(CondVar* cnd)
+{
+  pthread_cond_init(&cnd->cond, NULL);
+}
+
+void cnd_deinit(CondVar* cnd)
+{
+  pthread_cond_destroy(&cnd->cond);
+}
+
+void cnd_wait(CondVar* cnd, Mutex* mutex)
+{
+  pthread_cond_wait(&cnd->cond, &mutex->mutex);
+}
+
+void cnd_signal(CondVar* cnd)
+{
+  pthread_cond_signal(&cnd->cond);
+}
+
+void cnd_broadcast(CondVar* cnd)
+{
+  pthread_cond_broadcast(&cnd->cond);
+}
+
+static void* thread__run(void* arg)
+{
+  Thread* thread = arg;
+  thread->thread_function(thread->thread_data);
+  return NULL;
+}
+
+bool thread_start(Thread* d_thread, ThreadFn* thread_function, void* thread_data)
+{
+  d_thread->thread_function = thread_function;
+  d_thread->thread_data = thread_data;
+  return 0 == pthread_create(&d_thread->pthread, NULL, thread__run, d_thread);
+}
+
+void thread_join(Thread* thread)
+{
+  pthread_join(thread->pthread, NULL);
+}
+
+void thread_sleep_ms(uint32_t ms)
+{
+  struct timespec duration = {
+    .tv_sec = ms / 1000,
+    .tv_nsec = (long)(ms % 1000) * 1000000,
+  };
+  while (nanosleep(&duration, &duration) != 0)
+    ; // interrupted, sleep the remaining time
+}
+
+void thread_yield(void)
+{
+  sched_yield();
+}
+
+uint64_t thread_clock_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+uint32_t thread_processor_n(void)
+{
+  long processor_n = sysconf(_SC_NPROCESSORS_ONLN);
+  return processor_n > 0 ? (uint32_t)processor_n : 1;
+}
+
+#if defined(__linux__)
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+void futex_wait(uint32_t* s_address, uint32_t expected)
+{
+  syscall(SYS_futex, s_address, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+void futex_wake_one(uint32_t* s_address)
+{
+  syscall(SYS_futex, s_address, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+void futex_wake_all(uint32_t* s_address)
+{
+  syscall(SYS_futex, s_address, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+}
+
+#else
+
+// Without a native futex, waiters park on one of a few condition variables selected by
+// the address. Waking takes the same mutex, so a wake-up cannot slip in between the
+// comparison and the wait.
+
+enum
+{
+  FUTEX_BUCKETS_N = 64,
+};
+
+typedef struct FutexBucket
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} FutexBucket;
+
+static FutexBucket g_futex_buckets[FUTEX_BUCKETS_N];
+static pthread_once_t g_futex_buckets_once = PTHREAD_ONCE_INIT;
+
+static void futex__init_buckets(void)
+{
+  for (FutexBucket *bucket_i = &g_futex_buckets[0],
+                   *bucket_l = &g_futex_buckets[FUTEX_BUCKETS_N];
+       bucket_i < bucket_l; bucket_i++)
+  {
+    pthread_mutex_init(&bucket_i->mutex, NULL);
+    pthread_cond_init(&bucket_i->cond, NULL);
+  }
+}
+
+static FutexBucket* futex__bucket(uint32_t const* s_address)
+{
+  pthread_once(&g_futex_buckets_once, futex__init_buckets);
+  uintptr_t key = (uintptr_t)s_address >> 2;
+  return &g_futex_buckets[(key ^ (key >> 6)) % FUTEX_BUCKETS_N];
+}
+
+void futex_wait(uint32_t* s_address, uint32_t expected)
+{
+  FutexBucket* bucket = futex__bucket(s_address);
+  pthread_mutex_lock(&bucket->mutex);
+  if (atomic_load_uint32(s_address) == expected)
+    pthread_cond_wait(&bucket->cond, &bucket->mutex);
+  pthread_mutex_unlock(&bucket->mutex);
+}
+
+void futex_wake_one(uint32_t* s_address)
+{
+  // the bucket may be shared by other addresses, wake them all to not lose ours
+  futex_wake_all(s_address);
+}
+
+void futex_wake_all(uint32_t* s_address)
+{
+  FutexBucket* bucket = futex__bucket(s_address);
+  pthread_mutex_lock(&bucket->mutex);
+  pthread_cond_broadcast(&bucket->cond);
+  pthread_mutex_unlock(&bucket->mutex);
+}
+
+#endif
+
+void fiber_init_thread(Fiber* d_fiber)
+{
+  // the context is saved by the first switch
+  d_fiber->stack = NULL;
+}
+
+void fiber_deinit_thread(Fiber* fiber)
+{
+  (void)fiber;
+}
+
+// makecontext only passes int arguments, the fiber pointer is passed in two halves
+static void fiber__run(uint32_t fiber_lo, uint32_t fiber_hi)
+{
+  Fiber* fiber = (Fiber*)(uintptr_t)((uint64_t)fiber_hi << 32 | fiber_lo);
+  fiber->fiber_function(fiber->fiber_data);
+  assert(0); // must switch away instead of returning
+}
+
+bool fiber_create(Fiber* d_fiber,
+                  size_t stack_n,
+                  FiberFn* fiber_function,
+                  void* fiber_data)
+{
+  d_fiber->fiber_function = fiber_function;
+  d_fiber->fiber_data = fiber_data;
+  d_fiber->stack = malloc(stack_n);
+  if (!d_fiber->stack || getcontext(&d_fiber->context) != 0)
+  {
+    free(d_fiber->stack), d_fiber->stack = NULL;
+    return false;
+  }
+  d_fiber->context.uc_stack.ss_sp = d_fiber->stack;
+  d_fiber->context.uc_stack.ss_size = stack_n;
+  d_fiber->context.uc_link = NULL;
+  uint64_t fiber_bits = (uint64_t)(uintptr_t)d_fiber;
+  makecontext(&d_fiber->context, (void (*)(void))fiber__run, 2, (uint32_t)fiber_bits,
+              (uint32_t)(fiber_bits >> 32));
+  return true;
+}
+
+void fiber_destroy(Fiber* fiber)
+{
+  free(fiber->stack), fiber->stack = NULL;
+}
+
+void fiber_switch(Fiber* from, Fiber* to)
+{
+  swapcontext(&from->context, &to->context);
+}
+
+#endif
+
+typedef struct TestThreadShared
+{
+  Mutex mutex;
+  uint32_t counter;
+  uint32_t turn; // futex
+} TestThreadShared;
+
+static void test_thread_increment(void* data)
+{
+  TestThreadShared* shared = data;
+  for (int i = 0; i < 10000; i++)
+  {
+    mtx_lock(&shared->mutex);
+    shared->counter++;
+    mtx_unlock(&shared->mutex);
+  }
+
+  // hand over the turn and wait for it to come back
+  atomic_store_uint32(&shared->turn, 1);
+  futex_wake_all(&shared->turn);
+  while (atomic_load_uint32(&shared->turn) == 1)
+    futex_wait(&shared->turn, 1);
+}
+
+typedef struct TestThreadFibers
+{
+  Fiber thread_fiber;
+  Fiber fiber;
+  int steps[4];
+  int steps_n;
+} TestThreadFibers;
+
+static void test_thread_fiber(void* data)
+{
+  TestThreadFibers* fibers = data;
+  for (;;)
+  {
+    fibers->steps[fibers->steps_n++] = 1;
+    fiber_switch(&fibers->fiber, &fibers->thread_fiber);
+  }
+}
+
+int test_thread(int argc, char const** argv)
+{
+  (void)argc, (void)argv;
+  assert(thread_processor_n() >= 1);
+
+  TestThreadShared shared = {0};
+  mtx_init(&shared.mutex);
+  Thread thread;
+  bool started = thread_start(&thread, test_thread_increment, &shared);
+  assert(started);
+  (void)started;
+  for (int i = 0; i < 10000; i++)
+  {
+    mtx_lock(&shared.mutex);
+    shared.counter++;
+    mtx_unlock(&shared.mutex);
+  }
+
+  while (atomic_load_uint32(&shared.turn) == 0)
+    futex_wait(&shared.turn, 0);
+  atomic_store_uint32(&shared.turn, 2);
+  futex_wake_all(&shared.turn);
+  thread_join(&thread);
+
+  assert(shared.counter == 20000);
+  mtx_deinit(&shared.mutex);
+
+  // fibers continue where they switched away
+  {
+    TestThreadFibers fibers = {0};
+    fiber_init_thread(&fibers.thread_fiber);
+    bool created = fiber_create(&fibers.fiber, 64 << 10, test_thread_fiber, &fibers);
+    assert(created);
+    (void)created;
+    fiber_switch(&fibers.thread_fiber, &fibers.fiber);
+    fibers.steps[fibers.steps_n++] = 0;
+    fiber_switch(&fibers.thread_fiber, &fibers.fiber);
+    assert(fibers.steps_n == 3);
+    assert(fibers.steps[0] == 1 && fibers.steps[1] == 0 && fibers.steps[2] == 1);
+    fiber_destroy(&fibers.fiber);
+    fiber_deinit_thread(&fibers.thread_fiber);
+  }
+  return 0;
+}
@@ -0,0 +1,125 @@
+#ifndef XXXX_THREAD
+#define XXXX_THREAD
+
+/*
+ * @lang: c99
+ * @platform: win32, posix (pthreads)
+ *
+ * Threads, mutexes, condition variables, futex-style waits on a 32-bit word and fibers.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <ucontext.h>
+#endif
+
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+typedef struct Mutex
+{
+#if defined(_WIN32)
+  CRITICAL_SECTION critical_section;
+#else
+  pthread_mutex_t mutex;
+#endif
+} Mutex;
+
+void mtx_init(Mutex* mutex);
+void mtx_deinit(Mutex* mutex);
+void mtx_lock(Mutex* mutex);
+void mtx_unlock(Mutex* mutex);
+
+typedef struct CondVar
+{
+#if defined(_WIN32)
+  CONDITION_VARIABLE condition_variable;
+#else
+  pthread_cond_t cond;
+#endif
+} CondVar;
+
+void cnd_init(CondVar* cnd);
+void cnd_deinit(CondVar* cnd);
+// \pre mutex is locked, and is locked again on return. May wake up spuriously.
+void cnd_wait(CondVar* cnd, Mutex* mutex);
+void cnd_signal(CondVar* cnd);
+void cnd_broadcast(CondVar* cnd);
+
+typedef void(ThreadFn)(void* thread_data);
+
+typedef struct Thread
+{
+  ThreadFn* thread_function;
+  void* thread_data;
+#if defined(_WIN32)
+  HANDLE handle;
+#else
+  pthread_t pthread;
+#endif
+} Thread;
+
+// Starts running `thread_function(thread_data)` in a new thread.
+//
+// \pre `d_thread` stays valid until `thread_join`
+bool thread_start(Thread* d_thread, ThreadFn* thread_function, void* thread_data);
+void thread_join(Thread* thread);
+
+void thread_sleep_ms(uint32_t ms);
+// lets another ready thread run on this processor, for spin-waits
+void thread_yield(void);
+
+// monotonic clock, in nanoseconds from an unspecified origin
+uint64_t thread_clock_ns(void);
+
+// number of logical processors available to the process
+uint32_t thread_processor_n(void);
+
+// Blocks while `*s_address == expected`, until woken by a `futex_wake_*` call on the same
+// address. May wake up spuriously, so callers re-check their condition in a loop.
+void futex_wait(uint32_t* s_address, uint32_t expected);
+void futex_wake_one(uint32_t* s_address);
+void futex_wake_all(uint32_t* s_address);
+
+typedef void(FiberFn)(void* fiber_data);
+
+// An execution context with its own stack, that threads switch to and from explicitly.
+typedef struct Fiber
+{
+  FiberFn* fiber_function;
+  void* fiber_data;
+#if defined(_WIN32)
+  void* fiber;
+#else
+  ucontext_t context;
+  void* stack;
+#endif
+} Fiber;
+
+// Makes the calling thread a fiber, so that it can switch to other fibers and back.
+void fiber_init_thread(Fiber* d_fiber);
+// \pre the calling thread runs `fiber`, initialised with fiber_init_thread
+void fiber_deinit_thread(Fiber* fiber);
+
+// \pre `fiber_function` never returns, it switches to another fiber instead
+bool fiber_create(Fiber* d_fiber,
+                  size_t stack_n,
+                  FiberFn* fiber_function,
+                  void* fiber_data);
+// \pre `fiber` is not running
+void fiber_destroy(Fiber* fiber);
+
+// Saves the context of the calling fiber in `from`, and continues `to` where it stopped.
+// \pre `from` is the fiber running on the calling thread
+void fiber_switch(Fiber* from, Fiber* to);
+
+#endif
@@ -2,10 +2,72 @@
 
 #include "md2_math.h"
 
+#include "libs/xxxx_atomic.h"
+#include "libs/xxxx_buf.h"
 #include "libs/xxxx_mu.h"
+#include "libs/xxxx_tasks.h"
 
-void audiobuffer_compute_waveform(struct Mu_AudioBuffer* audiobuffer,
-                                  WaveformData* d_waveform)
+static inline WaveformPartial waveform_partial_unit(void)
+{
+  return (WaveformPartial){
+    .min = min_f_unit(),
+    .max = max_f_unit(),
+    .sum_of_squares = 0.0f,
+  };
+}
+
+static inline WaveformPartial waveform_partial_added(WaveformPartial partial, float x)
+{
+  partial.min = min_f(partial.min, x);
+  partial.max = max_f(partial.max, x);
+  partial.sum_of_squares += x * x;
+  return partial;
+}
+
+static inline WaveformPartial waveform_partial_merged(WaveformPartial a,
+                                                      WaveformPartial b)
+{
+  return (WaveformPartial){
+    .min = min_f(a.min, b.min),
+    .max = max_f(a.max, b.max),
+    .sum_of_squares = a.sum_of_squares + b.sum_of_squares,
+  };
+}
+
+enum
+{
+  WAVEFORM_ANALYSIS_CHUNK_FRAMES_MIN = 1 << 18,
+  WAVEFORM_ANALYSIS_CHUNKS_MAX = 256,
+};
+
+// A chunk covers a range of frames, and produces one partial for each of the
+// buckets it overlaps. Chunks do not need to be aligned on buckets.
+typedef struct WaveformAnalysisChunk
+{
+  struct WaveformAnalysis* analysis;
+  size_t frame_f;
+  size_t frame_l;
+  size_t bucket_f;
+  WaveformPartial* partials; // [bucket_f..bucket_f + partials_n)
+  size_t partials_n;
+} WaveformAnalysisChunk;
+
+typedef struct WaveformAnalysis
+{
+  int16_t const* samples;
+  size_t frame_n;
+  size_t chan_n;
+  size_t frames_per_bucket;
+  WaveformData* waveform;
+  WaveformAnalysisChunk* chunks;
+  size_t chunks_n;
+  WaveformPartial* partials; // storage for all chunks
+} WaveformAnalysis;
+
+static void waveform_analysis__init(WaveformAnalysis* analysis,
+                                    struct Mu_AudioBuffer const* audiobuffer,
+                                    WaveformData* d_waveform,
+                                    size_t chunks_n)
 {
   assert(d_waveform->min);
   assert(d_waveform->max);
@@ -14,37 +76,269 @@ void audiobuffer_compute_waveform(struct Mu_AudioBuffer* audiobuffer,
   size_t n_pot = d_waveform->len_pot;
   size_t chan_n = audiobuffer->format.channels;
   size_t frame_n = audiobuffer->samples_count / chan_n;
-  size_t chunk_size = round_up_multiple_of_pot_uintptr(frame_n, n_pot) / n_pot;
+  *analysis = (WaveformAnalysis){
+    .samples = audiobuffer->samples,
+    .frame_n = frame_n,
+    .chan_n = chan_n,
+    .frames_per_bucket = round_up_multiple_of_pot_uintptr(frame_n, n_pot) / n_pot,
+    .waveform = d_waveform,
+    .chunks = calloc(chunks_n, sizeof analysis->chunks[0]),
+    .chunks_n = chunks_n,
+  };
+  if (!analysis->chunks)
+    md2_fatal("can't allocate");
 
-  size_t s_frame_i = 0;
-  size_t s_frame_n = frame_n;
-  for (size_t chunk_index = 0; chunk_index < n_pot; chunk_index++)
+  size_t chunk_frame_n = (frame_n + chunks_n - 1) / chunks_n;
+  size_t partials_n = 0;
+  for (size_t chunk_i = 0; chunk_i < chunks_n; chunk_i++)
   {
-    float* d_min = &d_waveform->min[chunk_index];
-    float* d_max = &d_waveform->max[chunk_index];
-    float* d_rms = &d_waveform->rms[chunk_index];
-    *d_min = min_f_unit();
-    *d_max = max_f_unit();
-    *d_rms = 0.0f;
+    WaveformAnalysisChunk* chunk = &analysis->chunks[chunk_i];
+    chunk->analysis = analysis;
+    chunk->frame_f = min_i(frame_n, chunk_i * chunk_frame_n);
+    chunk->frame_l = min_i(frame_n, chunk->frame_f + chunk_frame_n);
+    if (chunk->frame_f == chunk->frame_l)
+      continue;
+    chunk->bucket_f = chunk->frame_f / analysis->frames_per_bucket;
+    chunk->partials_n =
+      1 + (chunk->frame_l - 1) / analysis->frames_per_bucket - chunk->bucket_f;
+    partials_n += chunk->partials_n;
+  }
 
-    size_t s_frame_chunk_l = s_frame_i + chunk_size;
-    for (; s_frame_i < s_frame_n && s_frame_i < s_frame_chunk_l; s_frame_i++)
+  analysis->partials = calloc(partials_n, sizeof analysis->partials[0]);
+  if (!analysis->partials)
+    md2_fatal("can't allocate");
+  WaveformPartial* partials = analysis->partials;
+  for (size_t chunk_i = 0; chunk_i < chunks_n; chunk_i++)
+  {
+    analysis->chunks[chunk_i].partials = partials;
+    partials += analysis->chunks[chunk_i].partials_n;
+  }
+}
+
+static void waveform_analysis__free(WaveformAnalysis* analysis)
+{
+  free(analysis->partials), analysis->partials = NULL;
+  free(analysis->chunks), analysis->chunks = NULL;
+}
+
+static void waveform_analysis__run_chunk(WaveformAnalysisChunk* chunk)
+{
+  WaveformAnalysis const* analysis = chunk->analysis;
+  size_t const chan_n = analysis->chan_n;
+  size_t const frames_per_bucket = analysis->frames_per_bucket;
+  float const sample_scale = 1.0f / 32267.0f;
+  size_t frame_i = chunk->frame_f;
+  for (size_t partial_i = 0; partial_i < chunk->partials_n; partial_i++)
+  {
+    size_t frame_l =
+      min_i(chunk->frame_l, (chunk->bucket_f + partial_i + 1) * frames_per_bucket);
+    WaveformPartial partial = waveform_partial_unit();
+    for (int16_t const *s_sample = &analysis->samples[frame_i * chan_n],
+                       *s_sample_l = &analysis->samples[frame_l * chan_n];
+         s_sample < s_sample_l; s_sample++)
+    {
+      partial = waveform_partial_added(partial, *s_sample * sample_scale);
+    }
+    chunk->partials[partial_i] = partial;
+    frame_i = frame_l;
+  }
+  assert(frame_i == chunk->frame_l);
+}
+
+// Merges the chunks' partials into the waveform buckets. Buckets past the end of the
+// samples are padded with silence.
+static void waveform_analysis__reduce(WaveformAnalysis* analysis)
+{
+  WaveformData* d_waveform = analysis->waveform;
+  size_t const frames_per_bucket = analysis->frames_per_bucket;
+  size_t bucket_i = 0;
+  WaveformPartial bucket = waveform_partial_unit();
+  for (WaveformAnalysisChunk *chunk_i = &analysis->chunks[0],
+                             *chunk_l = &chunk_i[analysis->chunks_n];
+       chunk_i < chunk_l; chunk_i++)
+  {
+    for (size_t partial_i = 0; partial_i < chunk_i->partials_n; partial_i++)
     {
-      for (size_t chan_i = 0; chan_i < chan_n; chan_i++)
+      size_t partial_bucket_i = chunk_i->bucket_f + partial_i;
+      if (partial_bucket_i != bucket_i)
       {
-        float x = audiobuffer->samples[s_frame_i * chan_n + chan_i] / 32268.0f;
-        *d_min = min_f(*d_min, x);
-        *d_max = max_f(*d_max, x);
-        *d_rms += x * x;
+        assert(partial_bucket_i == bucket_i + 1);
+        d_waveform->min[bucket_i] = bucket.min;
+        d_waveform->max[bucket_i] = bucket.max;
+        d_waveform->rms[bucket_i] =
+          bucket.sum_of_squares / (frames_per_bucket * analysis->chan_n);
+        bucket_i++;
+        bucket = waveform_partial_unit();
       }
+      bucket = waveform_partial_merged(bucket, chunk_i->partials[partial_i]);
     }
-    for (; s_frame_i < s_frame_chunk_l; s_frame_i++)
+  }
+  for (; bucket_i < d_waveform->len_pot; bucket_i++)
+  {
+    if (bucket_i * frames_per_bucket + frames_per_bucket > analysis->frame_n)
+      bucket = waveform_partial_added(bucket, 0.0f);
+    d_waveform->min[bucket_i] = bucket.min;
+    d_waveform->max[bucket_i] = bucket.max;
+    d_waveform->rms[bucket_i] =
+      bucket.sum_of_squares / (frames_per_bucket * analysis->chan_n);
+    bucket = waveform_partial_unit();
+  }
+  atomic_store_uint32(&d_waveform->ready_n, (uint32_t)d_waveform->len_pot);
+}
+
+static size_t waveform_analysis__chunks_n(struct Mu_AudioBuffer const* audiobuffer)
+{
+  size_t frame_n = audiobuffer->samples_count / audiobuffer->format.channels;
+  return max_i(1, min_i(WAVEFORM_ANALYSIS_CHUNKS_MAX,
+                        frame_n / WAVEFORM_ANALYSIS_CHUNK_FRAMES_MIN));
+}
+
+static void waveform_analysis__run_chunks(void* data, TaskRange range)
+{
+  WaveformAnalysis* analysis = data;
+  for (size_t chunk_i = range.f; chunk_i < range.l; chunk_i++)
+    waveform_analysis__run_chunk(&analysis->chunks[chunk_i]);
+}
+
+void audiobuffer_compute_waveform(struct Mu_AudioBuffer* audiobuffer,
+                                  WaveformData* d_waveform)
+{
+  WaveformAnalysis analysis;
+  waveform_analysis__init(
+    &analysis, audiobuffer, d_waveform, waveform_analysis__chunks_n(audiobuffer));
+  task_parallel_for((TaskRange){0, analysis.chunks_n}, 1, waveform_analysis__run_chunks,
+                    &analysis);
+  waveform_analysis__reduce(&analysis);
+  waveform_analysis__free(&analysis);
+}
+
+static void waveform_analysis__reduce_task(void* data)
+{
+  WaveformAnalysis* analysis = data;
+  waveform_analysis__reduce(analysis);
+  waveform_analysis__free(analysis);
+  free(analysis);
+}
+
+static void waveform_analysis__chunk_task(void* data)
+{
+  WaveformAnalysisChunk* chunk = data;
+  waveform_analysis__run_chunk(chunk);
+}
+
+void audiobuffer_compute_waveform_start(struct Mu_AudioBuffer const* audiobuffer,
+                                        WaveformData* d_waveform,
+                                        TaskHandle then)
+{
+  size_t chunks_n = waveform_analysis__chunks_n(audiobuffer);
+
+  WaveformAnalysis* analysis = calloc(1, sizeof *analysis);
+  if (!analysis)
+    md2_fatal("can't allocate");
+  waveform_analysis__init(analysis, audiobuffer, d_waveform, chunks_n);
+  TaskHandle reduce_task = task_create(waveform_analysis__reduce_task, analysis);
+  if (then.id)
+  {
+    task_depends(reduce_task, then);
+  }
+
+  // @note the chunk tasks can complete as soon as they're started, do not touch
+  // `analysis` past this point.
+  TaskHandle* chunk_tasks = NULL;
+  for (size_t chunk_i = 0; chunk_i < chunks_n; chunk_i++)
+  {
+    TaskHandle chunk_task =
+      task_create(waveform_analysis__chunk_task, &analysis->chunks[chunk_i]);
+    task_depends(chunk_task, reduce_task);
+    buf_push(chunk_tasks, chunk_task);
+  }
+  for (TaskHandle *task_i = &chunk_tasks[0], *task_l = buf_end(chunk_tasks);
+       task_i < task_l; task_i++)
+  {
+    task_start(*task_i);
+  }
+  buf_free(chunk_tasks);
+}
+
+static void waveform_stream__publish(WaveformStream* stream, size_t frame_n)
+{
+  WaveformData* d_waveform = stream->waveform;
+  size_t bucket_index = stream->bucket_index;
+  d_waveform->min[bucket_index] = stream->bucket.min;
+  d_waveform->max[bucket_index] = stream->bucket.max;
+  d_waveform->rms[bucket_index] = stream->bucket.sum_of_squares / frame_n;
+  stream->bucket_index++;
+  stream->bucket_frame_n = 0;
+  stream->bucket = waveform_partial_unit();
+  atomic_store_uint32(&d_waveform->ready_n, (uint32_t)stream->bucket_index);
+}
+
+void waveform_stream_start(WaveformStream* stream,
+                           WaveformData* d_waveform,
+                           size_t expected_frame_n)
+{
+  assert(d_waveform->min);
+  assert(d_waveform->max);
+  assert(d_waveform->rms);
+  assert(d_waveform->len_pot);
+  size_t n_pot = d_waveform->len_pot;
+  *stream = (WaveformStream){
+    .waveform = d_waveform,
+    .frames_per_bucket =
+      round_up_multiple_of_pot_uintptr(expected_frame_n, n_pot) / n_pot,
+    .bucket = waveform_partial_unit(),
+  };
+  stream->overflowed = stream->frames_per_bucket == 0;
+  atomic_store_uint32(&d_waveform->ready_n, 0);
+}
+
+void waveform_stream_push_int16(WaveformStream* stream,
+                                int16_t const* s_samples,
+                                size_t frame_n,
+                                size_t chan_n,
+                                MD2_Float2* d_frames)
+{
+  assert(chan_n > 0);
+  stream->chan_n = chan_n;
+  size_t const frames_per_bucket = stream->frames_per_bucket;
+  float const sample_scale = 1.0f / 32267.0f;
+  int16_t const* s_sample = s_samples;
+  for (MD2_Float2 *d_frame = &d_frames[0], *d_frame_l = &d_frames[frame_n];
+       d_frame < d_frame_l; d_frame++, s_sample += chan_n)
+  {
+    d_frame->x = s_sample[0] * sample_scale;
+    d_frame->y = chan_n > 1 ? s_sample[1] * sample_scale : d_frame->x;
+    if (stream->overflowed)
+      continue;
+    if (stream->bucket_index == stream->waveform->len_pot)
+    {
+      stream->overflowed = true;
+      continue;
+    }
+
+    WaveformPartial bucket = stream->bucket;
+    bucket = waveform_partial_added(bucket, d_frame->x);
+    if (chan_n > 1)
+      bucket = waveform_partial_added(bucket, d_frame->y);
+    for (size_t chan_i = 2; chan_i < chan_n; chan_i++)
+      bucket = waveform_partial_added(bucket, s_sample[chan_i] * sample_scale);
+    stream->bucket = bucket;
+
+    if (++stream->bucket_frame_n == frames_per_bucket)
     {
-      *d_min = min_f(*d_min, 0.0f);
-      *d_max = max_f(*d_min, 0.0f);
-      *d_rms += 0.0f;
+      waveform_stream__publish(stream, frames_per_bucket * chan_n);
     }
-    *d_rms /= (chunk_size * chan_n);
   }
-  assert(s_frame_i >= s_frame_n);
+}
+
+void waveform_stream_end(WaveformStream* stream)
+{
+  if (stream->overflowed)
+    return;
+  size_t const sample_n = stream->frames_per_bucket * max_i(1, stream->chan_n);
+  while (stream->bucket_index < stream->waveform->len_pot)
+  {
+    stream->bucket = waveform_partial_added(stream->bucket, 0.0f);
+    waveform_stream__publish(stream, sample_n);
+  }
 }
@@ -1,15 +1,70 @@
 #ifndef MD2_AUDIO
 #define MD2_AUDIO
 
+#include "md2_types.h"
+
+#include "libs/xxxx_tasks.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct Mu_AudioBuffer;
+
 typedef struct WaveformData
 {
   float* min;
   float* max;
   float* rms;
   size_t len_pot;
+  uint32_t ready_n; // @atomic [0..ready_n) buckets are complete and may be read
 } WaveformData;
 
 void audiobuffer_compute_waveform(struct Mu_AudioBuffer* audiobuffer,
                                   WaveformData* d_waveform);
 
+// Same as `audiobuffer_compute_waveform`, split in chunks analysed by parallel tasks
+// and merged by a final task. `then` (may be null) is started when the waveform is
+// complete. The samples must stay valid until then.
+void audiobuffer_compute_waveform_start(struct Mu_AudioBuffer const* audiobuffer,
+                                        WaveformData* d_waveform,
+                                        TaskHandle then);
+
+// Partial analysis of a range of frames.
+typedef struct WaveformPartial
+{
+  float min;
+  float max;
+  float sum_of_squares;
+} WaveformPartial;
+
+// Computes the waveform in the same pass as the samples are decoded, publishing
+// buckets as soon as they are complete.
+typedef struct WaveformStream
+{
+  WaveformData* waveform;
+  size_t frames_per_bucket;
+  size_t chan_n;
+  size_t bucket_index;
+  size_t bucket_frame_n; // frames accumulated in the current bucket
+  WaveformPartial bucket;
+  bool overflowed; // more frames were pushed than were expected
+} WaveformStream;
+
+// \pre expected_frame_n is an estimate, or 0 when unknown in which case no buckets
+// are produced and the stream is marked as overflowed.
+void waveform_stream_start(WaveformStream* stream,
+                           WaveformData* d_waveform,
+                           size_t expected_frame_n);
+
+// Converts interleaved samples to stereo frames and accumulates them in the waveform.
+void waveform_stream_push_int16(WaveformStream* stream,
+                                int16_t const* s_samples,
+                                size_t frame_n,
+                                size_t chan_n,
+                                MD2_Float2* d_frames);
+
+// Completes and publishes the remaining buckets, as if padded by silence.
+void waveform_stream_end(WaveformStream* stream);
+
 #endif
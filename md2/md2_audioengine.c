@@ -20,29 +20,32 @@ typedef struct MD2_AudioEngineState
   MD2_AudioState client_state;
 } MD2_AudioEngineState;
 
+// messages copied into the queues between the client and the audio thread
+enum
+{
+  MD2_AudioEngineMessage_EngineState = 1, // MD2_AudioEngineState, to the client
+  MD2_AudioEngineMessage_ClientState,     // MD2_AudioState, to the engine
+};
+
 typedef struct MD2_AudioEngine
 {
-  MD2_AudioEngineState* state; // current
+  MD2_AudioEngineState state; // owned by the audio thread
   double preview_clip_phase;
 
-  QueueWriter to_client_writer;
-  QueueReader from_client_reader;
-  Queue to_client_queue;
-  Queue from_client_queue;
+  ByteQueueWriter to_client_writer;
+  ByteQueueReader from_client_reader;
+  ByteQueue to_client_queue;
+  ByteQueue from_client_queue;
   Map entities;
 
   // Client
-  MD2_AudioEngineState nursery[2];
-  uint32_t engine_nursery_index;
-
-  QueueReader client_reader;
-  QueueWriter client_writer;
+  ByteQueueReader client_reader;
+  ByteQueueWriter client_writer;
 } MD2_AudioEngine;
 
 struct MD2_AudioEngine* md2_audioengine_init()
 {
   MD2_AudioEngine* engine = calloc(1, sizeof *engine);
-  engine->state = &engine->nursery[0];
   engine->to_client_writer.queue = &engine->to_client_queue;
   engine->client_reader.queue = &engine->to_client_queue;
   engine->from_client_reader.queue = &engine->from_client_queue;
@@ -55,39 +58,29 @@ struct MD2_AudioEngine* md2_audioengine_init()
 
 void md2_audioengine_deinit(struct MD2_AudioEngine* engine)
 {
-  queue_reader_free(&engine->client_reader);
-  queue_writer_free(&engine->client_writer);
-  queue_writer_free(&engine->to_client_writer);
-  queue_free(&engine->to_client_queue);
-  queue_reader_free(&engine->from_client_reader);
-  queue_free(&engine->from_client_queue);
   free(engine);
 }
 
-static md2_audioengine__push_to_client(MD2_AudioEngine* engine)
+static void md2_audioengine__push_to_client(MD2_AudioEngine* engine)
 {
-  QueueWriter* writer = &engine->to_client_writer;
-  queue_flush(writer);
-  if (buf_len(writer->writer_buffer) > 0)
-  {
-    for (void **d_msg_i = &writer->writer_buffer[0], **d_msg_l = buf_end(d_msg_i);
-         d_msg_i < d_msg_l; d_msg_i++)
-    {
-      *d_msg_i = engine->state;
-    }
-  }
-  else
-  {
-    queue_push(writer, engine->state);
-  }
+  // when the client is behind, it gets the next state instead
+  byte_queue_push(&engine->to_client_writer, MD2_AudioEngineMessage_EngineState,
+                  &engine->state, sizeof engine->state);
 }
 
 static void md2_audioengine__pull_from_client(MD2_AudioEngine* engine,
                                               struct Mu_AudioBuffer* output)
 {
-  for (void* src; src = queue_pull_next(&engine->from_client_reader);)
+  // only the latest state matters
+  ByteQueueReader* reader = &engine->from_client_reader;
+  for (ByteQueueMessage message; byte_queue_peek(reader, &message);
+       byte_queue_pop(reader))
   {
-    engine->state = src;
+    if (message.type == MD2_AudioEngineMessage_ClientState)
+    {
+      memcpy(&engine->state.client_state, message.payload,
+             sizeof engine->state.client_state);
+    }
   }
 }
 
@@ -149,34 +142,35 @@ void md2_audioengine_mu_audiocallback(struct MD2_AudioEngine* engine,
                                       struct Mu_AudioBuffer* output)
 {
   md2_audioengine__pull_from_client(engine, output);
-  engine->state->output_format = output->format;
+  engine->state.output_format = output->format;
 
   memset(&output->samples[0], 0, output->samples_count * sizeof output->samples[0]);
-  if (engine->state->client_state.preview_clip_is_playing)
+  if (engine->state.client_state.preview_clip_is_playing)
   {
     assert(output->format.channels == 2);
     reference_tone_n(
       &output->samples[0], output->samples_count / output->format.channels);
     clip_player_mixdown(
-      &engine->state->client_state.preview_clip, &engine->preview_clip_phase, output);
-    engine->state->client_state.preview_clip.phase = engine->preview_clip_phase;
+      &engine->state.client_state.preview_clip, &engine->preview_clip_phase, output);
+    engine->state.client_state.preview_clip.phase = engine->preview_clip_phase;
   }
   md2_audioengine__push_to_client(engine);
 }
 
 void md2_audioengine_update(struct MD2_AudioEngine* engine, MD2_AudioState* audio_state)
 {
-  bool engine_state_updated = false;
-  for (void* src; src = queue_pull_next(&engine->client_reader);)
+  ByteQueueReader* reader = &engine->client_reader;
+  for (ByteQueueMessage message; byte_queue_peek(reader, &message);
+       byte_queue_pop(reader))
   {
-    MD2_AudioEngineState* engine_state_ptr = src;
-    audio_state->preview_clip.phase = engine_state_ptr->client_state.preview_clip.phase;
-    audio_state->time.samples_per_second =
-      engine_state_ptr->output_format.samples_per_second;
-    engine->engine_nursery_index = engine_state_ptr - &engine->nursery[0];
+    if (message.type != MD2_AudioEngineMessage_EngineState)
+      continue;
+    MD2_AudioEngineState const* engine_state = message.payload;
+    audio_state->preview_clip.phase = engine_state->client_state.preview_clip.phase;
+    audio_state->time.samples_per_second = engine_state->output_format.samples_per_second;
   }
 
-  MD2_AudioEngineState* next_state = &engine->nursery[1 - engine->engine_nursery_index];
-  next_state->client_state = *audio_state;
-  queue_push(&engine->client_writer, next_state);
+  // when the engine is behind, it gets the next state instead
+  byte_queue_push(&engine->client_writer, MD2_AudioEngineMessage_ClientState, audio_state,
+                  sizeof *audio_state);
 }
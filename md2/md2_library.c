@@ -0,0 +1,1700 @@
+#include "md2_library.h"
+
+#include "md2_math.h"
+#include "md2_serialisation.h"
+
+#include "libs/xxxx_atomic.h"
+#include "libs/xxxx_buf.h"
+#include "libs/xxxx_iobuffer.h"
+#include "libs/xxxx_map.h"
+#include "libs/xxxx_tasks.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+#include <assert.h>
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum
+{
+  LIBRARY_INDEX_MAGIC = 0x4c32444d, // "MD2L"
+  LIBRARY_INDEX_VERSION = 1,
+  LIBRARY_INDEX_NAMES_MAX = 1 << 30, // bytes, guards against corrupted files
+  LIBRARY_PROBE_BYTES_MAX = 1 << 16, // give up on headers past this
+};
+
+static uint32_t library__names_push(char** d_names_buf, char const* name)
+{
+  char* names_buf = *d_names_buf;
+  size_t offset = buf_len(names_buf);
+  buf_printf(names_buf, "%s", name);
+  buf_push(names_buf, '\0');
+  *d_names_buf = names_buf;
+  return (uint32_t)offset;
+}
+
+static bool library__is_separator(char c)
+{
+  return c == '/' || c == '\\';
+}
+
+void library_index_free(LibraryIndex* index)
+{
+  free(index->root_abspath), index->root_abspath = NULL;
+  buf_free(index->names_buf);
+  buf_free(index->dirs_buf);
+  buf_free(index->files_buf);
+  library_search_index_free(&index->search);
+}
+
+uint32_t library_index_find_directory(LibraryIndex const* index, char const* abspath)
+{
+  if (buf_len(index->dirs_buf) == 0)
+    return LIBRARY_INDEX_NONE;
+
+  size_t root_n = strlen(index->root_abspath);
+  if (0 != strncmp(abspath, index->root_abspath, root_n))
+    return LIBRARY_INDEX_NONE;
+  char const* path_i = &abspath[root_n];
+  if (*path_i && root_n > 0 && !library__is_separator(index->root_abspath[root_n - 1])
+      && !library__is_separator(*path_i))
+    return LIBRARY_INDEX_NONE; // a sibling sharing a prefix with the root
+
+  uint32_t dir_i = 0;
+  while (*path_i)
+  {
+    while (library__is_separator(*path_i))
+      path_i++;
+    char const* name_f = path_i;
+    while (*path_i && !library__is_separator(*path_i))
+      path_i++;
+    size_t name_n = path_i - name_f;
+    if (name_n == 0)
+      break;
+
+    LibraryDirectory const* dir = &index->dirs_buf[dir_i];
+    uint32_t child_i = dir->first_dir_index;
+    uint32_t child_l = dir->first_dir_index + dir->dir_n;
+    for (; child_i < child_l; child_i++)
+    {
+      char const* child_name = &index->names_buf[index->dirs_buf[child_i].name_offset];
+      if (0 == strncmp(child_name, name_f, name_n) && child_name[name_n] == '\0')
+        break;
+    }
+    if (child_i == child_l)
+      return LIBRARY_INDEX_NONE;
+    dir_i = child_i;
+  }
+  return dir_i;
+}
+
+static void library_index__directory_path(LibraryIndex const* index,
+                                          uint32_t dir_index,
+                                          char** d_path_buf)
+{
+  if (dir_index == 0)
+  {
+    buf_printf(*d_path_buf, "%s", index->root_abspath);
+    return;
+  }
+  LibraryDirectory const* dir = &index->dirs_buf[dir_index];
+  library_index__directory_path(index, dir->parent_index, d_path_buf);
+  buf_printf(*d_path_buf, "/%s", &index->names_buf[dir->name_offset]);
+}
+
+void library_index_file_path(LibraryIndex const* index,
+                             uint32_t file_index,
+                             char** d_path_buf)
+{
+  LibraryFile const* file = &index->files_buf[file_index];
+  library_index__directory_path(index, file->dir_index, d_path_buf);
+  buf_printf(*d_path_buf, "/%s", &index->names_buf[file->name_offset]);
+}
+
+// Persistence
+
+static bool library__write_string(IOBuffer* out, char const* string)
+{
+  uint32_t n = (uint32_t)strlen(string);
+  return write_uint32(out, &n) && write_uint8_n(out, (uint8_t*)string, n);
+}
+
+static bool library__read_string(IOBuffer* in, char** d_string)
+{
+  uint32_t n;
+  if (!read_uint32(in, &n) || n >= LIBRARY_INDEX_NAMES_MAX)
+    return false;
+  char* string = malloc((size_t)n + 1);
+  if (!read_uint8_n(in, (uint8_t*)string, n))
+  {
+    free(string);
+    return false;
+  }
+  string[n] = '\0';
+  *d_string = string;
+  return true;
+}
+
+bool library_index_write(LibraryIndex const* index, IOBuffer* out)
+{
+  uint32_t magic = LIBRARY_INDEX_MAGIC;
+  uint32_t version = LIBRARY_INDEX_VERSION;
+  uint32_t names_n = (uint32_t)buf_len(index->names_buf);
+  uint32_t dirs_n = (uint32_t)buf_len(index->dirs_buf);
+  uint32_t files_n = (uint32_t)buf_len(index->files_buf);
+
+  bool ok = write_uint32(out, &magic) && write_uint32(out, &version)
+            && library__write_string(out, index->root_abspath)
+            && write_uint32(out, &names_n)
+            && write_uint8_n(out, (uint8_t*)index->names_buf, names_n)
+            && write_uint32(out, &dirs_n);
+  for (LibraryDirectory *dir_i = &index->dirs_buf[0], *dir_l = &dir_i[dirs_n];
+       ok && dir_i < dir_l; dir_i++)
+  {
+    ok = write_uint32(out, &dir_i->parent_index) && write_uint32(out, &dir_i->name_offset)
+         && write_uint32(out, &dir_i->first_dir_index) && write_uint32(out, &dir_i->dir_n)
+         && write_uint32(out, &dir_i->first_file_index)
+         && write_uint32(out, &dir_i->file_n) && write_uint64(out, &dir_i->mtime);
+  }
+  ok = ok && write_uint32(out, &files_n);
+  for (LibraryFile *file_i = &index->files_buf[0], *file_l = &file_i[files_n];
+       ok && file_i < file_l; file_i++)
+  {
+    ok = write_uint32(out, &file_i->dir_index) && write_uint32(out, &file_i->name_offset)
+         && write_uint64(out, &file_i->size) && write_uint64(out, &file_i->mtime)
+         && write_uint32(out, &file_i->duration_ms) && write_uint8(out, &file_i->format)
+         && write_uint8(out, &file_i->chan_n);
+  }
+  return ok;
+}
+
+// checks that all offsets and ranges of a read index are within bounds, so that the
+// rest of the program can trust it.
+static bool library_index__is_valid(LibraryIndex const* index)
+{
+  size_t names_n = buf_len(index->names_buf);
+  size_t dirs_n = buf_len(index->dirs_buf);
+  size_t files_n = buf_len(index->files_buf);
+  if (names_n == 0 || index->names_buf[names_n - 1] != '\0' || dirs_n == 0)
+    return false;
+  if (index->dirs_buf[0].parent_index != LIBRARY_INDEX_NONE)
+    return false;
+  for (size_t dir_i = 0; dir_i < dirs_n; dir_i++)
+  {
+    LibraryDirectory const* dir = &index->dirs_buf[dir_i];
+    if (dir_i > 0 && dir->parent_index >= dir_i)
+      return false;
+    if (dir->name_offset >= names_n)
+      return false;
+    if (dir->first_dir_index <= dir_i || dir->first_dir_index > dirs_n
+        || dir->dir_n > dirs_n - dir->first_dir_index)
+      return false;
+    if (dir->first_file_index > files_n || dir->file_n > files_n - dir->first_file_index)
+      return false;
+  }
+  for (size_t file_i = 0; file_i < files_n; file_i++)
+  {
+    LibraryFile const* file = &index->files_buf[file_i];
+    if (file->dir_index >= dirs_n || file->name_offset >= names_n
+        || file->format >= LibraryFileFormat_Count)
+      return false;
+  }
+  return true;
+}
+
+bool library_index_read(LibraryIndex* d_index, IOBuffer* in)
+{
+  LibraryIndex index = {0};
+  uint32_t magic, version, names_n, dirs_n, files_n;
+  bool ok = read_uint32(in, &magic) && magic == LIBRARY_INDEX_MAGIC
+            && read_uint32(in, &version) && version == LIBRARY_INDEX_VERSION
+            && library__read_string(in, &index.root_abspath) && read_uint32(in, &names_n)
+            && names_n < LIBRARY_INDEX_NAMES_MAX;
+  if (ok)
+    buf_fit(index.names_buf, names_n);
+  for (uint32_t name_i = 0; ok && name_i < names_n;)
+  {
+    uint8_t chunk[4096];
+    uint32_t chunk_n = min_i(names_n - name_i, sizeof chunk);
+    ok = read_uint8_n(in, chunk, chunk_n);
+    for (uint32_t chunk_i = 0; ok && chunk_i < chunk_n; chunk_i++)
+      buf_push(index.names_buf, (char)chunk[chunk_i]);
+    name_i += chunk_n;
+  }
+  ok = ok && read_uint32(in, &dirs_n);
+  for (uint32_t dir_i = 0; ok && dir_i < dirs_n; dir_i++)
+  {
+    LibraryDirectory dir;
+    ok = read_uint32(in, &dir.parent_index) && read_uint32(in, &dir.name_offset)
+         && read_uint32(in, &dir.first_dir_index) && read_uint32(in, &dir.dir_n)
+         && read_uint32(in, &dir.first_file_index) && read_uint32(in, &dir.file_n)
+         && read_uint64(in, &dir.mtime);
+    if (ok)
+      buf_push(index.dirs_buf, dir);
+  }
+  ok = ok && read_uint32(in, &files_n);
+  for (uint32_t file_i = 0; ok && file_i < files_n; file_i++)
+  {
+    LibraryFile file;
+    ok = read_uint32(in, &file.dir_index) && read_uint32(in, &file.name_offset)
+         && read_uint64(in, &file.size) && read_uint64(in, &file.mtime)
+         && read_uint32(in, &file.duration_ms) && read_uint8(in, &file.format)
+         && read_uint8(in, &file.chan_n);
+    if (ok)
+      buf_push(index.files_buf, file);
+  }
+  ok = ok && library_index__is_valid(&index);
+  if (!ok)
+  {
+    library_index_free(&index);
+    return false;
+  }
+  *d_index = index;
+  return true;
+}
+
+// Search
+
+static char library__fold(char c)
+{
+  return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+static uint32_t library__trigram(char const* s)
+{
+  return (uint32_t)(uint8_t)s[0] << 16 | (uint32_t)(uint8_t)s[1] << 8 | (uint8_t)s[2];
+}
+
+// Sorts (trigram << 32 | file index) pairs by trigram, keeping the order of file
+// indices. Radix sort in two passes of 12 bits.
+static void library_search__sort_pairs(uint64_t* pairs, uint64_t* scratch, size_t n)
+{
+  enum
+  {
+    DIGIT_BITS = 12,
+    DIGIT_N = 1 << DIGIT_BITS,
+  };
+  uint32_t* counts = malloc(DIGIT_N * sizeof counts[0]);
+  for (int shift = 32; shift < 32 + 24; shift += DIGIT_BITS)
+  {
+    memset(counts, 0, DIGIT_N * sizeof counts[0]);
+    for (size_t pair_i = 0; pair_i < n; pair_i++)
+      counts[(pairs[pair_i] >> shift) & (DIGIT_N - 1)]++;
+    uint32_t offset = 0;
+    for (size_t digit = 0; digit < DIGIT_N; digit++)
+    {
+      uint32_t count = counts[digit];
+      counts[digit] = offset;
+      offset += count;
+    }
+    for (size_t pair_i = 0; pair_i < n; pair_i++)
+      scratch[counts[(pairs[pair_i] >> shift) & (DIGIT_N - 1)]++] = pairs[pair_i];
+    uint64_t* sorted = scratch;
+    scratch = pairs;
+    pairs = sorted;
+  }
+  // after an even number of passes the result is back in the input array
+  free(counts);
+}
+
+enum
+{
+  LIBRARY_SEARCH_EXTRACTION_GRAIN = 1 << 12, // files
+};
+
+typedef struct LibrarySearchPairsExtraction
+{
+  LibraryIndex const* index;
+  char const* folded_names;
+  size_t* pairs_offsets; // [files_n + 1] first pair of every file
+  uint64_t* pairs;       // trigram << 32 | file index
+} LibrarySearchPairsExtraction;
+
+static void library_search__extract_pairs(void* data, TaskRange files_range)
+{
+  LibrarySearchPairsExtraction* extraction = data;
+  uint64_t* d_pair = &extraction->pairs[extraction->pairs_offsets[files_range.f]];
+  for (size_t file_i = files_range.f; file_i < files_range.l; file_i++)
+  {
+    char const* name =
+      &extraction->folded_names[extraction->index->files_buf[file_i].name_offset];
+    for (size_t char_i = 0; name[char_i] && name[char_i + 1] && name[char_i + 2];
+         char_i++)
+      *d_pair++ = (uint64_t)library__trigram(&name[char_i]) << 32 | file_i;
+  }
+  assert(d_pair == &extraction->pairs[extraction->pairs_offsets[files_range.l]]);
+}
+
+void library_search_index_build(LibrarySearchIndex* d_search, LibraryIndex const* index)
+{
+  LibrarySearchIndex search = {0};
+  size_t names_n = buf_len(index->names_buf);
+  buf_fit(search.folded_names_buf, names_n);
+  for (size_t name_i = 0; name_i < names_n; name_i++)
+    buf_push(search.folded_names_buf, library__fold(index->names_buf[name_i]));
+
+  // each file's pairs have a known place, so that they can be extracted in parallel
+  size_t files_n = buf_len(index->files_buf);
+  LibrarySearchPairsExtraction extraction = {
+    .index = index,
+    .folded_names = search.folded_names_buf,
+    .pairs_offsets = malloc((files_n + 1) * sizeof extraction.pairs_offsets[0]),
+  };
+  size_t pairs_n = 0;
+  for (size_t file_i = 0; file_i < files_n; file_i++)
+  {
+    extraction.pairs_offsets[file_i] = pairs_n;
+    size_t name_n =
+      strlen(&search.folded_names_buf[index->files_buf[file_i].name_offset]);
+    pairs_n += name_n > 2 ? name_n - 2 : 0;
+  }
+  extraction.pairs_offsets[files_n] = pairs_n;
+  uint64_t* pairs_buf = malloc(pairs_n * sizeof pairs_buf[0]);
+  uint64_t* scratch = malloc(pairs_n * sizeof scratch[0]);
+  extraction.pairs = pairs_buf;
+  task_parallel_for((TaskRange){0, files_n}, LIBRARY_SEARCH_EXTRACTION_GRAIN,
+                    library_search__extract_pairs, &extraction);
+  free(extraction.pairs_offsets);
+  library_search__sort_pairs(pairs_buf, scratch, pairs_n);
+  free(scratch);
+
+  for (size_t pair_i = 0; pair_i < pairs_n; pair_i++)
+  {
+    uint64_t pair = pairs_buf[pair_i];
+    if (pair_i > 0 && pair == pairs_buf[pair_i - 1])
+      continue; // trigram repeated within a name
+    uint32_t trigram = (uint32_t)(pair >> 32);
+    if (buf_len(search.trigrams_buf) == 0 || buf_end(search.trigrams_buf)[-1] != trigram)
+    {
+      buf_push(search.trigrams_buf, trigram);
+      buf_push(search.postings_offsets_buf, (uint32_t)buf_len(search.postings_buf));
+    }
+    buf_push(search.postings_buf, (uint32_t)pair);
+  }
+  buf_push(search.postings_offsets_buf, (uint32_t)buf_len(search.postings_buf));
+  free(pairs_buf);
+  *d_search = search;
+}
+
+void library_search_index_free(LibrarySearchIndex* search)
+{
+  buf_free(search->folded_names_buf);
+  buf_free(search->trigrams_buf);
+  buf_free(search->postings_offsets_buf);
+  buf_free(search->postings_buf);
+}
+
+// returns false when the trigram does not appear in any name
+static bool library_search__postings(LibrarySearchIndex const* search,
+                                     uint32_t trigram,
+                                     uint32_t const** d_postings_f,
+                                     uint32_t const** d_postings_l)
+{
+  size_t lo = 0, hi = buf_len(search->trigrams_buf);
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    if (search->trigrams_buf[mid] < trigram)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == buf_len(search->trigrams_buf) || search->trigrams_buf[lo] != trigram)
+    return false;
+  *d_postings_f = &search->postings_buf[search->postings_offsets_buf[lo]];
+  *d_postings_l = &search->postings_buf[search->postings_offsets_buf[lo + 1]];
+  return true;
+}
+
+// keeps in `candidates` the file indices present in the postings, both ascending.
+// Gallops through the postings, which are usually longer than the candidates.
+static void library_search__intersect(uint32_t** d_candidates_buf,
+                                      uint32_t const* postings_f,
+                                      uint32_t const* postings_l)
+{
+  uint32_t* candidates = *d_candidates_buf;
+  size_t kept_n = 0;
+  for (size_t candidate_i = 0; candidate_i < buf_len(candidates); candidate_i++)
+  {
+    uint32_t candidate = candidates[candidate_i];
+    size_t step = 1;
+    while (step < (size_t)(postings_l - postings_f) && postings_f[step] < candidate)
+      postings_f += step, step *= 2;
+    uint32_t const* lo = postings_f;
+    uint32_t const* hi = postings_f + min_i(step + 1, postings_l - postings_f);
+    while (lo < hi)
+    {
+      uint32_t const* mid = lo + (hi - lo) / 2;
+      if (*mid < candidate)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    postings_f = lo;
+    if (postings_f == postings_l)
+      break;
+    if (*postings_f == candidate)
+      candidates[kept_n++] = candidate;
+  }
+  buf_truncate(candidates, kept_n);
+}
+
+typedef struct LibrarySearchPostings
+{
+  uint32_t const* f;
+  uint32_t const* l;
+} LibrarySearchPostings;
+
+static int library_search__compare_postings_n(void const* a_ptr, void const* b_ptr)
+{
+  LibrarySearchPostings const* a = a_ptr;
+  LibrarySearchPostings const* b = b_ptr;
+  ptrdiff_t a_n = a->l - a->f, b_n = b->l - b->f;
+  return a_n < b_n ? -1 : a_n > b_n ? 1 : 0;
+}
+
+// returns the score of the name, or -1 when a term is missing
+static int32_t library_search__score(LibrarySearch const* search,
+                                     char const* folded_name,
+                                     char const* name)
+{
+  int32_t score = 0;
+  for (size_t term_i = 0; term_i < search->terms_n; term_i++)
+  {
+    LibrarySearchTerm term = search->terms[term_i];
+    char const* term_chars = &search->folded_query[term.offset];
+    char const* match = folded_name;
+    while ((match = strchr(match, term_chars[0]))
+           && 0 != strncmp(match, term_chars, term.chars_n))
+      match++;
+    if (!match)
+      return -1;
+    size_t match_i = match - folded_name;
+    bool at_word_start = match_i == 0 || !isalnum((unsigned char)name[match_i - 1])
+                         || (isupper((unsigned char)name[match_i])
+                             && islower((unsigned char)name[match_i - 1]));
+    score += match_i == 0 ? 1000 : at_word_start ? 500 : 100;
+  }
+  return score - (int32_t)min_i(strlen(name), 255);
+}
+
+static bool library_search__result_is_better(LibrarySearchResult a, LibrarySearchResult b)
+{
+  return a.score > b.score || (a.score == b.score && a.file_index < b.file_index);
+}
+
+// The results are a heap with the worst result at the top, so that only the best
+// `results_max` are retained.
+static void library_search__heap_sift_down(LibrarySearchResult* heap, size_t n, size_t i)
+{
+  for (;;)
+  {
+    size_t worst_i = i;
+    size_t left_i = 2 * i + 1, right_i = 2 * i + 2;
+    if (left_i < n && library_search__result_is_better(heap[worst_i], heap[left_i]))
+      worst_i = left_i;
+    if (right_i < n && library_search__result_is_better(heap[worst_i], heap[right_i]))
+      worst_i = right_i;
+    if (worst_i == i)
+      return;
+    LibrarySearchResult tmp = heap[i];
+    heap[i] = heap[worst_i];
+    heap[worst_i] = tmp;
+    i = worst_i;
+  }
+}
+
+static void library_search__heap_push(LibrarySearch* search, LibrarySearchResult result)
+{
+  LibrarySearchResult* heap = search->results;
+  size_t n = search->results_n;
+  if (n == search->results_max)
+  {
+    if (n == 0 || !library_search__result_is_better(result, heap[0]))
+      return;
+    search->results_version++;
+    heap[0] = result;
+    library_search__heap_sift_down(heap, n, 0);
+    return;
+  }
+  search->results_version++;
+  size_t i = n;
+  heap[i] = result;
+  while (i > 0 && library_search__result_is_better(heap[(i - 1) / 2], heap[i]))
+  {
+    LibrarySearchResult tmp = heap[i];
+    heap[i] = heap[(i - 1) / 2];
+    heap[(i - 1) / 2] = tmp;
+    i = (i - 1) / 2;
+  }
+  search->results_n = n + 1;
+}
+
+void library_search_start(LibrarySearch* search,
+                          LibraryIndex const* index,
+                          char const* query,
+                          size_t results_max)
+{
+  *search = (LibrarySearch){
+    .index = index,
+    .results = calloc(results_max, sizeof search->results[0]),
+    .results_max = results_max,
+  };
+  char* folded_query = search->folded_query;
+  size_t folded_query_n = 0;
+  while (query[folded_query_n] && folded_query_n + 1 < sizeof search->folded_query)
+  {
+    folded_query[folded_query_n] = library__fold(query[folded_query_n]);
+    folded_query_n++;
+  }
+  folded_query[folded_query_n] = '\0';
+
+  for (size_t term_f = 0;
+       folded_query[term_f] && search->terms_n < LIBRARY_SEARCH_TERMS_MAX;)
+  {
+    if (folded_query[term_f] == ' ')
+    {
+      term_f++;
+      continue;
+    }
+    size_t term_l = term_f;
+    while (folded_query[term_l] && folded_query[term_l] != ' ')
+      term_l++;
+    search->terms[search->terms_n++] = (LibrarySearchTerm){
+      .offset = (uint16_t)term_f,
+      .chars_n = (uint16_t)(term_l - term_f),
+    };
+    term_f = term_l;
+  }
+  if (search->terms_n == 0)
+    return;
+
+  // every trigram of the terms must appear in the name: start from the shortest
+  // postings and intersect them with the others. The terms are checked on what remains.
+  LibrarySearchPostings postings[LIBRARY_SEARCH_QUERY_MAX];
+  size_t postings_n = 0;
+  for (size_t term_i = 0; term_i < search->terms_n; term_i++)
+  {
+    LibrarySearchTerm term = search->terms[term_i];
+    for (size_t char_i = 0; char_i + 3 <= term.chars_n; char_i++)
+    {
+      uint32_t trigram = library__trigram(&folded_query[term.offset + char_i]);
+      LibrarySearchPostings* d = &postings[postings_n++];
+      if (!library_search__postings(&index->search, trigram, &d->f, &d->l))
+        return; // no match
+    }
+  }
+  search->all_files_are_candidates = postings_n == 0;
+  if (search->all_files_are_candidates)
+  {
+    search->candidates_n = buf_len(index->files_buf);
+    return;
+  }
+  qsort(postings, postings_n, sizeof postings[0], library_search__compare_postings_n);
+  if (postings_n == 1)
+  {
+    search->candidates = postings[0].f;
+    search->candidates_n = postings[0].l - postings[0].f;
+    return;
+  }
+  buf_fit(search->candidates_buf, postings[0].l - postings[0].f);
+  for (uint32_t const* posting = postings[0].f; posting < postings[0].l; posting++)
+    buf_push(search->candidates_buf, *posting);
+  for (size_t postings_i = 1; postings_i < postings_n; postings_i++)
+  {
+    library_search__intersect(
+      &search->candidates_buf, postings[postings_i].f, postings[postings_i].l);
+  }
+  search->candidates = search->candidates_buf;
+  search->candidates_n = buf_len(search->candidates_buf);
+}
+
+bool library_search_continue(LibrarySearch* search, size_t candidates_max)
+{
+  LibraryIndex const* index = search->index;
+  size_t remaining_n = search->candidates_n - search->candidate_i;
+  size_t candidate_l =
+    search->candidate_i + (candidates_max < remaining_n ? candidates_max : remaining_n);
+  for (size_t candidate_i = search->candidate_i; candidate_i < candidate_l; candidate_i++)
+  {
+    uint32_t file_i = search->all_files_are_candidates
+                        ? (uint32_t)candidate_i
+                        : search->candidates[candidate_i];
+    uint32_t name_offset = index->files_buf[file_i].name_offset;
+    int32_t score = library_search__score(search,
+                                          &index->search.folded_names_buf[name_offset],
+                                          &index->names_buf[name_offset]);
+    if (score < 0)
+      continue;
+    search->matches_n++;
+    library_search__heap_push(search, (LibrarySearchResult){file_i, score});
+  }
+  search->candidate_i = candidate_l;
+  return search->candidate_i == search->candidates_n;
+}
+
+static int library_search__compare_results(void const* a_ptr, void const* b_ptr)
+{
+  LibrarySearchResult const* a = a_ptr;
+  LibrarySearchResult const* b = b_ptr;
+  return library_search__result_is_better(*a, *b)   ? -1
+         : library_search__result_is_better(*b, *a) ? 1
+                                                    : 0;
+}
+
+size_t library_search_results(LibrarySearch const* search,
+                              LibrarySearchResult* d_results,
+                              size_t results_max)
+{
+  size_t results_n = min_i(search->results_n, results_max);
+  if (results_n == search->results_n)
+  {
+    memcpy(d_results, search->results, results_n * sizeof d_results[0]);
+    qsort(d_results, results_n, sizeof d_results[0], library_search__compare_results);
+    return results_n;
+  }
+  LibrarySearchResult* sorted = malloc(search->results_n * sizeof sorted[0]);
+  memcpy(sorted, search->results, search->results_n * sizeof sorted[0]);
+  qsort(sorted, search->results_n, sizeof sorted[0], library_search__compare_results);
+  memcpy(d_results, sorted, results_n * sizeof sorted[0]);
+  free(sorted);
+  return results_n;
+}
+
+void library_search_free(LibrarySearch* search)
+{
+  buf_free(search->candidates_buf);
+  free(search->results), search->results = NULL;
+}
+
+size_t library_search(LibraryIndex const* index,
+                      char const* query,
+                      LibrarySearchResult* d_results,
+                      size_t results_max)
+{
+  LibrarySearch search;
+  library_search_start(&search, index, query, results_max);
+  library_search_continue(&search, SIZE_MAX);
+  library_search_results(&search, d_results, results_max);
+  size_t matches_n = search.matches_n;
+  library_search_free(&search);
+  return matches_n;
+}
+
+// Audio file headers
+
+static LibraryFileFormat library__format_from_name(char const* name)
+{
+  static struct
+  {
+    char const* extension;
+    LibraryFileFormat format;
+  } const formats[] = {
+    {"wav", LibraryFileFormat_Wav},   {"wave", LibraryFileFormat_Wav},
+    {"aif", LibraryFileFormat_Aiff},  {"aiff", LibraryFileFormat_Aiff},
+    {"aifc", LibraryFileFormat_Aiff}, {"flac", LibraryFileFormat_Flac},
+    {"mp3", LibraryFileFormat_Mp3},   {"ogg", LibraryFileFormat_Ogg},
+  };
+  char const* extension = strrchr(name, '.');
+  if (!extension)
+    return LibraryFileFormat_Unknown;
+  extension++;
+  for (size_t format_i = 0; format_i < sizeof formats / sizeof formats[0]; format_i++)
+  {
+    char const* a = extension;
+    char const* b = formats[format_i].extension;
+    while (*a && *b && (*a | 0x20) == *b)
+      a++, b++;
+    if (*a == '\0' && *b == '\0')
+      return formats[format_i].format;
+  }
+  return LibraryFileFormat_Unknown;
+}
+
+static bool library__skip(IOBuffer* in, uint64_t n)
+{
+  while (n && in->error == IOBufferError_None)
+  {
+    if (in->bytes_i == in->bytes_l)
+      iobuffer_refill(in);
+    uint64_t available_n = in->bytes_l - in->bytes_i;
+    uint64_t skipped_n = n < available_n ? n : available_n;
+    in->bytes_i += skipped_n;
+    n -= skipped_n;
+  }
+  return n == 0;
+}
+
+static bool library__read_id(IOBuffer* in, char const* expected_id)
+{
+  uint8_t id[4];
+  return read_uint8_n(in, id, sizeof id) && 0 == memcmp(id, expected_id, sizeof id);
+}
+
+static bool library__read_uint16_be(IOBuffer* in, uint16_t* dest)
+{
+  uint8_t bytes[2];
+  if (!read_uint8_n(in, bytes, sizeof bytes))
+    return false;
+  *dest = (uint16_t)(bytes[0] << 8 | bytes[1]);
+  return true;
+}
+
+static bool library__read_uint32_be(IOBuffer* in, uint32_t* dest)
+{
+  uint8_t bytes[4];
+  if (!read_uint8_n(in, bytes, sizeof bytes))
+    return false;
+  *dest = (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8
+          | bytes[3];
+  return true;
+}
+
+static void library__set_duration(LibraryFile* file, uint64_t frame_n, double sample_rate)
+{
+  if (sample_rate < 1.0)
+    return;
+  double duration_ms = 1000.0 * frame_n / sample_rate;
+  file->duration_ms = duration_ms < UINT32_MAX ? (uint32_t)duration_ms : UINT32_MAX;
+}
+
+static void library__probe_wav(IOBuffer* in, LibraryFile* file)
+{
+  uint32_t riff_size;
+  if (!library__read_id(in, "RIFF") || !read_uint32(in, &riff_size)
+      || !library__read_id(in, "WAVE"))
+    return;
+  uint32_t sample_rate = 0;
+  uint16_t block_align = 0;
+  for (uint64_t probed_n = 12; probed_n < LIBRARY_PROBE_BYTES_MAX;)
+  {
+    uint8_t id[4];
+    uint32_t size;
+    if (!read_uint8_n(in, id, sizeof id) || !read_uint32(in, &size))
+      return;
+    probed_n += 8;
+    if (0 == memcmp(id, "fmt ", 4))
+    {
+      uint16_t format_tag, chan_n;
+      uint32_t byte_rate;
+      if (size < 14 || !read_uint16(in, &format_tag) || !read_uint16(in, &chan_n)
+          || !read_uint32(in, &sample_rate) || !read_uint32(in, &byte_rate)
+          || !read_uint16(in, &block_align))
+        return;
+      file->chan_n = chan_n < UINT8_MAX ? (uint8_t)chan_n : UINT8_MAX;
+      size -= 14;
+    }
+    else if (0 == memcmp(id, "data", 4))
+    {
+      if (block_align)
+        library__set_duration(file, size / block_align, sample_rate);
+      return;
+    }
+    uint64_t padded_size = size + (size & 1);
+    if (!library__skip(in, padded_size))
+      return;
+    probed_n += padded_size;
+  }
+}
+
+static void library__probe_aiff(IOBuffer* in, LibraryFile* file)
+{
+  uint32_t form_size;
+  if (!library__read_id(in, "FORM") || !library__read_uint32_be(in, &form_size))
+    return;
+  uint8_t form_type[4];
+  if (!read_uint8_n(in, form_type, sizeof form_type)
+      || (0 != memcmp(form_type, "AIFF", 4) && 0 != memcmp(form_type, "AIFC", 4)))
+    return;
+  for (uint64_t probed_n = 12; probed_n < LIBRARY_PROBE_BYTES_MAX;)
+  {
+    uint8_t id[4];
+    uint32_t size;
+    if (!read_uint8_n(in, id, sizeof id) || !library__read_uint32_be(in, &size))
+      return;
+    probed_n += 8;
+    if (0 == memcmp(id, "COMM", 4))
+    {
+      uint16_t chan_n, sample_size, exponent;
+      uint32_t frame_n, mantissa_hi, mantissa_lo;
+      if (!library__read_uint16_be(in, &chan_n) || !library__read_uint32_be(in, &frame_n)
+          || !library__read_uint16_be(in, &sample_size)
+          || !library__read_uint16_be(in, &exponent)
+          || !library__read_uint32_be(in, &mantissa_hi)
+          || !library__read_uint32_be(in, &mantissa_lo))
+        return;
+      // 80-bit IEEE 754 extended precision
+      double mantissa = (double)mantissa_hi * 4294967296.0 + mantissa_lo;
+      double sample_rate = ldexp(mantissa, (int)(exponent & 0x7fff) - 16383 - 63);
+      file->chan_n = chan_n < UINT8_MAX ? (uint8_t)chan_n : UINT8_MAX;
+      library__set_duration(file, frame_n, sample_rate);
+      return;
+    }
+    uint64_t padded_size = size + (size & 1);
+    if (!library__skip(in, padded_size))
+      return;
+    probed_n += padded_size;
+  }
+}
+
+static void library__probe_flac(IOBuffer* in, LibraryFile* file)
+{
+  // STREAMINFO is always the first metadata block
+  uint8_t block_header[4];
+  uint8_t info[18];
+  if (!library__read_id(in, "fLaC")
+      || !read_uint8_n(in, block_header, sizeof block_header)
+      || (block_header[0] & 0x7f) != 0 || !read_uint8_n(in, info, sizeof info))
+    return;
+  uint8_t const* bits = &info[10];
+  uint32_t sample_rate = (uint32_t)bits[0] << 12 | (uint32_t)bits[1] << 4 | bits[2] >> 4;
+  uint32_t chan_n = ((bits[2] >> 1) & 0x7) + 1;
+  uint64_t frame_n = (uint64_t)(bits[3] & 0x0f) << 32 | (uint64_t)bits[4] << 24
+                     | (uint64_t)bits[5] << 16 | (uint64_t)bits[6] << 8 | bits[7];
+  file->chan_n = (uint8_t)chan_n;
+  library__set_duration(file, frame_n, sample_rate);
+}
+
+// fills the format, channel count and duration of a file, when its header tells.
+static void library__probe_file(char const* path, LibraryFile* file)
+{
+  file->format = library__format_from_name(path);
+  if (file->format != LibraryFileFormat_Wav && file->format != LibraryFileFormat_Aiff
+      && file->format != LibraryFileFormat_Flac)
+    return;
+
+  IOBuffer in = iobuffer_file_reader(path);
+  switch (file->format)
+  {
+  case LibraryFileFormat_Wav: library__probe_wav(&in, file); break;
+  case LibraryFileFormat_Aiff: library__probe_aiff(&in, file); break;
+  case LibraryFileFormat_Flac: library__probe_flac(&in, file); break;
+  default: break;
+  }
+  iobuffer_file_reader_close(&in);
+}
+
+// File system
+
+typedef struct LibraryListedEntry
+{
+  uint32_t name_offset; // in the names of the listing
+  bool is_dir;
+  uint64_t size;
+  uint64_t mtime;
+} LibraryListedEntry;
+
+#if defined(_WIN32)
+static uint64_t library__win32_mtime(FILETIME filetime)
+{
+  return (uint64_t)filetime.dwHighDateTime << 32 | filetime.dwLowDateTime;
+}
+
+static bool library__stat_directory(char const* path, uint64_t* d_mtime)
+{
+  WIN32_FILE_ATTRIBUTE_DATA attributes;
+  if (!GetFileAttributesExA(path, GetFileExInfoStandard, &attributes)
+      || !(attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+    return false;
+  *d_mtime = library__win32_mtime(attributes.ftLastWriteTime);
+  return true;
+}
+
+static bool library__list_directory(char const* path,
+                                    LibraryListedEntry** d_entries_buf,
+                                    char** d_names_buf)
+{
+  char* query = NULL;
+  buf_printf(query, "%s\\*", path);
+  WIN32_FIND_DATAA find_data;
+  HANDLE search_handle = FindFirstFileA(query, &find_data);
+  buf_free(query);
+  if (!search_handle || INVALID_HANDLE_VALUE == search_handle)
+    return false;
+  LibraryListedEntry* entries_buf = *d_entries_buf;
+  do
+  {
+    DWORD attrs = find_data.dwFileAttributes;
+    if (attrs
+        & (FILE_ATTRIBUTE_DEVICE | FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_INTEGRITY_STREAM
+           | FILE_ATTRIBUTE_OFFLINE | FILE_ATTRIBUTE_SYSTEM | FILE_ATTRIBUTE_TEMPORARY))
+      continue;
+    if (0 == strcmp(find_data.cFileName, ".") || 0 == strcmp(find_data.cFileName, ".."))
+      continue;
+    LibraryListedEntry entry = {
+      .name_offset = library__names_push(d_names_buf, find_data.cFileName),
+      .is_dir = attrs & FILE_ATTRIBUTE_DIRECTORY,
+      .size = (uint64_t)find_data.nFileSizeHigh << 32 | find_data.nFileSizeLow,
+      .mtime = library__win32_mtime(find_data.ftLastWriteTime),
+    };
+    buf_push(entries_buf, entry);
+  } while (FindNextFileA(search_handle, &find_data));
+  *d_entries_buf = entries_buf;
+  FindClose(search_handle);
+  return true;
+}
+
+static void library__temp_path(char** d_path_buf, char const* name)
+{
+  char temp_dir[MAX_PATH + 1];
+  DWORD temp_dir_n = GetTempPathA(sizeof temp_dir, temp_dir);
+  if (temp_dir_n == 0 || temp_dir_n > sizeof temp_dir)
+    strcpy(temp_dir, ".\\");
+  buf_printf(*d_path_buf, "%s%s", temp_dir, name); // temp_dir ends with a separator
+}
+
+static bool library__make_directory(char const* path)
+{
+  return CreateDirectoryA(path, NULL);
+}
+
+static bool library__remove_directory(char const* path)
+{
+  return RemoveDirectoryA(path);
+}
+
+static bool library__set_mtime(char const* path, uint64_t mtime)
+{
+  // directories only open with backup semantics
+  HANDLE handle =
+    CreateFileA(path, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+  if (INVALID_HANDLE_VALUE == handle)
+    return false;
+  FILETIME filetime = {
+    .dwLowDateTime = (DWORD)mtime,
+    .dwHighDateTime = (DWORD)(mtime >> 32),
+  };
+  bool ok = SetFileTime(handle, NULL, NULL, &filetime);
+  CloseHandle(handle);
+  return ok;
+}
+#else
+static bool library__stat_directory(char const* path, uint64_t* d_mtime)
+{
+  struct stat result;
+  if (0 != stat(path, &result) || !S_ISDIR(result.st_mode))
+    return false;
+  *d_mtime = (uint64_t)result.st_mtime;
+  return true;
+}
+
+static bool library__list_directory(char const* path,
+                                    LibraryListedEntry** d_entries_buf,
+                                    char** d_names_buf)
+{
+  DIR* dir = opendir(path);
+  if (!dir)
+    return false;
+  LibraryListedEntry* entries_buf = *d_entries_buf;
+  char* entry_path = NULL;
+  for (struct dirent* dirent; (dirent = readdir(dir));)
+  {
+    if (dirent->d_name[0] == '.')
+      continue; // hidden, or one of "." and ".."
+    buf_reset(entry_path);
+    buf_printf(entry_path, "%s/%s", path, dirent->d_name);
+    struct stat result;
+    if (0 != stat(entry_path, &result))
+      continue;
+    if (!S_ISDIR(result.st_mode) && !S_ISREG(result.st_mode))
+      continue;
+    LibraryListedEntry entry = {
+      .name_offset = library__names_push(d_names_buf, dirent->d_name),
+      .is_dir = S_ISDIR(result.st_mode),
+      .size = (uint64_t)result.st_size,
+      .mtime = (uint64_t)result.st_mtime,
+    };
+    buf_push(entries_buf, entry);
+  }
+  *d_entries_buf = entries_buf;
+  buf_free(entry_path);
+  closedir(dir);
+  return true;
+}
+
+static void library__temp_path(char** d_path_buf, char const* name)
+{
+  char const* temp_dir = getenv("TMPDIR");
+  buf_printf(*d_path_buf, "%s/%s", temp_dir && *temp_dir ? temp_dir : "/tmp", name);
+}
+
+static bool library__make_directory(char const* path)
+{
+  return 0 == mkdir(path, 0777);
+}
+
+static bool library__remove_directory(char const* path)
+{
+  return 0 == rmdir(path);
+}
+
+static bool library__set_mtime(char const* path, uint64_t mtime)
+{
+  struct utimbuf times = {.actime = (time_t)mtime, .modtime = (time_t)mtime};
+  return 0 == utime(path, &times);
+}
+#endif
+
+// Indexing
+//
+// Every directory is scanned by its own task, which starts the tasks of its
+// sub-directories. The scan of the whole tree is then flattened into an index by a last
+// task, started when no directory remains.
+
+typedef struct LibraryScanNode
+{
+  struct LibraryScan* scan;
+  char* path_buf;
+  char* name;
+  uint64_t mtime;              // 0 when not known yet
+  uint32_t previous_dir_index; // in the previous index, or LIBRARY_INDEX_NONE
+  char* names_buf;
+  LibraryFile* files_buf; // name_offset in names_buf
+  struct LibraryScanNode** children_buf;
+} LibraryScanNode;
+
+typedef struct LibraryScan
+{
+  Library* library;
+  LibraryIndex* previous; // may be null, read-only
+  LibraryScanNode* root;
+  uint32_t pending_nodes_n; // @atomic
+  TaskHandle finish_task;
+} LibraryScan;
+
+static void library_scan__node_task(void* data_);
+
+// The blocking calls of the scan go through task_io_call, so that the workers scan other
+// directories while the disk answers.
+
+typedef struct LibraryScanListing
+{
+  char const* path;
+  LibraryListedEntry* entries_buf;
+  char* names_buf;
+  bool is_listed;
+} LibraryScanListing;
+
+static void library_scan__list_directory(void* data_)
+{
+  LibraryScanListing* listing = data_;
+  listing->is_listed =
+    library__list_directory(listing->path, &listing->entries_buf, &listing->names_buf);
+}
+
+typedef struct LibraryScanProbe
+{
+  char const* path;
+  LibraryFile* file;
+} LibraryScanProbe;
+
+static void library_scan__probe_file(void* data_)
+{
+  LibraryScanProbe* probe = data_;
+  library__probe_file(probe->path, probe->file);
+}
+
+static void library_scan__start_node(LibraryScanNode* parent,
+                                     char const* name,
+                                     uint64_t mtime,
+                                     uint32_t previous_dir_index)
+{
+  LibraryScan* scan = parent->scan;
+  LibraryScanNode* node = calloc(1, sizeof *node);
+  node->scan = scan;
+  buf_printf(node->path_buf, "%s/%s", parent->path_buf, name);
+  node->name = _strdup(name);
+  node->mtime = mtime;
+  node->previous_dir_index = previous_dir_index;
+  buf_push(parent->children_buf, node);
+
+  atomic_fetch_add_uint32(&scan->pending_nodes_n, 1);
+  task_start(task_create(library_scan__node_task, node));
+}
+
+static void library_scan__node_reuse(LibraryScanNode* node,
+                                     LibraryDirectory const* previous_dir)
+{
+  LibraryIndex const* previous = node->scan->previous;
+  for (uint32_t dir_i = previous_dir->first_dir_index,
+                dir_l = dir_i + previous_dir->dir_n;
+       dir_i < dir_l; dir_i++)
+  {
+    char const* name = &previous->names_buf[previous->dirs_buf[dir_i].name_offset];
+    library_scan__start_node(node, name, 0, dir_i);
+  }
+  for (uint32_t file_i = previous_dir->first_file_index,
+                file_l = file_i + previous_dir->file_n;
+       file_i < file_l; file_i++)
+  {
+    LibraryFile file = previous->files_buf[file_i];
+    file.name_offset =
+      library__names_push(&node->names_buf, &previous->names_buf[file.name_offset]);
+    buf_push(node->files_buf, file);
+  }
+}
+
+static void library_scan__node(LibraryScanNode* node)
+{
+  LibraryIndex const* previous = node->scan->previous;
+  LibraryDirectory const* previous_dir = NULL;
+  if (previous && node->previous_dir_index != LIBRARY_INDEX_NONE)
+    previous_dir = &previous->dirs_buf[node->previous_dir_index];
+
+  if (node->mtime == 0 && !library__stat_directory(node->path_buf, &node->mtime))
+    return; // the directory is gone
+
+  if (previous_dir && previous_dir->mtime == node->mtime)
+  {
+    library_scan__node_reuse(node, previous_dir);
+    return;
+  }
+
+  LibraryScanListing listing = {.path = node->path_buf};
+  task_io_call(library_scan__list_directory, &listing);
+  if (!listing.is_listed)
+    return;
+  LibraryListedEntry* entries_buf = listing.entries_buf;
+  char* entry_names_buf = listing.names_buf;
+
+  // directories are matched to their previous scan, and files that did not change keep
+  // their metadata
+  StrMap previous_dir_index_by_name = {0};  // to 1 + index in previous->dirs_buf
+  StrMap previous_file_index_by_name = {0}; // to 1 + index in previous->files_buf
+  if (previous_dir)
+  {
+    for (uint32_t dir_i = previous_dir->first_dir_index,
+                  dir_l = dir_i + previous_dir->dir_n;
+         dir_i < dir_l; dir_i++)
+    {
+      char const* name = &previous->names_buf[previous->dirs_buf[dir_i].name_offset];
+      str_map_put(&previous_dir_index_by_name, name, strlen(name),
+                  (void*)(intptr_t)(1 + dir_i));
+    }
+    for (uint32_t file_i = previous_dir->first_file_index,
+                  file_l = file_i + previous_dir->file_n;
+         file_i < file_l; file_i++)
+    {
+      char const* name = &previous->names_buf[previous->files_buf[file_i].name_offset];
+      str_map_put(&previous_file_index_by_name, name, strlen(name),
+                  (void*)(intptr_t)(1 + file_i));
+    }
+  }
+
+  char* file_path = NULL;
+  for (LibraryListedEntry* entry = &entries_buf[0]; entry < buf_end(entries_buf); entry++)
+  {
+    char const* name = &entry_names_buf[entry->name_offset];
+    if (entry->is_dir)
+    {
+      intptr_t previous_dir_index_plus_one =
+        (intptr_t)str_map_get(&previous_dir_index_by_name, name, strlen(name));
+      uint32_t previous_child_index = previous_dir_index_plus_one
+                                        ? (uint32_t)(previous_dir_index_plus_one - 1)
+                                        : LIBRARY_INDEX_NONE;
+      library_scan__start_node(node, name, entry->mtime, previous_child_index);
+      continue;
+    }
+
+    LibraryFile file = {
+      .size = entry->size,
+      .mtime = entry->mtime,
+    };
+    intptr_t previous_file_index_plus_one =
+      (intptr_t)str_map_get(&previous_file_index_by_name, name, strlen(name));
+    LibraryFile const* previous_file = NULL;
+    if (previous_file_index_plus_one)
+      previous_file = &previous->files_buf[previous_file_index_plus_one - 1];
+    if (previous_file && previous_file->size == file.size
+        && previous_file->mtime == file.mtime)
+    {
+      file = *previous_file;
+    }
+    else
+    {
+      buf_reset(file_path);
+      buf_printf(file_path, "%s/%s", node->path_buf, name);
+      LibraryScanProbe probe = {file_path, &file};
+      task_io_call(library_scan__probe_file, &probe);
+    }
+    file.name_offset = library__names_push(&node->names_buf, name);
+    buf_push(node->files_buf, file);
+  }
+  buf_free(file_path);
+  str_map_free(&previous_dir_index_by_name);
+  str_map_free(&previous_file_index_by_name);
+  buf_free(entries_buf);
+  buf_free(entry_names_buf);
+}
+
+static void library_scan__node_task(void* data_)
+{
+  LibraryScanNode* node = data_;
+  LibraryScan* scan = node->scan;
+  if (!atomic_load_uint32(&scan->library->cancelled))
+    library_scan__node(node);
+  if (atomic_fetch_add_uint32(&scan->pending_nodes_n, (uint32_t)-1) == 1)
+    task_start(scan->finish_task);
+}
+
+static LibraryIndex* library_scan__flatten(LibraryScan* scan)
+{
+  LibraryIndex* index = calloc(1, sizeof *index);
+  index->root_abspath = _strdup(scan->root->path_buf);
+  LibraryDirectory root_dir = {
+    .parent_index = LIBRARY_INDEX_NONE,
+    .name_offset = library__names_push(&index->names_buf, ""),
+    .mtime = scan->root->mtime,
+  };
+  buf_push(index->dirs_buf, root_dir);
+
+  // breadth-first, so that siblings are contiguous
+  LibraryScanNode** nodes_buf = NULL;
+  buf_push(nodes_buf, scan->root);
+  for (uint32_t node_i = 0; node_i < buf_len(nodes_buf); node_i++)
+  {
+    LibraryScanNode* node = nodes_buf[node_i];
+    index->dirs_buf[node_i].first_file_index = (uint32_t)buf_len(index->files_buf);
+    index->dirs_buf[node_i].file_n = (uint32_t)buf_len(node->files_buf);
+    for (LibraryFile* file_i = &node->files_buf[0]; file_i < buf_end(node->files_buf);
+         file_i++)
+    {
+      LibraryFile file = *file_i;
+      file.dir_index = node_i;
+      file.name_offset =
+        library__names_push(&index->names_buf, &node->names_buf[file_i->name_offset]);
+      buf_push(index->files_buf, file);
+    }
+
+    index->dirs_buf[node_i].first_dir_index = (uint32_t)buf_len(nodes_buf);
+    index->dirs_buf[node_i].dir_n = (uint32_t)buf_len(node->children_buf);
+    for (LibraryScanNode** child_i = &node->children_buf[0];
+         child_i < buf_end(node->children_buf); child_i++)
+    {
+      LibraryDirectory dir = {
+        .parent_index = node_i,
+        .name_offset = library__names_push(&index->names_buf, (*child_i)->name),
+        .mtime = (*child_i)->mtime,
+      };
+      buf_push(index->dirs_buf, dir);
+      buf_push(nodes_buf, *child_i);
+    }
+  }
+
+  for (LibraryScanNode** node_i = &nodes_buf[0]; node_i < buf_end(nodes_buf); node_i++)
+  {
+    LibraryScanNode* node = *node_i;
+    buf_free(node->path_buf);
+    free(node->name);
+    buf_free(node->names_buf);
+    buf_free(node->files_buf);
+    buf_free(node->children_buf);
+    free(node);
+  }
+  buf_free(nodes_buf);
+  scan->root = NULL;
+  return index;
+}
+
+static bool library__write_index_file(LibraryIndex const* index, char const* path)
+{
+  // write then replace, to never leave a truncated index behind
+  char* temp_path = NULL;
+  buf_printf(temp_path, "%s.tmp", path);
+  IOBuffer out = iobuffer_file_writer(temp_path);
+  bool ok = out.error == IOBufferError_None && library_index_write(index, &out);
+  iobuffer_file_writer_close(&out);
+  ok = ok && out.error != IOBufferError_IO;
+#if defined(_WIN32)
+  ok = ok && MoveFileExA(temp_path, path, MOVEFILE_REPLACE_EXISTING);
+#else
+  ok = ok && 0 == rename(temp_path, path);
+#endif
+  if (!ok)
+    remove(temp_path);
+  buf_free(temp_path);
+  return ok;
+}
+
+static void library__publish(Library* library, LibraryIndex* index)
+{
+  library_search_index_build(&index->search, index);
+  LibraryIndex* unseen_index =
+    atomic_exchange_ptr((void**)&library->pending_index, index);
+  if (unseen_index)
+  {
+    library_index_free(unseen_index);
+    free(unseen_index);
+  }
+}
+
+static void library_scan__finish_task(void* data_)
+{
+  LibraryScan* scan = data_;
+  Library* library = scan->library;
+  LibraryIndex* index = library_scan__flatten(scan);
+  if (atomic_load_uint32(&library->cancelled))
+  {
+    library_index_free(index);
+    free(index);
+  }
+  else
+  {
+    library__write_index_file(index, library->index_path);
+    // the previous index is not used past this point, the UI may now release it
+    library__publish(library, index);
+  }
+  free(scan);
+  atomic_store_uint32(&library->state, Library_Done);
+}
+
+static void library__start_task(void* data_)
+{
+  LibraryScan* scan = data_;
+  Library* library = scan->library;
+
+  IOBuffer in = iobuffer_file_reader(library->index_path);
+  LibraryIndex* previous = calloc(1, sizeof *previous);
+  if (library_index_read(previous, &in)
+      && 0 == strcmp(previous->root_abspath, library->root_abspath))
+  {
+    scan->previous = previous;
+    library__publish(library, previous);
+  }
+  else
+  {
+    library_index_free(previous);
+    free(previous);
+  }
+  iobuffer_file_reader_close(&in);
+
+  atomic_store_uint32(&library->state, Library_Scanning);
+  LibraryScanNode* root = calloc(1, sizeof *root);
+  root->scan = scan;
+  buf_printf(root->path_buf, "%s", library->root_abspath);
+  root->name = _strdup("");
+  root->previous_dir_index = scan->previous ? 0 : LIBRARY_INDEX_NONE;
+  scan->root = root;
+  scan->pending_nodes_n = 1;
+  library_scan__node_task(root);
+}
+
+void library_start(Library* library, char const* root_abspath, char const* index_path)
+{
+  assert(atomic_load_uint32(&library->state) == Library_Idle);
+  library->root_abspath = _strdup(root_abspath);
+  library->index_path = _strdup(index_path);
+  atomic_store_uint32(&library->state, Library_Loading);
+
+  LibraryScan* scan = calloc(1, sizeof *scan);
+  scan->library = library;
+  // the tasks created by the scan inherit the background priority
+  scan->finish_task =
+    task_create_with_priority(library_scan__finish_task, scan, TaskPriority_Background);
+  library->finish_task = scan->finish_task;
+  task_start(
+    task_create_with_priority(library__start_task, scan, TaskPriority_Background));
+}
+
+bool library_update(Library* library)
+{
+  LibraryIndex* index = atomic_exchange_ptr((void**)&library->pending_index, NULL);
+  if (!index)
+    return false;
+  if (library->index)
+  {
+    // the indexer publishes a new index only when it is done with the previous one
+    library_index_free(library->index);
+    free(library->index);
+  }
+  library->index = index;
+  return true;
+}
+
+void library_deinit(Library* library)
+{
+  atomic_store_uint32(&library->cancelled, 1);
+  // cancelled directories are skipped, and meanwhile we help with what's left
+  if (library->finish_task.id)
+    task_wait(library->finish_task), library->finish_task = (TaskHandle){0};
+  library_update(library);
+  if (library->index)
+  {
+    library_index_free(library->index);
+    free(library->index), library->index = NULL;
+  }
+  free(library->root_abspath), library->root_abspath = NULL;
+  free(library->index_path), library->index_path = NULL;
+}
+
+// header of a 16-bit wav with 44100 frames
+static void test_library__write_wav(char const* path, uint8_t chan_n, uint64_t mtime)
+{
+  uint8_t wav[] = {
+    'R', 'I', 'F', 'F', 0, 0, 0, 0,    'W', 'A',  'V', 'E', 'f', 'm', 't',
+    ' ', 16,  0,   0,   0, 1, 0, 2,    0,   0x44, 0xac, 0,  0,   0,   0,
+    0,   0,   4,   0,   16, 0, 'd', 'a', 't', 'a', 0x10, 0xb1, 0x02, 0,
+  };
+  wav[22] = chan_n;
+  IOBuffer out = iobuffer_file_writer(path);
+  assert(write_uint8_n(&out, wav, sizeof wav));
+  iobuffer_file_writer_close(&out);
+  assert(library__set_mtime(path, mtime));
+}
+
+static LibraryFile const* test_library__find_file(LibraryIndex const* index,
+                                                  char const* dir_path,
+                                                  char const* name)
+{
+  uint32_t dir_index = library_index_find_directory(index, dir_path);
+  if (dir_index == LIBRARY_INDEX_NONE)
+    return NULL;
+  LibraryDirectory const* dir = &index->dirs_buf[dir_index];
+  for (uint32_t file_i = dir->first_file_index, file_l = file_i + dir->file_n;
+       file_i < file_l; file_i++)
+  {
+    if (0 == strcmp(name, &index->names_buf[index->files_buf[file_i].name_offset]))
+      return &index->files_buf[file_i];
+  }
+  return NULL;
+}
+
+// scans to completion, and returns the index it published
+static LibraryIndex* test_library__scan(char const* root_path, char const* index_path)
+{
+  Library library = {0};
+  library_start(&library, root_path, index_path);
+  task_wait(library.finish_task);
+  library_update(&library);
+  LibraryIndex* index = library.index;
+  library.index = NULL;
+  library_deinit(&library);
+  return index;
+}
+
+int test_library(int argc, char const** argv)
+{
+  (void)argc, (void)argv;
+
+  // root/
+  //   a/
+  //     c/
+  //       y.flac
+  //   b/
+  //   x.wav
+  LibraryIndex index = {
+    .root_abspath = _strdup("/library"),
+  };
+  uint32_t root_name = library__names_push(&index.names_buf, "");
+  uint32_t a_name = library__names_push(&index.names_buf, "a");
+  uint32_t b_name = library__names_push(&index.names_buf, "b");
+  uint32_t c_name = library__names_push(&index.names_buf, "c");
+  uint32_t x_name = library__names_push(&index.names_buf, "x.wav");
+  uint32_t y_name = library__names_push(&index.names_buf, "y.flac");
+  LibraryDirectory dirs[] = {
+    {LIBRARY_INDEX_NONE, root_name, 1, 2, 0, 1, 1},
+    {0, a_name, 3, 1, 1, 0, 2},
+    {0, b_name, 4, 0, 1, 0, 3},
+    {1, c_name, 4, 0, 1, 1, 4},
+  };
+  for (size_t dir_i = 0; dir_i < sizeof dirs / sizeof dirs[0]; dir_i++)
+    buf_push(index.dirs_buf, dirs[dir_i]);
+  LibraryFile files[] = {
+    {0, x_name, 1000, 5, 250, LibraryFileFormat_Wav, 2},
+    {3, y_name, 2000, 6, 500, LibraryFileFormat_Flac, 1},
+  };
+  for (size_t file_i = 0; file_i < sizeof files / sizeof files[0]; file_i++)
+    buf_push(index.files_buf, files[file_i]);
+  assert(library_index__is_valid(&index));
+
+  assert(library_index_find_directory(&index, "/library") == 0);
+  assert(library_index_find_directory(&index, "/library/") == 0);
+  assert(library_index_find_directory(&index, "/library/a") == 1);
+  assert(library_index_find_directory(&index, "/library\\a\\c") == 3);
+  assert(library_index_find_directory(&index, "/library/b/") == 2);
+  assert(library_index_find_directory(&index, "/library/d") == LIBRARY_INDEX_NONE);
+  assert(library_index_find_directory(&index, "/library2/a") == LIBRARY_INDEX_NONE);
+
+  char* path = NULL;
+  library_index_file_path(&index, 1, &path);
+  assert(0 == strcmp(path, "/library/a/c/y.flac"));
+  buf_free(path);
+
+  assert(library__format_from_name("x.WAV") == LibraryFileFormat_Wav);
+  assert(library__format_from_name("x.aif") == LibraryFileFormat_Aiff);
+  assert(library__format_from_name("x.wav.txt") == LibraryFileFormat_Unknown);
+  assert(library__format_from_name("wav") == LibraryFileFormat_Unknown);
+
+  // round-trip
+  size_t bytes_n = 4096;
+  uint8_t* bytes = calloc(1, bytes_n);
+  IOBuffer out = iobuffer_from_memory_size(bytes, bytes_n);
+  assert(library_index_write(&index, &out));
+  size_t written_n = out.bytes_i - out.bytes_f;
+  for (size_t n = 0; n < written_n; n += 7)
+  {
+    LibraryIndex truncated_index;
+    IOBuffer truncated_in = iobuffer_from_memory_size(bytes, n);
+    assert(!library_index_read(&truncated_index, &truncated_in));
+  }
+  LibraryIndex read_index;
+  IOBuffer in = iobuffer_from_memory_size(bytes, written_n);
+  assert(library_index_read(&read_index, &in));
+  assert(0 == strcmp(read_index.root_abspath, index.root_abspath));
+  assert(buf_len(read_index.names_buf) == buf_len(index.names_buf));
+  assert(0 == memcmp(read_index.names_buf, index.names_buf, buf_len(index.names_buf)));
+  assert(buf_len(read_index.dirs_buf) == buf_len(index.dirs_buf));
+  assert(0
+         == memcmp(read_index.dirs_buf, index.dirs_buf,
+                   buf_len(index.dirs_buf) * sizeof index.dirs_buf[0]));
+  assert(buf_len(read_index.files_buf) == buf_len(index.files_buf));
+  for (size_t file_i = 0; file_i < buf_len(index.files_buf); file_i++)
+  {
+    LibraryFile a = read_index.files_buf[file_i];
+    LibraryFile b = index.files_buf[file_i];
+    assert(a.dir_index == b.dir_index && a.name_offset == b.name_offset
+           && a.size == b.size && a.mtime == b.mtime && a.duration_ms == b.duration_ms
+           && a.format == b.format && a.chan_n == b.chan_n);
+  }
+  library_index_free(&read_index);
+
+  // a broken index is rejected
+  index.dirs_buf[3].parent_index = 3;
+  assert(!library_index__is_valid(&index));
+
+  free(bytes);
+  library_index_free(&index);
+
+  // search
+  LibraryIndex search_index = {
+    .root_abspath = _strdup("/search"),
+  };
+  char const* search_names[] = {
+    "Kick 808.wav",
+    "808 Snare.wav",
+    "HiHat.wav",
+    "hard_kick.aif",
+  };
+  size_t search_names_n = sizeof search_names / sizeof search_names[0];
+  LibraryDirectory search_root = {
+    .parent_index = LIBRARY_INDEX_NONE,
+    .name_offset = library__names_push(&search_index.names_buf, ""),
+    .first_dir_index = 1,
+    .file_n = (uint32_t)search_names_n,
+  };
+  buf_push(search_index.dirs_buf, search_root);
+  for (size_t name_i = 0; name_i < search_names_n; name_i++)
+  {
+    LibraryFile file = {
+      .name_offset = library__names_push(&search_index.names_buf, search_names[name_i]),
+    };
+    buf_push(search_index.files_buf, file);
+  }
+  library_search_index_build(&search_index.search, &search_index);
+  LibrarySearchResult results[4];
+  assert(library_search(&search_index, "kick", results, 4) == 2);
+  assert(results[0].file_index == 0 && results[1].file_index == 3);
+  assert(library_search(&search_index, "808", results, 4) == 2);
+  assert(results[0].file_index == 1); // at the start of the name
+  assert(library_search(&search_index, " 808  KICK ", results, 4) == 1);
+  assert(results[0].file_index == 0);
+  assert(library_search(&search_index, "ha", results, 1) == 2); // short, scanned
+  assert(results[0].file_index == 3);
+  assert(library_search(&search_index, "snore", results, 4) == 0);
+  assert(library_search(&search_index, "", results, 4) == 0);
+  library_index_free(&search_index);
+
+  // header of a 16-bit stereo wav with 44100 frames
+  uint8_t wav[] = {
+    'R', 'I', 'F', 'F', 0, 0, 0, 0,    'W', 'A',  'V', 'E', 'f', 'm', 't',
+    ' ', 16,  0,   0,   0, 1, 0, 2,    0,   0x44, 0xac, 0,  0,   0,   0,
+    0,   0,   4,   0,   16, 0, 'd', 'a', 't', 'a', 0x10, 0xb1, 0x02, 0,
+  };
+  LibraryFile wav_file = {0};
+  IOBuffer wav_in = iobuffer_from_memory_size(wav, sizeof wav);
+  library__probe_wav(&wav_in, &wav_file);
+  assert(wav_file.chan_n == 2 && wav_file.duration_ms == 1000);
+
+  // rescan of a tree on disk:
+  //   a/ changed, re-listed: v.wav changed, x.wav did not, z.wav is new
+  //   b/ did not change, kept as is: y.wav, w.wav is written behind its back
+  {
+    char* root = NULL;
+    char* index_path = NULL;
+    library__temp_path(&root, "md2_test_library");
+    library__temp_path(&index_path, "md2_test_library_index.bin");
+    char* a = NULL;
+    char* b = NULL;
+    buf_printf(a, "%s/a", root);
+    buf_printf(b, "%s/b", root);
+    char const* a_files[] = {"v.wav", "x.wav", "z.wav"};
+    char const* b_files[] = {"y.wav", "w.wav"};
+    char* paths[5] = {0};
+    for (int file_i = 0; file_i < 3; file_i++)
+      buf_printf(paths[file_i], "%s/%s", a, a_files[file_i]);
+    for (int file_i = 0; file_i < 2; file_i++)
+      buf_printf(paths[3 + file_i], "%s/%s", b, b_files[file_i]);
+    for (int path_i = 0; path_i < 5; path_i++)
+      remove(paths[path_i]); // left over by an interrupted run
+    library__remove_directory(a), library__remove_directory(b);
+    library__remove_directory(root), remove(index_path);
+
+    uint64_t const mtime = 1000000000;
+    assert(library__make_directory(root));
+    assert(library__make_directory(a) && library__make_directory(b));
+    test_library__write_wav(paths[0], 2, mtime);
+    test_library__write_wav(paths[1], 2, mtime);
+    test_library__write_wav(paths[3], 2, mtime);
+    assert(library__set_mtime(a, mtime) && library__set_mtime(b, mtime));
+    assert(library__set_mtime(root, mtime));
+
+    task_init();
+    LibraryIndex* index = test_library__scan(root, index_path);
+    assert(index && buf_len(index->dirs_buf) == 3 && buf_len(index->files_buf) == 3);
+    assert(test_library__find_file(index, a, "v.wav")->chan_n == 2);
+    assert(test_library__find_file(index, a, "x.wav")->chan_n == 2);
+    assert(test_library__find_file(index, b, "y.wav")->chan_n == 2);
+    library_index_free(index);
+    free(index);
+
+    test_library__write_wav(paths[0], 1, mtime + 1);
+    test_library__write_wav(paths[1], 1, mtime);
+    test_library__write_wav(paths[2], 1, mtime);
+    test_library__write_wav(paths[4], 1, mtime);
+    assert(library__set_mtime(a, mtime + 1) && library__set_mtime(b, mtime));
+
+    index = test_library__scan(root, index_path);
+    assert(index && buf_len(index->dirs_buf) == 3 && buf_len(index->files_buf) == 4);
+    assert(test_library__find_file(index, a, "v.wav")->chan_n == 1); // probed again
+    assert(test_library__find_file(index, a, "x.wav")->chan_n == 2); // kept
+    assert(test_library__find_file(index, a, "z.wav")->chan_n == 1);
+    assert(test_library__find_file(index, b, "y.wav")->chan_n == 2);
+    assert(!test_library__find_file(index, b, "w.wav")); // b was not listed
+    library_index_free(index);
+    free(index);
+    task_deinit();
+
+    for (int path_i = 0; path_i < 5; path_i++)
+      remove(paths[path_i]), buf_free(paths[path_i]);
+    library__remove_directory(a), library__remove_directory(b);
+    library__remove_directory(root), remove(index_path);
+    buf_free(a);
+    buf_free(b);
+    buf_free(root);
+    buf_free(index_path);
+  }
+
+  return 0;
+}
@@ -0,0 +1,184 @@
+#ifndef MD2_LIBRARY
+#define MD2_LIBRARY
+
+#include "libs/xxxx_tasks.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct IOBuffer;
+
+enum
+{
+  LIBRARY_INDEX_NONE = UINT32_MAX,
+};
+
+typedef enum LibraryFileFormat {
+  LibraryFileFormat_Unknown,
+  LibraryFileFormat_Wav,
+  LibraryFileFormat_Aiff,
+  LibraryFileFormat_Flac,
+  LibraryFileFormat_Mp3,
+  LibraryFileFormat_Ogg,
+  LibraryFileFormat_Count,
+} LibraryFileFormat;
+
+typedef struct LibraryFile
+{
+  uint32_t dir_index;
+  uint32_t name_offset; // in names_buf
+  uint64_t size;
+  uint64_t mtime;       // platform specific modification stamp, compared for equality
+  uint32_t duration_ms; // 0 when unknown
+  uint8_t format;       // LibraryFileFormat
+  uint8_t chan_n;       // 0 when unknown
+} LibraryFile;
+
+// Directories are stored breadth-first, so that the sub-directories and files of a
+// directory are contiguous. The root directory is at index 0 and has an empty name.
+typedef struct LibraryDirectory
+{
+  uint32_t parent_index; // LIBRARY_INDEX_NONE for the root
+  uint32_t name_offset;  // in names_buf
+  uint32_t first_dir_index;
+  uint32_t dir_n;
+  uint32_t first_file_index;
+  uint32_t file_n;
+  uint64_t mtime;
+} LibraryDirectory;
+
+// Trigram index over the file names, derived from the index and not persisted.
+typedef struct LibrarySearchIndex
+{
+  char* folded_names_buf;         // lower-case copy of names_buf, with the same offsets
+  uint32_t* trigrams_buf;         // sorted, three bytes of folded names
+  uint32_t* postings_offsets_buf; // of trigrams_buf[i] is [offsets[i]..offsets[i + 1])
+  uint32_t* postings_buf;         // file indices, ascending for every trigram
+} LibrarySearchIndex;
+
+// Immutable once published.
+typedef struct LibraryIndex
+{
+  char* root_abspath;
+  char* names_buf; // nul-terminated names
+  LibraryDirectory* dirs_buf;
+  LibraryFile* files_buf;
+  LibrarySearchIndex search;
+} LibraryIndex;
+
+void library_index_free(LibraryIndex* index);
+
+// returns the index of the directory at `abspath`, or LIBRARY_INDEX_NONE
+uint32_t library_index_find_directory(LibraryIndex const* index, char const* abspath);
+
+// appends the absolute path of a file to `*d_path_buf`
+void library_index_file_path(LibraryIndex const* index,
+                             uint32_t file_index,
+                             char** d_path_buf);
+
+bool library_index_write(LibraryIndex const* index, struct IOBuffer* out);
+bool library_index_read(LibraryIndex* d_index, struct IOBuffer* in);
+
+void library_search_index_build(LibrarySearchIndex* d_search, LibraryIndex const* index);
+void library_search_index_free(LibrarySearchIndex* search);
+
+typedef struct LibrarySearchResult
+{
+  uint32_t file_index;
+  int32_t score; // higher is better
+} LibrarySearchResult;
+
+enum
+{
+  LIBRARY_SEARCH_QUERY_MAX = 256,
+  LIBRARY_SEARCH_TERMS_MAX = 16,
+};
+
+typedef struct LibrarySearchTerm
+{
+  uint16_t offset; // in folded_query
+  uint16_t chars_n;
+} LibrarySearchTerm;
+
+// Finds the files whose name contains all the space separated terms of a query,
+// ignoring case, and keeps the best `results_max` of them.
+//
+// The search can be run a bit at a time, to stream results without blocking.
+typedef struct LibrarySearch
+{
+  LibraryIndex const* index;
+  char folded_query[LIBRARY_SEARCH_QUERY_MAX];
+  LibrarySearchTerm terms[LIBRARY_SEARCH_TERMS_MAX];
+  size_t terms_n;
+  uint32_t const* candidates; // file indices containing all trigrams of the terms
+  uint32_t* candidates_buf;    // storage for candidates, when intersected
+  bool all_files_are_candidates;
+  size_t candidates_n;
+  size_t candidate_i;
+  size_t matches_n;
+  LibrarySearchResult* results; // heap, worst first
+  size_t results_n;
+  size_t results_max;
+  uint32_t results_version; // changes whenever the results do
+} LibrarySearch;
+
+// \pre library_search_index_build was called on the index
+void library_search_start(LibrarySearch* search,
+                          LibraryIndex const* index,
+                          char const* query,
+                          size_t results_max);
+
+// Checks up to `candidates_max` more files. Returns true when the search is complete.
+bool library_search_continue(LibrarySearch* search, size_t candidates_max);
+
+// Copies the best results found so far, best first, and returns their count.
+size_t library_search_results(LibrarySearch const* search,
+                              LibrarySearchResult* d_results,
+                              size_t results_max);
+
+void library_search_free(LibrarySearch* search);
+
+// Runs a whole search. Fills up to `results_max` results, best first, and returns how
+// many files matched in total.
+size_t library_search(LibraryIndex const* index,
+                      char const* query,
+                      LibrarySearchResult* d_results,
+                      size_t results_max);
+
+enum
+{
+  Library_Idle,
+  Library_Loading,  // reading the persisted index
+  Library_Scanning, // walking the library, the loaded index may already be published
+  Library_Done,
+};
+
+// Indexes all files under a root directory in the background.
+//
+// The index persisted at `index_path` is loaded first and published, then the library
+// is walked again: only the directories whose modification stamp changed are listed,
+// and files whose size and modification stamp did not change keep their metadata.
+typedef struct Library
+{
+  char* root_abspath;
+  char* index_path;
+  uint32_t state;              // @atomic
+  uint32_t cancelled;          // @atomic
+  LibraryIndex* index;         // latest published index (may be null), owned by the UI
+  LibraryIndex* pending_index; // @atomic published by the indexer, not yet seen by the UI
+  TaskHandle finish_task;      // completes with the indexer
+} Library;
+
+void library_start(Library* library, char const* root_abspath, char const* index_path);
+
+// Picks up the latest published index into `library->index`. Returns true when it
+// changed.
+//
+// \pre must be called only from one thread at a time
+bool library_update(Library* library);
+
+// Cancels and waits for the indexer.
+void library_deinit(Library* library);
+
+#endif
@@ -9,6 +9,7 @@
 #include "md1_support.h"
 #include "md2_audio.h"
 #include "md2_audioengine.h"
+#include "md2_library.h"
 #include "md2_math.h"
 #include "md2_posix.h"
 #include "md2_temp_allocator.h"
@@ -16,6 +17,7 @@
 #include "md2_ui.h"
 #include "md2_win32.h"
 
+#include "libs/xxxx_atomic.h"
 #include "libs/xxxx_buf.h"
 #include "libs/xxxx_iobuffer.h"
 #include "libs/xxxx_map.h"
@@ -30,6 +32,7 @@
 #define NANOVG_GL3_IMPLEMENTATION
 #include "deps/nanovg/src/nanovg.h"
 #include "deps/nanovg/src/nanovg_gl.h"
+#include "deps/nanovg/src/nanovg_gl_utils.h"
 
 
 #include <assert.h>
@@ -43,10 +46,16 @@ int test_map(int, char const**);
 int test_iobuffer(int, char const**);
 int test_queue(int argc, char const** argv);
 
+int test_library(int argc, char const** argv);
 int test_serialisation(int argc, char const** argv);
 int test_task(int argc, char const** argv);
+int test_thread(int argc, char const** argv);
 int test_ui(int, char const**);
 
+int bench_map(int argc, char const** argv);
+int bench_queue(int argc, char const** argv);
+int bench_task(int argc, char const** argv);
+
 enum
 {
   MD2_UI_WAVEFORM_SIZE = 512,
@@ -246,12 +255,21 @@ void load_fonts(NVGcontext* vg)
   free(exe_dir), exe_dir = NULL;
 }
 
+enum
+{
+  LoadAudioTask_None,
+  LoadAudioTask_InProgress,
+  LoadAudioTask_Done,
+  LoadAudioTask_Error,
+};
+
 typedef struct LoadAudioTask
 {
-  bool success;
+  uint32_t state; // @atomic
   char* filename;
-  WaveformData ui_waveform;
-  MD2_Float2* float_stereo;
+  WaveformData ui_waveform;       // @atomic{ready_n} filled in progressively
+  WaveformData* pending_waveform; // @atomic analysed again, to replace ui_waveform
+  MD2_Float2* float_stereo;       // valid once state is LoadAudioTask_Done
   size_t float_stereo_n;
 } LoadAudioTask;
 
@@ -264,43 +282,137 @@ char* strdup_range(char const* f, size_t n)
   return str;
 }
 
+typedef struct LoadAudioDecoding
+{
+  LoadAudioTask* task;
+  size_t float_stereo_cap;
+  bool waveform_stream_started;
+  WaveformStream waveform_stream;
+} LoadAudioDecoding;
+
+// Converts and analyses the samples while they are hot, in one pass.
+static void load_audio_file__decoded(void* user,
+                                     struct Mu_AudioBuffer const* audiobuffer,
+                                     size_t samples_f,
+                                     size_t expected_samples_count)
+{
+  LoadAudioDecoding* decoding = user;
+  LoadAudioTask* load_audio_task = decoding->task;
+  size_t chan_n = audiobuffer->format.channels;
+  size_t frame_f = samples_f / chan_n;
+  size_t frame_l = audiobuffer->samples_count / chan_n;
+  assert(frame_f == load_audio_task->float_stereo_n);
+
+  if (!decoding->waveform_stream_started && load_audio_task->ui_waveform.len_pot > 0)
+  {
+    waveform_stream_start(&decoding->waveform_stream, &load_audio_task->ui_waveform,
+                          expected_samples_count / chan_n);
+    decoding->waveform_stream_started = true;
+  }
+
+  if (frame_l > decoding->float_stereo_cap)
+  {
+    size_t cap = max_i(frame_l, max_i(expected_samples_count / chan_n,
+                                      2 * decoding->float_stereo_cap));
+    MD2_Float2* float_stereo = realloc(
+      load_audio_task->float_stereo, cap * sizeof load_audio_task->float_stereo[0]);
+    if (!float_stereo)
+      md2_fatal("can't allocate");
+    load_audio_task->float_stereo = float_stereo;
+    decoding->float_stereo_cap = cap;
+  }
+
+  MD2_Float2* d_frames = &load_audio_task->float_stereo[frame_f];
+  int16_t const* s_samples = &audiobuffer->samples[frame_f * chan_n];
+  if (decoding->waveform_stream_started)
+  {
+    waveform_stream_push_int16(
+      &decoding->waveform_stream, s_samples, frame_l - frame_f, chan_n, d_frames);
+  }
+  else
+  {
+    WaveformStream no_waveform = {.overflowed = true};
+    waveform_stream_push_int16(
+      &no_waveform, s_samples, frame_l - frame_f, chan_n, d_frames);
+  }
+  load_audio_task->float_stereo_n = frame_l;
+}
+
+static void load_audio_file__free_samples(void* samples)
+{
+  free(samples);
+}
+
+static void load_audio_file__done(void* data)
+{
+  LoadAudioTask* load_audio_task = data;
+  atomic_store_uint32(&load_audio_task->state, LoadAudioTask_Done);
+}
+
 void load_audio_file(LoadAudioTask* load_audio_task)
 {
+  atomic_store_uint32(&load_audio_task->state, LoadAudioTask_InProgress);
+  LoadAudioDecoding decoding = {.task = load_audio_task};
   struct Mu_AudioBuffer audiobuffer;
-  bool success = Mu_LoadAudio(load_audio_task->filename, &audiobuffer);
+  bool success = Mu_LoadAudioProgressive(
+    load_audio_task->filename, &audiobuffer, load_audio_file__decoded, &decoding);
   if (!success)
+  {
+    atomic_store_uint32(&load_audio_task->state, LoadAudioTask_Error);
     return;
+  }
+
+  assert(load_audio_task->float_stereo_n
+         == audiobuffer.samples_count / audiobuffer.format.channels);
 
   WaveformData* d_waveform = &load_audio_task->ui_waveform;
-  size_t n = d_waveform->len_pot;
-  if (n > 0)
+  TaskHandle free_samples =
+    task_create(load_audio_file__free_samples, audiobuffer.samples);
+  if (d_waveform->len_pot > 0 && audiobuffer.samples_count > 0
+      && (!decoding.waveform_stream_started || decoding.waveform_stream.overflowed))
   {
-    audiobuffer_compute_waveform(&audiobuffer, d_waveform);
+    // the duration was unknown or underestimated: analyse again from the start into
+    // new buckets, the streamed ones stay visible until the UI swaps them
+    WaveformData* pending_waveform = calloc(1, sizeof *pending_waveform);
+    if (!pending_waveform)
+      md2_fatal("can't allocate");
+    size_t n = d_waveform->len_pot;
+    pending_waveform->len_pot = n;
+    pending_waveform->min = calloc(n, sizeof pending_waveform->min[0]);
+    pending_waveform->max = calloc(n, sizeof pending_waveform->max[0]);
+    pending_waveform->rms = calloc(n, sizeof pending_waveform->rms[0]);
+    if (!pending_waveform->min || !pending_waveform->max || !pending_waveform->rms)
+      md2_fatal("can't allocate");
+    atomic_store_ptr((void**)&load_audio_task->pending_waveform, pending_waveform);
+    TaskHandle done = task_create(load_audio_file__done, load_audio_task);
+    task_depends(free_samples, done);
+    audiobuffer_compute_waveform_start(&audiobuffer, pending_waveform, free_samples);
+    return;
   }
 
-  load_audio_task->float_stereo_n =
-    audiobuffer.samples_count / audiobuffer.format.channels;
-  load_audio_task->float_stereo =
-    calloc(load_audio_task->float_stereo_n, sizeof load_audio_task->float_stereo[0]);
-  {
-    MD2_Float2* d_frame = &load_audio_task->float_stereo[0];
-    for (size_t sample_index = 0; sample_index < audiobuffer.samples_count;
-         sample_index += audiobuffer.format.channels)
-    {
-      d_frame->x = audiobuffer.samples[sample_index] / 32267.0;
-      d_frame->y = d_frame->x;
-      if (audiobuffer.format.channels > 1)
-      {
-        d_frame->y = audiobuffer.samples[sample_index + 1] / 32267.0;
-      }
-      d_frame++;
-    }
-    assert(load_audio_task->float_stereo_n
-           == d_frame - &load_audio_task->float_stereo[0]);
-  }
+  if (decoding.waveform_stream_started)
+    waveform_stream_end(&decoding.waveform_stream);
+  task_start(free_samples);
+  atomic_store_uint32(&load_audio_task->state, LoadAudioTask_Done);
+}
 
-  free(audiobuffer.samples);
-  load_audio_task->success = success;
+// Swaps in the waveform analysed again, once all its buckets are ready.
+//
+// \pre must be called from the UI thread, the only reader of the waveform
+static void load_audio_task_update(LoadAudioTask* load_audio_task)
+{
+  WaveformData* pending_waveform =
+    atomic_load_ptr((void**)&load_audio_task->pending_waveform);
+  if (!pending_waveform
+      || atomic_load_uint32(&pending_waveform->ready_n) != pending_waveform->len_pot)
+    return;
+  atomic_store_ptr((void**)&load_audio_task->pending_waveform, NULL);
+  WaveformData* waveform = &load_audio_task->ui_waveform;
+  free(waveform->min), waveform->min = pending_waveform->min;
+  free(waveform->max), waveform->max = pending_waveform->max;
+  free(waveform->rms), waveform->rms = pending_waveform->rms;
+  atomic_store_uint32(&waveform->ready_n, (uint32_t)pending_waveform->len_pot);
+  free(pending_waveform);
 }
 
 static inline char* temp_strdup(char const* src, TempAllocator* allocator)
@@ -372,9 +484,11 @@ typedef struct MD2_UIRegion
   Map element_index_by_data;
 } MD2_UIRegion;
 
-void md2_ui_region_start(MD2_UIRegion* region)
+// \param perframe_allocator holds the region's index until the end of the frame
+void md2_ui_region_start(MD2_UIRegion* region, TempAllocator* perframe_allocator)
 {
   region->bounds = rect_cover_unit();
+  temp_map_init(&region->element_index_by_data, perframe_allocator);
 }
 
 void md2_ui_region_end(MD2_UIRegion* region)
@@ -619,16 +733,6 @@ bool md2_ui_scroller_get_element(MD2_UserInterface* ui,
   return true;
 }
 
-static void atomic_store_uint32(uint32_t* d_y, uint32_t x)
-{
-  *d_y = x;
-}
-
-static uint32_t atomic_load_uint32(uint32_t const* s_x)
-{
-  return *s_x;
-}
-
 enum
 {
   DirectoryListing_None,
@@ -644,7 +748,8 @@ enum
 
 typedef struct DirectoryListing
 {
-  uint32_t state;
+  uint32_t state;  // @atomic
+  TaskHandle task; // when listing from disk
   char* error;
   char error_buffer[256];
   uint64_t start_tick;
@@ -657,19 +762,11 @@ typedef struct DirectoryListing
     names; // [0..last_dir_name_n) directories, [last_dir_name_n..names_n) files
 } DirectoryListing;
 
-void directory_listing_cleanup_on_cancellation_task(void* data_)
-{
-  DirectoryListing* listing = data_;
-  if (atomic_load_uint32(&listing->state) == DirectoryListing_Cancelled)
-  {
-    // @todo cleanup memory
-    temp_allocator_free(&listing->allocator);
-  }
-}
-
 #if defined(_WIN32)
-void win32_query_directory(DirectoryListing* listing)
+// \param data_ the DirectoryListing, as a blocking call for task_io_call
+void win32_query_directory(void* data_)
 {
+  DirectoryListing* listing = data_;
   char const* query_fmt = "%s\\*";
   char* query = temp_sprintf(&listing->allocator, query_fmt, listing->root_abspath);
 
@@ -677,7 +774,6 @@ void win32_query_directory(DirectoryListing* listing)
   HANDLE SearchHandle = FindFirstFileA(query, &CurrentFileAttributes);
   if (!SearchHandle || ((void*)(intptr_t)(-1)) == SearchHandle)
   {
-    listing->state = DirectoryListing_Error;
     snprintf(listing->error_buffer, sizeof listing->error_buffer, "Got Win32 error: 0x%x",
              GetLastError());
     listing->error = listing->error_buffer;
@@ -711,7 +807,7 @@ void win32_query_directory(DirectoryListing* listing)
       buf_push(
         files_buf, temp_strdup(CurrentFileAttributes.cFileName, &listing->allocator));
     }
-  } while (FindNextFileA(SearchHandle, &CurrentFileAttributes));
+  } while (!task_is_cancelled() && FindNextFileA(SearchHandle, &CurrentFileAttributes));
   FindClose(SearchHandle);
   size_t names_n = buf_len(dirs_buf) + buf_len(files_buf);
   char** names = temp_calloc(&listing->allocator, names_n, sizeof names[0]);
@@ -729,16 +825,64 @@ void win32_query_directory(DirectoryListing* listing)
 void directory_listing_task(void* data_)
 {
   DirectoryListing* listing = data_;
-  atomic_store_uint32(&listing->state, DirectoryListing_InProgress);
+  uint32_t state = DirectoryListing_None;
+  if (atomic_compare_exchange_uint32(
+        &listing->state, &state, DirectoryListing_InProgress))
+  {
 #if defined(_WIN32)
-  win32_query_directory(listing);
+    task_io_call(win32_query_directory, listing);
 #else
 #error "Implement me"
 #endif
+    state = DirectoryListing_InProgress;
+    uint32_t end_state = listing->error ? DirectoryListing_Error : DirectoryListing_Done;
+    if (atomic_compare_exchange_uint32(&listing->state, &state, end_state))
+      return;
+  }
+
+  // cancelled by directory_listing_free, which left the listing to us
+  temp_allocator_free(&listing->allocator);
+  free(listing);
+}
+
+// fills the listing from the library index, when it covers the directory
+static bool directory_listing__from_library(DirectoryListing* listing,
+                                            LibraryIndex const* library_index)
+{
+  uint32_t dir_i = library_index_find_directory(library_index, listing->root_abspath);
+  if (dir_i == LIBRARY_INDEX_NONE)
+    return false;
+
+  LibraryDirectory const* dir = &library_index->dirs_buf[dir_i];
+  char const* parent_name = ".."; // to navigate up, as in the listings from disk
+  size_t names_n = 1 + dir->dir_n + dir->file_n;
+  char const** names = temp_calloc(&listing->allocator, names_n, sizeof names[0]);
+  size_t name_i = 0;
+  names[name_i++] = temp_strdup(parent_name, &listing->allocator);
+  for (uint32_t child_i = 0; child_i < dir->dir_n; child_i++)
+  {
+    LibraryDirectory const* child =
+      &library_index->dirs_buf[dir->first_dir_index + child_i];
+    names[name_i++] =
+      temp_strdup(&library_index->names_buf[child->name_offset], &listing->allocator);
+  }
+  for (uint32_t file_i = 0; file_i < dir->file_n; file_i++)
+  {
+    LibraryFile const* file = &library_index->files_buf[dir->first_file_index + file_i];
+    names[name_i++] =
+      temp_strdup(&library_index->names_buf[file->name_offset], &listing->allocator);
+  }
+  listing->names = names;
+  listing->names_n = names_n;
+  listing->last_dir_name_n = 1 + dir->dir_n;
   atomic_store_uint32(&listing->state, DirectoryListing_Done);
+  return true;
 }
 
-void directory_listing_make(DirectoryListing* listing, char const* root_dir_path)
+// \param library_index may be null
+void directory_listing_make(DirectoryListing* listing,
+                            char const* root_dir_path,
+                            LibraryIndex const* library_index)
 {
   bool rp_error;
 #if defined(_WIN32)
@@ -755,47 +899,33 @@ void directory_listing_make(DirectoryListing* listing, char const* root_dir_path
   }
   listing->root_abspath = temp_strdup(rp, &listing->allocator);
 
-  TaskHandle task = task_create(directory_listing_task, listing);
-  task_depends(
-    task, task_create(directory_listing_cleanup_on_cancellation_task, listing));
-  task_start(task);
-}
+  if (library_index && directory_listing__from_library(listing, library_index))
+    return;
 
-bool directory_listing_same_dir(DirectoryListing* listing, char const* other_path)
-{
-  bool rp_error;
-#if defined(_WIN32)
-  char* rp = win32_realpath(other_path, &rp_error, NULL, 0);
-#else
-  char* rp = posix_realpath(other_path, &rp_error, NULL, 0);
-#endif
-  if (rp_error)
-    return false;
-  return strcmp(listing->root_abspath, rp) == 0;
+  listing->task = task_create(directory_listing_task, listing);
+  task_start(listing->task);
 }
 
+// Frees the listing, or lets its task free it once it stopped, so as to never wait for
+// the disk from the UI.
 void directory_listing_free(DirectoryListing* listing)
 {
-  assert(listing->state != DirectoryListing_InProgress);
-  if (atomic_load_uint32(&listing->state) == DirectoryListing_InProgress)
+  TaskHandle task = listing->task; // the listing is the task's as soon as it's cancelled
+  uint32_t state = atomic_load_uint32(&listing->state);
+  while (state == DirectoryListing_None || state == DirectoryListing_InProgress)
   {
-    atomic_store_uint32(&listing->state, DirectoryListing_Cancelled);
-    // @todo @defect interrupt and wait for task if it's running, otherwise detach if it
-    // does not respond
-    // @todo @defect it would be a defect for the UI to wait, so detaching the data and
-    // having a cleanup task is the surest.
-    return; // will crash if we free the memory
+    if (atomic_compare_exchange_uint32(
+          &listing->state, &state, DirectoryListing_Cancelled))
+    {
+      task_cancel(task);
+      return;
+    }
   }
   temp_allocator_free(&listing->allocator);
+  free(listing);
 }
 
-static Map /* path to DirectoryListing* */ g_directory_listings;
-typedef struct DirectoryListingEntry
-{
-  char* directory_path_buf;
-  struct DirectoryListing* listing;
-  struct DirectoryListing** collisions;
-} DirectoryListingEntry;
+static StrMap /* path to DirectoryListing* */ g_directory_listings;
 
 char* buf_make_strdup(char* other)
 {
@@ -807,48 +937,37 @@ char* buf_make_strdup(char* other)
   return buf;
 }
 
-DirectoryListing* directory_listing_get(char const* directory_path, uint64_t start_tick)
+DirectoryListing* directory_listing_get(char const* directory_path,
+                                        uint64_t start_tick,
+                                        LibraryIndex const* library_index)
 {
-  uint64_t key_hash = hash_bytes(directory_path, strlen(directory_path));
-  DirectoryListingEntry* listing_entry = map_get(&g_directory_listings, key_hash);
-  if (listing_entry && directory_listing_same_dir(listing_entry->listing, directory_path))
-  {
-    return listing_entry->listing;
-  }
-
-  DirectoryListing** d_listing;
-  if (listing_entry)
-  {
-    DirectoryListing** collision_entry;
-    for (collision_entry = &listing_entry->collisions[0];
-         collision_entry < buf_end(listing_entry->collisions)
-         && !directory_listing_same_dir(*collision_entry, directory_path);
-         collision_entry++)
-      ;
-    if (collision_entry < buf_end(listing_entry->collisions))
-    {
-      return *collision_entry;
-    }
-
-    buf_push(listing_entry->collisions, NULL);
-    d_listing = &buf_end(listing_entry->collisions)[-1];
-  }
-  else
-  {
-    listing_entry = calloc(1, sizeof *listing_entry);
-    map_put(&g_directory_listings, key_hash, listing_entry);
-    d_listing = &listing_entry->listing;
-  }
+  size_t directory_path_n = strlen(directory_path);
+  DirectoryListing* cached_listing =
+    str_map_get(&g_directory_listings, directory_path, directory_path_n);
+  if (cached_listing)
+    return cached_listing;
 
   DirectoryListing* listing = calloc(1, sizeof *listing);
-  directory_listing_make(listing, directory_path);
+  directory_listing_make(listing, directory_path, library_index);
   listing->start_tick = start_tick;
 
-  *d_listing = listing;
+  str_map_put(&g_directory_listings, directory_path, directory_path_n, listing);
 
   return listing;
 }
 
+// cancels the listings still in progress rather than waiting for them
+void directory_listings_free_all(void)
+{
+  for (size_t entry_i = 0; entry_i < g_directory_listings.cap; entry_i++)
+  {
+    StrMapEntry const* entry = &g_directory_listings.entries[entry_i];
+    if (entry->hash)
+      directory_listing_free(entry->ptr);
+  }
+  str_map_free(&g_directory_listings);
+}
+
 typedef struct MD2_UIList
 {
   Map selection_indices_set; // all element indices belonging to the selection
@@ -902,6 +1021,113 @@ SelectionRange ui_list_element_process_input(MD2_UserInterface* ui,
   return (SelectionRange){0};
 }
 
+// The items shown by a list, and what the list needs to know of them.
+typedef struct UIListItems
+{
+  void const* data;
+  size_t n;
+  uint64_t (*key)(void const* data, size_t item_i); // in selection_indices_set
+  // returns the path to drag, or null when the item can't be dragged
+  char* (*path)(void const* data, size_t item_i, TempAllocator* allocator);
+} UIListItems;
+
+typedef struct UIListElement
+{
+  MD2_UIElement element;
+  size_t item_i;
+  bool is_selected;
+  bool is_dragged;            // drawn again at drag_element
+  MD2_UIElement drag_element; // follows the pointer, in the overlay
+  SelectionRange selection;   // applied by ui_list_element_end
+} UIListElement;
+
+// Processes the input over a visible element of the list and draws its selection,
+// before the caller draws the element itself.
+UIListElement ui_list_element_start(MD2_UserInterface* ui,
+                                    MD2_UIList* list,
+                                    UIListItems const* items,
+                                    MD2_UIElement element,
+                                    size_t item_i)
+{
+  UIListElement list_element = {
+    .element = element,
+    .item_i = item_i,
+    .selection = ui_list_element_process_input(ui, list, element, item_i),
+  };
+  list_element.is_selected =
+    map_get(&list->selection_indices_set, items->key(items->data, item_i)) != NULL;
+  if (list_element.is_selected)
+    md2_ui_rect(ui, element, nvgRGBA(160, 160, 160, 128));
+  list_element.is_dragged = list->in_drag_gesture && list_element.is_selected;
+  list_element.drag_element = element;
+  list_element.drag_element.layer = 1;
+  list_element.drag_element.rect = rect_translated(
+    element.rect, vec_from_to(ui->pointer.last_press_position, ui->pointer.position));
+  return list_element;
+}
+
+// Draws the hover over the element, starts a drag from it and applies the selection.
+void ui_list_element_end(MD2_UserInterface* ui,
+                         MD2_UIList* list,
+                         UIListItems const* items,
+                         UIListElement list_element)
+{
+  SelectionRange selection = list_element.selection;
+  size_t item_i = list_element.item_i;
+  if (rect_intersects(list_element.element.rect, ui->pointer.position))
+  {
+    md2_ui_rect(ui, list_element.element, nvgRGBA(255, 160, 160, 128));
+    if (ui->pointer.drag.started)
+    {
+      list->in_drag_gesture = true;
+      if (!list_element.is_selected)
+      {
+        list->anchor_index = item_i;
+        selection = (SelectionRange){SelectionRangeOp_Replace, item_i, item_i + 1};
+      }
+    }
+  }
+  if (selection.op == SelectionRangeOp_Replace)
+    map_clear(&list->selection_indices_set);
+  for (size_t selected_i = selection.first_index; selected_i < selection.last_index;
+       selected_i++)
+  {
+    map_put(&list->selection_indices_set, items->key(items->data, selected_i),
+            (void*)(intptr_t)1);
+  }
+}
+
+// Offers the paths of the selected items when a drag starts from the list.
+void ui_list_end(MD2_UserInterface* ui, MD2_UIList* list, UIListItems const* items)
+{
+  if (list->in_drag_gesture && ui->pointer.drag.started)
+  {
+    char** filepath_list = NULL;
+    TempAllocator* d_allocator = &ui->pointer.drag.payload_allocator;
+    for (size_t item_i = 0; item_i < items->n; item_i++)
+    {
+      if (!map_get(&list->selection_indices_set, items->key(items->data, item_i)))
+        continue;
+      char* path = items->path(items->data, item_i, d_allocator);
+      if (path)
+        buf_push(filepath_list, path);
+    }
+    if (buf_len(filepath_list) > 0)
+    {
+      FilepathList* d_list = temp_calloc(d_allocator, 1, sizeof *d_list);
+      d_list->paths_n = buf_len(filepath_list);
+      d_list->paths =
+        temp_memdup_range(d_allocator, &filepath_list[0], buf_end(filepath_list));
+      map_put(&ui->pointer.drag.payload_by_type, MD2_PayloadType_FilepathList, d_list);
+    }
+    buf_free(filepath_list);
+  }
+  if (ui->pointer.drag.ended)
+  {
+    list->in_drag_gesture = false;
+  }
+}
+
 void ui_directory_listing_element_draw(MD2_UserInterface* ui,
                                        MD2_UIElement element,
                                        char const* name,
@@ -919,14 +1145,32 @@ typedef struct DirectoryListingOperation
   char const* next_directory_path;
 } DirectoryListingOperation;
 
+static uint64_t ui_directory_listing__key(void const* data, size_t entry_i)
+{
+  DirectoryListing const* listing = data;
+  return hash_ptr(listing->names[entry_i]);
+}
+
+static char* ui_directory_listing__path(void const* data,
+                                        size_t entry_i,
+                                        TempAllocator* allocator)
+{
+  DirectoryListing const* listing = data;
+  if (entry_i < listing->last_dir_name_n)
+    return NULL; // ignore dirs
+  return temp_sprintf(allocator, "%s/%s", listing->root_abspath, listing->names[entry_i]);
+}
+
 DirectoryListingOperation ui_directory_listing(MD2_UserInterface* ui,
                                                MD2_UIElement element,
                                                MD2_UIList* list,
                                                MD2_UIScrollableContent* scroller_state,
-                                               char const* directory_path)
+                                               char const* directory_path,
+                                               LibraryIndex const* library_index,
+                                               TempAllocator* perframe_allocator)
 {
   DirectoryListing const* listing =
-    directory_listing_get(directory_path, ui->mu->time.ticks);
+    directory_listing_get(directory_path, ui->mu->time.ticks, library_index);
   DirectoryListingOperation result = {.next_directory_path = NULL};
   bool listing_is_done = atomic_load_uint32(&listing->state) & DirectoryListing_Done;
 
@@ -935,7 +1179,7 @@ DirectoryListingOperation ui_directory_listing(MD2_UserInterface* ui,
   float default_font_size = 16.0; // @todo global
   MD2_UIRegion list_content = {0};
 
-  md2_ui_region_start(&list_content);
+  md2_ui_region_start(&list_content, perframe_allocator);
   if (listing_is_done)
   {
     float row_y = 0.0;
@@ -961,128 +1205,321 @@ DirectoryListingOperation ui_directory_listing(MD2_UserInterface* ui,
 
   md2_ui_rect(ui, element, nvgRGBA(160, 160, 160, 128)); // debug
   nvgFillColor(vg, nvgRGBA(255, 255, 255, 255));
+  UIListItems items = {
+    .data = listing,
+    .n = listing_is_done ? listing->names_n : 0,
+    .key = ui_directory_listing__key,
+    .path = ui_directory_listing__path,
+  };
   md2_ui_scroller_start(ui, scroller_state, &list_content, file_list_scroller);
-  if (listing_is_done)
+  for (size_t entry_i = 0; entry_i < items.n; entry_i++)
   {
-    for (size_t entry_i = 0; entry_i < listing->names_n; entry_i++)
+    char const* name = listing->names[entry_i];
+    bool is_dir = entry_i < listing->last_dir_name_n;
+    MD2_UIElement element_in_list;
+    if (!md2_ui_scroller_get_element(
+          ui, scroller_state, file_list_scroller, &list_content, name, &element_in_list))
+      continue;
+
+    UIListElement list_element =
+      ui_list_element_start(ui, list, &items, element_in_list, entry_i);
+    ui_directory_listing_element_draw(ui, list_element.element, name, is_dir);
+    if (list_element.is_dragged)
+      ui_directory_listing_element_draw(ui, list_element.drag_element, name, is_dir);
+    if (rect_intersects(list_element.element.rect, ui->pointer.position)
+        && ui->pointer.double_clicked && is_dir)
     {
-      char const* name = listing->names[entry_i];
-      bool is_dir = entry_i < listing->last_dir_name_n;
-      MD2_UIElement list_element;
-      if (md2_ui_scroller_get_element(
-            ui, scroller_state, file_list_scroller, &list_content, name, &list_element))
+      assert(result.next_directory_path == NULL);
+      if (result.next_directory_path == NULL)
       {
-        SelectionRange selection =
-          ui_list_element_process_input(ui, list, list_element, entry_i);
-        bool element_is_selected = map_get(&list->selection_indices_set, hash_ptr(name));
-        if (element_is_selected)
-        {
-          md2_ui_rect(ui, list_element, nvgRGBA(160, 160, 160, 128));
-        }
-        ui_directory_listing_element_draw(ui, list_element, name, is_dir);
-        if (list->in_drag_gesture && element_is_selected)
-        {
-          MD2_UIElement drag_element = list_element;
-          drag_element.layer = 1;
-          drag_element.rect = rect_translated(
-            list_element.rect,
-            vec_from_to(ui->pointer.last_press_position, ui->pointer.position));
-          ui_directory_listing_element_draw(ui, drag_element, name, is_dir);
-        }
-        if (rect_intersects(list_element.rect, ui->pointer.position))
-        {
-          md2_ui_rect(ui, list_element, nvgRGBA(255, 160, 160, 128));
-
-          if (ui->pointer.double_clicked && is_dir)
-          {
-            assert(result.next_directory_path == NULL);
-            if (result.next_directory_path == NULL)
-            {
-              char* buf = NULL;
-              buf_printf(buf, "%s/%s", listing->root_abspath, name);
-              result.next_directory_path = _strdup(buf);
-              buf_free(buf);
-            }
-          }
-
-          if (ui->pointer.drag.started)
-          {
-            list->in_drag_gesture = true;
-            if (!element_is_selected)
-            {
-              list->anchor_index = entry_i;
-              selection.op = SelectionRangeOp_Replace;
-              selection.first_index = entry_i;
-              selection.last_index = entry_i + 1;
-            }
-          }
-        }
-        if (selection.op == SelectionRangeOp_Replace)
-        {
-          map_free(&list->selection_indices_set);
-        }
-        for (size_t entry_to_select_i = selection.first_index;
-             entry_to_select_i < selection.last_index; entry_to_select_i++)
-        {
-          char const* const name = listing->names[entry_to_select_i];
-          map_put(&list->selection_indices_set, hash_ptr(name), (void*)(intptr_t)1);
-        }
+        char* buf = NULL;
+        buf_printf(buf, "%s/%s", listing->root_abspath, name);
+        result.next_directory_path = _strdup(buf);
+        buf_free(buf);
       }
     }
+    ui_list_element_end(ui, list, &items, list_element);
   }
   md2_ui_scroller_end(ui, scroller_state, &list_content, file_list_scroller);
+  ui_list_end(ui, list, &items);
 
+  nvgFillColor(vg, nvgRGBA(255, 255, 255, 255));
+  nvgTextAlign(vg, NVG_ALIGN_BOTTOM);
+  nvgFontSize(vg, default_font_size);
   if (listing_is_done)
   {
-    if (list->in_drag_gesture && ui->pointer.drag.started)
+    md2_ui_textf(
+      ui, element, "Directory %s (Found %d)", listing->root_abspath, listing->names_n);
+  }
+  else
+  {
+    md2_ui_textf(ui, element, "Directory %s (Listing)", listing->root_abspath);
+  }
+  nvgTextAlign(vg, NVG_ALIGN_BASELINE); // back to default
+
+  md2_ui_region_free(&list_content);
+  return result;
+}
+
+enum
+{
+  UI_LIBRARY_SEARCH_RESULTS_MAX = 512,
+  UI_LIBRARY_SEARCH_CANDIDATES_PER_FRAME = 1 << 14, // bounds the time spent per frame
+  UI_LIBRARY_SEARCH_CACHED_MAX = 8,
+};
+
+// Results of a completed search, to show them at once when the query comes back, as
+// when erasing what was typed.
+typedef struct UILibrarySearchCached
+{
+  char query[LIBRARY_SEARCH_QUERY_MAX];
+  uint64_t last_used_n;
+  LibrarySearchResult results[UI_LIBRARY_SEARCH_RESULTS_MAX]; // best first
+  size_t results_n;
+  size_t matches_n;
+} UILibrarySearchCached;
+
+typedef struct UILibrarySearch
+{
+  char query[LIBRARY_SEARCH_QUERY_MAX];
+  size_t query_n;
+  bool query_changed;
+  LibraryIndex const* index; // of the shown results, or null
+  LibrarySearch search;
+  bool search_is_done;
+  uint32_t results_version; // of the search, when the results were last copied
+  LibrarySearchResult results[UI_LIBRARY_SEARCH_RESULTS_MAX]; // best first
+  size_t results_n;
+  size_t matches_n; // files matching so far, including those past the results
+  LibraryIndex const* cached_index; // of the cached results
+  UILibrarySearchCached cached[UI_LIBRARY_SEARCH_CACHED_MAX];
+  size_t cached_n;
+  uint64_t uses_n;
+} UILibrarySearch;
+
+// The search box is the only text input, it receives all typed text.
+void ui_library_search_box(MD2_UserInterface* ui,
+                           MD2_UIElement element,
+                           UILibrarySearch* search)
+{
+  for (size_t char_i = 0; char_i < ui->mu->text_length; char_i++)
+  {
+    char c = ui->mu->text[char_i];
+    if (c == '\b' && search->query_n > 0)
+    {
+      search->query[--search->query_n] = '\0';
+      search->query_changed = true;
+    }
+    else if (c == 0x1b) // escape
+    {
+      search->query[search->query_n = 0] = '\0';
+      search->query_changed = true;
+    }
+    else if ((unsigned char)c >= 0x20 && search->query_n + 1 < sizeof search->query)
+    {
+      search->query[search->query_n++] = c;
+      search->query[search->query_n] = '\0';
+      search->query_changed = true;
+    }
+  }
+
+  NVGcontext* vg = md2_ui_vg(ui, element);
+  md2_ui_rect(ui, element, nvgRGBA(64, 64, 64, 255));
+  nvgTextAlign(vg, NVG_ALIGN_BOTTOM);
+  if (search->query_n > 0)
+  {
+    nvgFillColor(vg, nvgRGBA(255, 255, 255, 255));
+    md2_ui_textf(ui, element, "Search: %s_", search->query);
+  }
+  else
+  {
+    nvgFillColor(vg, nvgRGBA(160, 160, 160, 255));
+    md2_ui_textf(ui, element, "Type to search the library");
+  }
+  nvgTextAlign(vg, NVG_ALIGN_BASELINE); // back to default
+}
+
+// returns the cached results of the query, or null
+static UILibrarySearchCached* ui_library_search__cached(UILibrarySearch* search)
+{
+  for (size_t cached_i = 0; cached_i < search->cached_n; cached_i++)
+  {
+    UILibrarySearchCached* cached = &search->cached[cached_i];
+    if (0 == strcmp(cached->query, search->query))
     {
-      char** filepath_list = NULL;
-      TempAllocator* d_allocator = &ui->pointer.drag.payload_allocator;
+      cached->last_used_n = ++search->uses_n;
+      return cached;
+    }
+  }
+  return NULL;
+}
 
-      for (size_t entry_i = 0; entry_i < listing->names_n; entry_i++)
+// keeps the results of the completed search, in place of the least recently used ones
+static void ui_library_search__cache(UILibrarySearch* search)
+{
+  UILibrarySearchCached* cached = &search->cached[0];
+  if (search->cached_n < UI_LIBRARY_SEARCH_CACHED_MAX)
+  {
+    cached = &search->cached[search->cached_n++];
+  }
+  else
+  {
+    for (size_t cached_i = 1; cached_i < search->cached_n; cached_i++)
+    {
+      if (search->cached[cached_i].last_used_n < cached->last_used_n)
+        cached = &search->cached[cached_i];
+    }
+  }
+  memcpy(cached->query, search->query, sizeof cached->query);
+  cached->last_used_n = ++search->uses_n;
+  memcpy(cached->results, search->results, search->results_n * sizeof cached->results[0]);
+  cached->results_n = search->results_n;
+  cached->matches_n = search->matches_n;
+}
+
+// Restarts the search when the query or the index changed, and advances it by a
+// bounded amount, so that results stream in over the next frames. The results are
+// only sorted again when the search found better ones.
+void ui_library_search_update(UILibrarySearch* search, LibraryIndex const* library_index)
+{
+  if (search->query_changed || search->index != library_index)
+  {
+    library_search_free(&search->search);
+    search->search = (LibrarySearch){0};
+    search->index = NULL;
+    search->search_is_done = true;
+    search->results_version = 0;
+    search->results_n = 0;
+    search->matches_n = 0;
+    if (search->cached_index != library_index)
+    {
+      search->cached_index = library_index;
+      search->cached_n = 0;
+    }
+    if (library_index && search->query_n > 0)
+    {
+      search->index = library_index;
+      UILibrarySearchCached const* cached = ui_library_search__cached(search);
+      if (cached)
       {
-        if (entry_i < listing->last_dir_name_n)
-          continue; // ignore dirs
-        char const* const name = listing->names[entry_i];
-        if (map_get(&list->selection_indices_set, hash_ptr(name)))
-        {
-          buf_push(filepath_list,
-                   temp_sprintf(d_allocator, "%s/%s", listing->root_abspath, name));
-        }
+        memcpy(search->results, cached->results,
+               cached->results_n * sizeof search->results[0]);
+        search->results_n = cached->results_n;
+        search->matches_n = cached->matches_n;
       }
-      if (buf_len(filepath_list) > 0)
+      else
       {
-        FilepathList* d_list = temp_calloc(d_allocator, 1, sizeof *d_list);
-        d_list->paths_n = buf_len(filepath_list);
-        d_list->paths =
-          temp_memdup_range(d_allocator, &filepath_list[0], buf_end(filepath_list));
-        map_put(&ui->pointer.drag.payload_by_type, MD2_PayloadType_FilepathList, d_list);
+        library_search_start(&search->search, library_index, search->query,
+                             UI_LIBRARY_SEARCH_RESULTS_MAX);
+        search->search_is_done = false;
       }
-      buf_free(filepath_list);
     }
+    search->query_changed = false;
   }
-
-  if (ui->pointer.drag.ended)
+  if (!search->search_is_done)
   {
-    list->in_drag_gesture = false;
+    search->search_is_done =
+      library_search_continue(&search->search, UI_LIBRARY_SEARCH_CANDIDATES_PER_FRAME);
+    search->matches_n = search->search.matches_n;
+    if (search->results_version != search->search.results_version)
+    {
+      search->results_version = search->search.results_version;
+      search->results_n = library_search_results(
+        &search->search, search->results, UI_LIBRARY_SEARCH_RESULTS_MAX);
+    }
+    if (search->search_is_done)
+      ui_library_search__cache(search);
   }
+}
 
-  nvgFillColor(vg, nvgRGBA(255, 255, 255, 255));
-  nvgTextAlign(vg, NVG_ALIGN_BOTTOM);
-  nvgFontSize(vg, default_font_size);
-  if (listing_is_done)
+static uint64_t ui_library_search__key(void const* data, size_t result_i)
+{
+  UILibrarySearch const* search = data;
+  return hash_uint64(1 + search->results[result_i].file_index);
+}
+
+static char* ui_library_search__path(void const* data,
+                                     size_t result_i,
+                                     TempAllocator* allocator)
+{
+  UILibrarySearch const* search = data;
+  char* path_buf = NULL;
+  library_index_file_path(search->index, search->results[result_i].file_index, &path_buf);
+  char* path = temp_strdup(path_buf, allocator);
+  buf_free(path_buf);
+  return path;
+}
+
+void ui_library_search_results(MD2_UserInterface* ui,
+                               MD2_UIElement element,
+                               MD2_UIList* list,
+                               MD2_UIScrollableContent* scroller_state,
+                               UILibrarySearch const* search,
+                               TempAllocator* perframe_allocator)
+{
+  LibraryIndex const* index = search->index;
+  NVGcontext* vg = md2_ui_vg(ui, element);
+  float font_size = 14.0;
+  float default_font_size = 16.0; // @todo global
+
+  MD2_UIRegion list_content = {0};
+  md2_ui_region_start(&list_content, perframe_allocator);
+  for (size_t result_i = 0; result_i < search->results_n; result_i++)
   {
-    md2_ui_textf(
-      ui, element, "Directory %s (Found %d)", listing->root_abspath, listing->names_n);
+    md2_ui_region_add(&list_content,
+                      (MD2_UIElement){.rect = {.x0 = 0.0,
+                                               .x1 = element.rect.x1 - element.rect.x0,
+                                               .y0 = result_i * font_size,
+                                               .y1 = (result_i + 1) * font_size}},
+                      &search->results[result_i]);
   }
-  else
+  md2_ui_region_end(&list_content);
+
+  MD2_UIElement results_scroller = element;
+  results_scroller.rect.y1 -= default_font_size; // @todo status height
+  results_scroller.rect = rect_made_valid(results_scroller.rect);
+
+  md2_ui_rect(ui, element, nvgRGBA(160, 160, 160, 128)); // debug
+  nvgFontSize(vg, font_size);
+  UIListItems items = {
+    .data = search,
+    .n = search->results_n,
+    .key = ui_library_search__key,
+    .path = ui_library_search__path,
+  };
+  md2_ui_scroller_start(ui, scroller_state, &list_content, results_scroller);
+  for (size_t result_i = 0; result_i < search->results_n; result_i++)
   {
-    md2_ui_textf(ui, element, "Directory %s (Listing)", listing->root_abspath);
+    LibraryFile const* file = &index->files_buf[search->results[result_i].file_index];
+    MD2_UIElement element_in_list;
+    if (!md2_ui_scroller_get_element(ui, scroller_state, results_scroller, &list_content,
+                                     &search->results[result_i], &element_in_list))
+      continue;
+
+    UIListElement list_element =
+      ui_list_element_start(ui, list, &items, element_in_list, result_i);
+    char const* name = &index->names_buf[file->name_offset];
+    LibraryDirectory const* dir = &index->dirs_buf[file->dir_index];
+    char const* dir_name = &index->names_buf[dir->name_offset];
+    nvgTextAlign(vg, NVG_ALIGN_BOTTOM);
+    nvgFillColor(vg, nvgRGBA(255, 255, 255, 255));
+    md2_ui_textf(ui, list_element.element, "%s    %s/", name, dir_name);
+    if (list_element.is_dragged)
+      md2_ui_textf(ui, list_element.drag_element, "%s", name);
+    nvgTextAlign(vg, NVG_ALIGN_BASELINE); // back to default
+    ui_list_element_end(ui, list, &items, list_element);
   }
+  md2_ui_scroller_end(ui, scroller_state, &list_content, results_scroller);
+  ui_list_end(ui, list, &items);
+
+  nvgFillColor(vg, nvgRGBA(255, 255, 255, 255));
+  nvgTextAlign(vg, NVG_ALIGN_BOTTOM);
+  nvgFontSize(vg, default_font_size);
+  md2_ui_textf(ui, element, "Found %zu%s", search->matches_n,
+               search->search_is_done ? "" : " (searching)");
   nvgTextAlign(vg, NVG_ALIGN_BASELINE); // back to default
 
   md2_ui_region_free(&list_content);
-  return result;
 }
 
 
@@ -1138,15 +1575,32 @@ LoadAudioTask* md2_load_audio_task_start(char const* path, size_t path_n)
     wv->max = calloc(n, sizeof wv->max[0]);
     wv->rms = calloc(n, sizeof wv->rms[0]);
   }
-  task_start(task_create(load_audio_file, task_data));
+  // imports come in bulk, they must not delay browsing
+  task_start(
+    task_create_with_priority(load_audio_file, task_data, TaskPriority_Background));
   return task_data;
 }
 
+// writes the most recent task events, press F12 to take one while running
+void md2_task_trace_write(char const* path)
+{
+  FILE* file = fopen(path, "wb");
+  if (!file)
+  {
+    printf("ERROR: could not write the task trace to '%s'\n", path);
+    return;
+  }
+  task_trace_write(file);
+  fclose(file);
+}
+
 // ui definition
 typedef struct MD2_UIState
 {
   struct LoadAudioTask** audiofile_tasks;
   char const* user_library_path;
+  Library* library;
+  char const* task_trace_path; // empty when not tracing
 } MD2_UIState;
 
 
@@ -1197,6 +1651,11 @@ void md2_update(MD2_UserInterface* ui,
                 MD2_AudioState* audio_state,
                 TempAllocator* perframe_allocator)
 {
+  library_update(ui_state->library);
+
+  if (ui_state->task_trace_path[0] && ui->mu->keys[MU_F12].pressed)
+    md2_task_trace_write(ui_state->task_trace_path);
+
   size_t files_n = buf_len(ui_state->audiofile_tasks);
   size_t loaded_n = 0;
   size_t bytes_n = 0;
@@ -1205,7 +1664,8 @@ void md2_update(MD2_UserInterface* ui,
        task_i < task_l; task_i++)
   {
     LoadAudioTask* task = *task_i;
-    if (!task->success)
+    load_audio_task_update(task);
+    if (atomic_load_uint32(&task->state) != LoadAudioTask_Done)
       continue;
     loaded_n++;
     bytes_n += sizeof(task->float_stereo[0]) * task->float_stereo_n;
@@ -1236,6 +1696,20 @@ void md2_update(MD2_UserInterface* ui,
     "User Library %s%s", ui_state->user_library_path,
     !posix_is_dir(ui_state->user_library_path) ? " (offline)" : ""),
     row_y += line_size_y;
+  {
+    LibraryIndex const* library_index = ui_state->library->index;
+    uint32_t library_state = atomic_load_uint32(&ui_state->library->state);
+    col_x += small_size_x;
+    md2_ui_textf(
+      ui,
+      (MD2_UIElement){.rect = {.x0 = col_x, .x1 = bounds.x1, .y1 = row_y + font_size_y}},
+      "%s files indexed%s",
+      temp_str_nicenumber(library_index ? buf_len(library_index->files_buf) : 0,
+                          perframe_allocator),
+      library_state == Library_Done ? "" : " (indexing)"),
+      row_y += line_size_y;
+    col_x -= small_size_x;
+  }
   md2_ui_textf(
     ui,
     (MD2_UIElement){.rect = {.x0 = col_x, .x1 = bounds.x1, .y1 = row_y + font_size_y}},
@@ -1273,22 +1747,51 @@ void md2_update(MD2_UserInterface* ui,
   MD2_Rect2 splitter_rect = rect_right_abutting_size(col0_rect, splitter_size_x);
   MD2_Rect2 col1_rect = rect_right_abutting_extremity(splitter_rect, bounds.x1);
 
+  MD2_UIElement search_box_element = {
+    .rect = rect_intersection(
+      bounds, (MD2_Rect2){.x0 = col0_rect.x0,
+                          .x1 = col0_rect.x1,
+                          .y0 = col0_rect.y0,
+                          .y1 = col0_rect.y0 + line_size_y}),
+  };
   MD2_UIElement directory_listing_element = {
-    .rect = rect_intersection(bounds, col0_rect),
+    .rect = rect_intersection(
+      bounds, (MD2_Rect2){.x0 = col0_rect.x0,
+                          .x1 = col0_rect.x1,
+                          .y0 = search_box_element.rect.y1 + small_size_y / 2,
+                          .y1 = col0_rect.y1}),
   };
   {
+    static UILibrarySearch search = {0};
+    static MD2_UIScrollableContent search_results_content = {0};
+    static MD2_UIList search_results_list_state = {0};
+    ui_library_search_box(ui, search_box_element, &search);
+    if (search.query_changed)
+      map_clear(&search_results_list_state.selection_indices_set);
+    ui_library_search_update(&search, ui_state->library->index);
+
     static MD2_UIScrollableContent file_content = {0};
     static MD2_UIList file_list_state = {0};
     static char const* path = NULL;
     if (!path)
       path = ui_state->user_library_path;
-    DirectoryListingOperation result = ui_directory_listing(
-      ui, directory_listing_element, &file_list_state, &file_content, path);
-    if (result.next_directory_path)
+    if (search.index)
     {
-      if (path != ui_state->user_library_path)
-        free((char*)path);
-      path = result.next_directory_path;
+      ui_library_search_results(ui, directory_listing_element, &search_results_list_state,
+                                &search_results_content, &search, perframe_allocator);
+    }
+    else
+    {
+      DirectoryListingOperation result =
+        ui_directory_listing(ui, directory_listing_element, &file_list_state,
+                             &file_content, path, ui_state->library->index,
+                             perframe_allocator);
+      if (result.next_directory_path)
+      {
+        if (path != ui_state->user_library_path)
+          free((char*)path);
+        path = result.next_directory_path;
+      }
     }
   }
 
@@ -1333,11 +1836,12 @@ void md2_update(MD2_UserInterface* ui,
     MD2_UIRegion audiofile_list_content = {0};
     {
       float row_y = 0.0;
-      md2_ui_region_start(&audiofile_list_content);
+      md2_ui_region_start(&audiofile_list_content, perframe_allocator);
       for (size_t loaded_i = 0; loaded_i < buf_len(audiofile_tasks); loaded_i++)
       {
         LoadAudioTask const* task = audiofile_tasks[loaded_i];
-        if (!task->success)
+        if (atomic_load_uint32(&task->state) != LoadAudioTask_Done
+            && atomic_load_uint32(&task->ui_waveform.ready_n) == 0)
           continue;
         row_y += 10.0;
         md2_ui_region_add(&audiofile_list_content,
@@ -1365,7 +1869,8 @@ void md2_update(MD2_UserInterface* ui,
     for (size_t loaded_i = 0; loaded_i < buf_len(audiofile_tasks); loaded_i++)
     {
       LoadAudioTask const* task = audiofile_tasks[loaded_i];
-      if (!task->success)
+      bool task_is_done = atomic_load_uint32(&task->state) == LoadAudioTask_Done;
+      if (!task_is_done && atomic_load_uint32(&task->ui_waveform.ready_n) == 0)
         continue;
       MD2_UIElement element;
       if (md2_ui_scroller_get_element(ui, &audiofile_list, scroller_element,
@@ -1373,6 +1878,8 @@ void md2_update(MD2_UserInterface* ui,
                                       &element))
       {
         md2_ui_waveform(ui, element, &task->ui_waveform);
+        if (!task_is_done)
+          continue;
         if (rect_intersects(element.rect, ui->pointer.last_click_position)
             && ui->pointer.clicked)
         {
@@ -1447,13 +1954,18 @@ int md2_main(int argc, char const* argv[])
   test_iobuffer(argc, argv);
   test_queue(argc, argv);
   // md2:
+  test_library(argc, argv);
   test_serialisation(argc, argv);
   test_main(argc, argv);
   test_task(argc, argv);
+  test_thread(argc, argv);
   test_ui(argc, argv);
 
   char const* user_library_path = "";
+  char const* library_index_path = "md2_library_index.bin";
   char const* md1_song_path = "";
+  char const* task_trace_path = "";
+  char const* bench_name = "";
   for (char const **arg = &argv[0], **argl = &argv[argc]; arg != argl;)
   {
     if (0 == strcmp(*arg, "--quit"))
@@ -1465,15 +1977,45 @@ int md2_main(int argc, char const* argv[])
       arg++;
       user_library_path = *arg;
     }
+    else if (0 == strcmp(*arg, "--library-index"))
+    {
+      arg++;
+      library_index_path = *arg;
+    }
     else if (0 == strcmp(*arg, "--md1-song"))
     {
       arg++;
       md1_song_path = *arg;
     }
+    else if (0 == strcmp(*arg, "--task-trace"))
+    {
+      arg++;
+      task_trace_path = *arg;
+    }
+    else if (0 == strcmp(*arg, "--bench"))
+    {
+      arg++;
+      bench_name = *arg;
+    }
     arg++;
   }
 
-  task_init();
+  // benchmarks print their results (as JSON with --json) and exit
+  if (bench_name[0])
+  {
+    if (0 == strcmp(bench_name, "map"))
+      exit(bench_map(argc, argv));
+    if (0 == strcmp(bench_name, "queue"))
+      exit(bench_queue(argc, argv));
+    if (0 == strcmp(bench_name, "tasks"))
+      exit(bench_task(argc, argv));
+    md2_fatal("--bench <name> expected, one of: map, queue, tasks ('%s' not recognized)",
+              bench_name);
+  }
+
+  task_init_with_fibers(); // so that the library scan keeps many reads in flight
+  if (task_trace_path[0])
+    task_trace_enable(true);
 
   if (!posix_is_dir(user_library_path))
   {
@@ -1481,6 +2023,23 @@ int md2_main(int argc, char const* argv[])
               user_library_path);
   }
 
+  static Library library; // outlives the indexer tasks
+  {
+    bool rp_error;
+    char error_buffer[256];
+#if defined(_WIN32)
+    char* rp =
+      win32_realpath(user_library_path, &rp_error, error_buffer, sizeof error_buffer);
+#else
+    char* rp =
+      posix_realpath(user_library_path, &rp_error, error_buffer, sizeof error_buffer);
+#endif
+    if (rp_error)
+      md2_fatal("--user-library: %s", error_buffer);
+    library_start(&library, rp, library_index_path);
+    free(rp);
+  }
+
   g_audioengine = md2_audioengine_init();
   assert(g_audioengine);
 
@@ -1498,8 +2057,9 @@ int md2_main(int argc, char const* argv[])
     .mu = &mu,
     .vg = nvgCreateGL3(NVG_ANTIALIAS | NVG_STENCIL_STROKES),
     .overlay_vg = nvgCreateGL3(NVG_ANTIALIAS | NVG_STENCIL_STROKES),
+    .offscreen_vg = nvgCreateGL3(NVG_ANTIALIAS | NVG_STENCIL_STROKES),
   };
-  if (!ui.vg || !ui.overlay_vg)
+  if (!ui.vg || !ui.overlay_vg || !ui.offscreen_vg)
     md2_fatal("Init: NanoVG");
 
   {
@@ -1533,6 +2093,8 @@ int md2_main(int argc, char const* argv[])
   MD2_UIState ui_state = {
     .audiofile_tasks = audiofile_tasks,
     .user_library_path = user_library_path,
+    .library = &library,
+    .task_trace_path = task_trace_path,
   };
   audiofile_tasks = NULL;   // @moved_from
   user_library_path = NULL; // @moved_from
@@ -1544,7 +2106,7 @@ int md2_main(int argc, char const* argv[])
   while (Mu_Push(&mu), Mu_Pull(&mu))
   {
 
-    temp_allocator_free(&perframe_allocator);
+    temp_allocator_reset(&perframe_allocator);
     float px_ratio = get_window_metrics(&mu).device_px_per_ref_points;
     ui.pixel_ratio = px_ratio;
 
@@ -1557,6 +2119,12 @@ int md2_main(int argc, char const* argv[])
     is_first_frame = false;
   }
 
+  temp_allocator_free(&perframe_allocator);
+  directory_listings_free_all();
+  md2_ui_deinit(&ui);
+  library_deinit(&library);
+  if (task_trace_path[0])
+    md2_task_trace_write(task_trace_path);
   md2_audioengine_deinit(g_audioengine), g_audioengine = NULL;
 
   return 0;
@@ -1,5 +1,7 @@
 #include "md2_temp_allocator.h"
 
+#include "libs/xxxx_map.h"
+
 static inline bool region_fits(TempAllocatorRegion* region, size_t added_bytes_n)
 {
   return added_bytes_n <= (region->bytes_n - region->bytes_allocated);
@@ -16,6 +18,33 @@ void temp_allocator_free(TempAllocator* temp_allocator)
   buf_free(temp_allocator->regions), temp_allocator->regions = NULL;
 }
 
+void temp_allocator_reset(TempAllocator* temp_allocator)
+{
+  size_t regions_n = buf_len(temp_allocator->regions);
+  if (regions_n == 1)
+  {
+    TempAllocatorRegion* region = &temp_allocator->regions[0];
+    memset(region->bytes_f, 0, region->bytes_allocated);
+    region->bytes_allocated = 0;
+    return;
+  }
+  if (regions_n == 0)
+    return;
+
+  // allocations only come from the last region, so make one that fits them all
+  size_t bytes_n = 0;
+  for (size_t region_i = 0; region_i < regions_n; region_i++)
+  {
+    bytes_n += temp_allocator->regions[region_i].bytes_n;
+  }
+  temp_allocator_free(temp_allocator);
+  TempAllocatorRegion merged_region = {
+    .bytes_f = calloc(1, bytes_n),
+    .bytes_n = bytes_n,
+  };
+  buf_push(temp_allocator->regions, merged_region);
+}
+
 void* temp_calloc(TempAllocator* temp_allocator, size_t n, size_t element_size)
 {
   if (element_size * n == 0)
@@ -31,8 +60,7 @@ void* temp_calloc(TempAllocator* temp_allocator, size_t n, size_t element_size)
     round_up_multiple_of_pot_uintptr(needed_size, alignment);
 
   if (buf_len(temp_allocator->regions) == 0
-      || buf_end(temp_allocator->regions)[-1].bytes_allocated
-           == buf_end(temp_allocator->regions)[-1].bytes_n)
+      || !region_fits(&buf_end(temp_allocator->regions)[-1], aligned_needed_size))
   {
     size_t region_size = max_i(1024 * 1024, aligned_needed_size);
     TempAllocatorRegion new_region = {
@@ -60,3 +88,14 @@ static inline void* temp_memdup_range(TempAllocator* allocator,
   memcpy(dst, bytes_f, bytes_l - bytes_f);
   return dst;
 }
+
+static void* temp__map_calloc(void* allocator, size_t n, size_t element_size)
+{
+  return temp_calloc(allocator, n, element_size);
+}
+
+void temp_map_init(Map* map, TempAllocator* temp_allocator)
+{
+  assert(map->cap == 0);
+  *map = (Map){.allocator = {temp__map_calloc, temp_allocator}};
+}
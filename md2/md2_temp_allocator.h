@@ -14,9 +14,16 @@ typedef struct TempAllocator
 } TempAllocator;
 
 void temp_allocator_free(TempAllocator* temp_allocator);
+// Releases all allocations but keeps the memory, merged into a single region.
+void temp_allocator_reset(TempAllocator* temp_allocator);
 void* temp_calloc(TempAllocator* temp_allocator, size_t n, size_t element_size);
 
 void* temp_memdup_range(TempAllocator* allocator, void const* first, void const* last);
 
+// The map will take its arrays from the allocator, and must not be used anymore after
+// the allocator is reset or freed.
+struct Map;
+void temp_map_init(struct Map* map, TempAllocator* temp_allocator);
+
 
 #endif
@@ -1,8 +1,10 @@
 #include "md2_ui.h"
 
+#include "libs/xxxx_atomic.h"
 #include "libs/xxxx_buf.h"
 #include "libs/xxxx_map.h"
 
+#include <math.h>
 #include <stdarg.h>
 
 void md2_ui__update_pointer(MD2_Pointer* pointer,
@@ -70,6 +72,8 @@ void md2_ui__update_pointer(MD2_Pointer* pointer,
   }
 }
 
+static void md2_ui__waveform_images_collect(MD2_UserInterface* ui);
+
 void md2_ui_update(MD2_UserInterface* ui)
 {
   if (ui->double_click_max_seconds <= 0.0)
@@ -89,6 +93,9 @@ void md2_ui_update(MD2_UserInterface* ui)
   ui->bounds = rect_from_point_size((MD2_Point2){0, 0}, ui->size);
   md2_ui__update_pointer(&ui->pointer, ui, mu);
 
+  ui->frame_index++;
+  md2_ui__waveform_images_collect(ui);
+
   nvgBeginFrame(ui->overlay_vg, ui->size.x, ui->size.y, ui->pixel_ratio);
   nvgBeginFrame(ui->vg, ui->size.x, ui->size.y, ui->pixel_ratio);
   ui->frame_started = true;
@@ -302,22 +309,20 @@ void md2_ui_rect(MD2_UserInterface* ui, MD2_UIElement element, NVGcolor color)
   nvgFill(vg);
 }
 
-void md2_ui_waveform(MD2_UserInterface* ui,
-                     MD2_UIElement element,
-                     WaveformData const* waveform)
+// Draws the waveform layers, each as one path following the buckets' outline.
+static void md2_ui__waveform_paths(NVGcontext* vg,
+                                   MD2_Rect2 rect,
+                                   WaveformData const* waveform,
+                                   size_t ready_n)
 {
-  if (!rects_intersect(ui->bounds, element.rect))
-    return;
-  float top_y = element.rect.y0;
-  float left_x = element.rect.x0;
-  float size_x = element.rect.x1 - element.rect.x0;
-  float size_y = element.rect.y1 - element.rect.y0;
+  float top_y = rect.y0;
+  float left_x = rect.x0;
+  float size_x = rect.x1 - rect.x0;
+  float size_y = rect.y1 - rect.y0;
   float halfsize_y = size_y / 2.0f;
   float inc_x = size_x / waveform->len_pot;
   float mid_y = top_y + halfsize_y;
-
-
-  NVGcontext* vg = md2_ui_vg(ui, element);
+  float ready_x = left_x + ready_n * inc_x;
 
   NVGcolor color = nvgRGBA(255, 192, 255, 160);
   NVGcolor red_color = nvgRGBA(255, 40, 60, 160);
@@ -330,63 +335,38 @@ void md2_ui_waveform(MD2_UserInterface* ui,
     nvgLinearGradient(vg, left_x, mid_y, left_x, mid_y - halfsize_y, color, red_color);
 
   float c_x;
-  c_x = left_x;
-
-  MD2_Rect2 intersecting_rect = {0};
-  size_t intersecting_chunk_index;
-  for (size_t chunk_index = 0; chunk_index < waveform->len_pot;
-       chunk_index++, c_x += inc_x)
-  {
-    MD2_Rect2 rect = {.x0 = c_x,
-                      .x1 = max_f(c_x + 1, c_x + inc_x),
-                      .y0 = element.rect.y0,
-                      .y1 = element.rect.y1};
-    if (rect_intersects(rect, ui->pointer.position))
-    {
-      intersecting_chunk_index = chunk_index;
-      intersecting_rect = rect;
-    }
-    if (c_x > ui->pointer.position.x)
-      break;
-  }
-
-  if (intersecting_rect.x0 != intersecting_rect.x1)
-  {
-    md2_ui_rect(
-      ui, (MD2_UIElement){.rect = intersecting_rect}, nvgRGBA(255, 255, 255, 128));
-    md2_ui_textf(
-      ui,
-      (MD2_UIElement){.layer = 1, .rect = {.x0 = intersecting_rect.x0 + 10, .y1 = mid_y}},
-      "[%f, %f]", waveform->min[intersecting_chunk_index],
-      waveform->max[intersecting_chunk_index]);
-  }
 
   nvgBeginPath(vg);
+  nvgMoveTo(vg, left_x, mid_y);
   c_x = left_x;
-  for (size_t chunk_index = 0; chunk_index < waveform->len_pot;
-       chunk_index++, c_x += inc_x)
+  for (size_t chunk_index = 0; chunk_index < ready_n; chunk_index++, c_x += inc_x)
   {
-    float size_y = -halfsize_y * waveform->min[chunk_index];
-    nvgRect(vg, c_x, mid_y, inc_x, size_y);
+    float y = mid_y - halfsize_y * waveform->min[chunk_index];
+    nvgLineTo(vg, c_x, y);
+    nvgLineTo(vg, c_x + inc_x, y);
   }
+  nvgLineTo(vg, ready_x, mid_y);
+  nvgClosePath(vg);
   nvgFillPaint(vg, min_gradient);
   nvgFill(vg);
 
   nvgBeginPath(vg);
+  nvgMoveTo(vg, left_x, mid_y);
   c_x = left_x;
-  for (size_t chunk_index = 0; chunk_index < waveform->len_pot;
-       chunk_index++, c_x += inc_x)
+  for (size_t chunk_index = 0; chunk_index < ready_n; chunk_index++, c_x += inc_x)
   {
-    float size_y = -halfsize_y * waveform->max[chunk_index];
-    nvgRect(vg, c_x, mid_y, inc_x, size_y);
+    float y = mid_y - halfsize_y * waveform->max[chunk_index];
+    nvgLineTo(vg, c_x, y);
+    nvgLineTo(vg, c_x + inc_x, y);
   }
+  nvgLineTo(vg, ready_x, mid_y);
+  nvgClosePath(vg);
   nvgFillPaint(vg, max_gradient);
   nvgFill(vg);
 
   nvgBeginPath(vg);
   c_x = left_x;
-  for (size_t chunk_index = 0; chunk_index < waveform->len_pot;
-       chunk_index++, c_x += inc_x)
+  for (size_t chunk_index = 0; chunk_index < ready_n; chunk_index++, c_x += inc_x)
   {
     if (waveform->min[chunk_index] < -1.0f || waveform->max[chunk_index] > 1.0f)
     {
@@ -398,19 +378,211 @@ void md2_ui_waveform(MD2_UserInterface* ui,
   nvgFillColor(vg, red_color);
   nvgFill(vg);
 
+  // rms: top outline from left to right, then bottom outline from right to left
   nvgBeginPath(vg);
+  nvgMoveTo(vg, left_x, mid_y);
   c_x = left_x;
-  for (size_t chunk_index = 0; chunk_index < waveform->len_pot;
-       chunk_index++, c_x += inc_x)
+  for (size_t chunk_index = 0; chunk_index < ready_n; chunk_index++, c_x += inc_x)
+  {
+    float y = mid_y - halfsize_y * waveform->rms[chunk_index];
+    nvgLineTo(vg, c_x, y);
+    nvgLineTo(vg, c_x + inc_x, y);
+  }
+  for (size_t chunk_index = ready_n; chunk_index-- > 0;)
   {
-    float min_y = halfsize_y * waveform->rms[chunk_index];
-    float max_y = -halfsize_y * waveform->rms[chunk_index];
-    nvgRect(vg, c_x, mid_y + min_y, inc_x, max_y - min_y);
+    c_x -= inc_x;
+    float y = mid_y + halfsize_y * waveform->rms[chunk_index];
+    nvgLineTo(vg, c_x + inc_x, y);
+    nvgLineTo(vg, c_x, y);
   }
+  nvgClosePath(vg);
   nvgFillColor(vg, rms_color);
   nvgFill(vg);
 }
 
+enum
+{
+  MD2_UI_WAVEFORM_IMAGE_MAX_UNUSED_FRAMES = 120,
+};
+
+// Waveform rendered once into an image, then drawn as a single quad for as long as
+// neither the waveform nor its size change.
+typedef struct MD2_UIWaveformImage
+{
+  WaveformData const* waveform;
+  float const* waveform_min; // to detect a different waveform at the same address
+  NVGcontext* vg;             // the context drawing the image, which owns it
+  uint32_t ready_n;
+  int size_x_px;
+  int size_y_px;
+  float pixel_ratio;
+  uint64_t last_used_frame_index;
+  NVGLUframebuffer* framebuffer;
+} MD2_UIWaveformImage;
+
+static void md2_ui__waveform_images_reindex(MD2_UserInterface* ui)
+{
+  map_clear(&ui->waveform_image_index_by_waveform);
+  for (size_t image_i = 0; image_i < buf_len(ui->waveform_images_buf); image_i++)
+  {
+    map_put(&ui->waveform_image_index_by_waveform,
+            hash_ptr(ui->waveform_images_buf[image_i].waveform),
+            (void*)(uintptr_t)(image_i + 1));
+  }
+}
+
+// Frees the images of waveforms that have not been drawn for a while.
+static void md2_ui__waveform_images_collect(MD2_UserInterface* ui)
+{
+  MD2_UIWaveformImage* images = ui->waveform_images_buf;
+  size_t kept_n = 0;
+  for (size_t image_i = 0; image_i < buf_len(images); image_i++)
+  {
+    if (images[image_i].last_used_frame_index + MD2_UI_WAVEFORM_IMAGE_MAX_UNUSED_FRAMES
+        < ui->frame_index)
+    {
+      nvgluDeleteFramebuffer(images[image_i].framebuffer);
+      continue;
+    }
+    images[kept_n++] = images[image_i];
+  }
+  if (kept_n == buf_len(images))
+    return;
+  buf_truncate(images, kept_n);
+  md2_ui__waveform_images_reindex(ui);
+}
+
+void md2_ui_deinit(MD2_UserInterface* ui)
+{
+  for (size_t image_i = 0; image_i < buf_len(ui->waveform_images_buf); image_i++)
+  {
+    nvgluDeleteFramebuffer(ui->waveform_images_buf[image_i].framebuffer);
+  }
+  buf_free(ui->waveform_images_buf);
+  map_free(&ui->waveform_image_index_by_waveform);
+}
+
+static MD2_UIWaveformImage* md2_ui__waveform_image(MD2_UserInterface* ui,
+                                                   NVGcontext* vg,
+                                                   MD2_Vec2 size,
+                                                   WaveformData const* waveform)
+{
+  int size_x_px = (int)ceilf(size.x * ui->pixel_ratio);
+  int size_y_px = (int)ceilf(size.y * ui->pixel_ratio);
+  if (size_x_px <= 0 || size_y_px <= 0)
+    return NULL;
+
+  size_t image_index = (size_t)map_get(&ui->waveform_image_index_by_waveform,
+                                       hash_ptr(waveform));
+  if (image_index == 0)
+  {
+    buf_push(ui->waveform_images_buf, (MD2_UIWaveformImage){.waveform = waveform});
+    image_index = buf_len(ui->waveform_images_buf);
+    map_put(&ui->waveform_image_index_by_waveform, hash_ptr(waveform),
+            (void*)(uintptr_t)image_index);
+  }
+  MD2_UIWaveformImage* image = &ui->waveform_images_buf[image_index - 1];
+  assert(image->waveform == waveform);
+  image->last_used_frame_index = ui->frame_index;
+
+  uint32_t ready_n = atomic_load_uint32(&waveform->ready_n);
+  if (image->framebuffer && image->vg == vg && image->size_x_px == size_x_px
+      && image->size_y_px == size_y_px && image->pixel_ratio == ui->pixel_ratio
+      && image->ready_n == ready_n && image->waveform_min == waveform->min)
+  {
+    return image;
+  }
+
+  // images are only valid in the context that created them
+  if (!image->framebuffer || image->vg != vg || image->size_x_px != size_x_px
+      || image->size_y_px != size_y_px)
+  {
+    nvgluDeleteFramebuffer(image->framebuffer);
+    image->framebuffer = nvgluCreateFramebuffer(vg, size_x_px, size_y_px, 0);
+    image->vg = vg;
+    if (!image->framebuffer)
+      return NULL;
+  }
+  image->waveform_min = waveform->min;
+  image->ready_n = ready_n;
+  image->size_x_px = size_x_px;
+  image->size_y_px = size_y_px;
+  image->pixel_ratio = ui->pixel_ratio;
+
+  // render the image, the main contexts only render at the end of the frame so this
+  // does not interfere with what's being drawn.
+  NVGcontext* offscreen_vg = ui->offscreen_vg;
+  nvgluBindFramebuffer(image->framebuffer);
+  glViewport(0, 0, size_x_px, size_y_px);
+  glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+  glClear(GL_COLOR_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+  nvgBeginFrame(offscreen_vg, size_x_px / ui->pixel_ratio, size_y_px / ui->pixel_ratio,
+                ui->pixel_ratio);
+  md2_ui__waveform_paths(
+    offscreen_vg, rect_from_point_size((MD2_Point2){0, 0}, size), waveform, ready_n);
+  nvgEndFrame(offscreen_vg);
+  nvgluBindFramebuffer(NULL);
+  glViewport(0, 0, ui->mu->window.size.x, ui->mu->window.size.y);
+  return image;
+}
+
+void md2_ui_waveform(MD2_UserInterface* ui,
+                     MD2_UIElement element,
+                     WaveformData const* waveform)
+{
+  if (!rects_intersect(ui->bounds, element.rect))
+    return;
+  float top_y = element.rect.y0;
+  float left_x = element.rect.x0;
+  float size_x = element.rect.x1 - element.rect.x0;
+  float size_y = element.rect.y1 - element.rect.y0;
+  float halfsize_y = size_y / 2.0f;
+  float inc_x = size_x / waveform->len_pot;
+  float mid_y = top_y + halfsize_y;
+  size_t ready_n = atomic_load_uint32(&waveform->ready_n); // may still be loading
+
+  NVGcontext* vg = md2_ui_vg(ui, element);
+
+  if (ui->pointer.position.x >= left_x && ui->pointer.position.x < left_x + size_x
+      && rect_intersects(element.rect, ui->pointer.position))
+  {
+    size_t intersecting_chunk_index = (ui->pointer.position.x - left_x) / inc_x;
+    if (intersecting_chunk_index < ready_n)
+    {
+      float c_x = left_x + intersecting_chunk_index * inc_x;
+      MD2_Rect2 intersecting_rect = {.x0 = c_x,
+                                     .x1 = max_f(c_x + 1, c_x + inc_x),
+                                     .y0 = element.rect.y0,
+                                     .y1 = element.rect.y1};
+      md2_ui_rect(
+        ui, (MD2_UIElement){.rect = intersecting_rect}, nvgRGBA(255, 255, 255, 128));
+      md2_ui_textf(
+        ui,
+        (MD2_UIElement){.layer = 1,
+                        .rect = {.x0 = intersecting_rect.x0 + 10, .y1 = mid_y}},
+        "[%f, %f]", waveform->min[intersecting_chunk_index],
+        waveform->max[intersecting_chunk_index]);
+    }
+  }
+
+  MD2_UIWaveformImage const* image =
+    ui->offscreen_vg
+      ? md2_ui__waveform_image(ui, vg, (MD2_Vec2){size_x, size_y}, waveform)
+      : NULL;
+  if (!image)
+  {
+    md2_ui__waveform_paths(vg, element.rect, waveform, ready_n);
+    return;
+  }
+
+  NVGpaint image_paint = nvgImagePattern(
+    vg, left_x, top_y, size_x, size_y, 0.0f, image->framebuffer->image, 1.0f);
+  nvgBeginPath(vg);
+  nvgRect(vg, left_x, top_y, size_x, size_y);
+  nvgFillPaint(vg, image_paint);
+  nvgFill(vg);
+}
+
 static void test_allocate_many_recursive(MD2_ElementAllocator* scope,
                                          int n,
                                          int depth,
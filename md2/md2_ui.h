@@ -72,11 +72,17 @@ typedef struct MD2_UserInterface
   uint64_t hot_element;
   uint64_t active_element;
   struct Map* elements_map;
+  uint64_t frame_index;
+
+  // Caches
+  struct MD2_UIWaveformImage* waveform_images_buf;
+  Map waveform_image_index_by_waveform; // to 1 + index in waveform_images_buf
 
   // Low-level
-  struct Mu* mu;                 // input & low-level output
-  struct NVGcontext* vg;         // nvg canvas
-  struct NVGcontext* overlay_vg; // overlay for drag images
+  struct Mu* mu;                    // input & low-level output
+  struct NVGcontext* vg;            // nvg canvas
+  struct NVGcontext* overlay_vg;    // overlay for drag images
+  struct NVGcontext* offscreen_vg;  // to render cached images, optional
   bool frame_started;
 } MD2_UserInterface;
 
@@ -107,6 +113,7 @@ typedef struct MD2_ElementAllocator
 } MD2_ElementAllocator;
 
 void md2_ui_update(MD2_UserInterface* ui);
+void md2_ui_deinit(MD2_UserInterface* ui);
 
 void* md2_ui_alloc(size_t size);
 void md2_ui_free(void* ptr);